@@ -0,0 +1,1089 @@
+/***********************************************************************
+RfbBenchmark - Measures the client side of librfb without a server or
+Vrui: how the reader reacts when the server stalls or goes away, the
+latency with which it handles server messages and the throughput of the
+ZRLE and pixel conversion kernels.
+Copyright (c) 2007,2008 Voltaic
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation; either version 2 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+// Usage: RfbBenchmark [stall [runs] | latency [numMessages] | zrle | pixels]
+//
+// A fake server on the loopback interface feeds two readers: an
+// RFBProtocol, whose reader blocks in poll(), and a copy of the read()/
+// usleep() loop that checkAvailableFromRFBServer() used before.
+//
+// stall: the server sends half of a FramebufferUpdate header and then
+// closes its end of the connection, as a server that dies in the middle
+// of an update does.  For each reader, the time until it gives up on the
+// connection, the read() calls and CPU time it spends meanwhile, and,
+// if it has not given up after STALL_WINDOW_MSEC, the time close() then
+// takes to get it back are reported.  Also reported is the time close()
+// takes to wake up a reader that is waiting for the next message of a
+// server that is still alive.
+//
+// latency: the server sends Bell messages at random intervals of up to
+// 2 ms, and the delay from send() to the message being handled and the
+// CPU time used by the reading thread are reported.  This is the steady
+// state, in which both readers block in the kernel, so it shows what the
+// poll() costs on top of a plain blocking read().
+//
+// zrle: decodes the rows of a 64x64 ZRLE tile with each ZrleKernels level
+// the CPU supports: packed palettes of 1, 2 and 4 bits per index, a 127
+// colour palette with one index per byte and plain runs of various
+// lengths, each for 8, 16 and 32-bit pixels, and raw and 16 colour
+// palette tiles of the 3-byte 24A and 24B pixels.
+//
+// pixels: converts a 1920x1080 frame to RGB row by row with the Converter
+// PixelKernels::getConverter() returns at each level the CPU supports,
+// for the common pixel layouts and two that take the generic path, and
+// with the per-pixel loop copyRectData() used before for comparison.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <vector>
+#include <algorithm>
+
+#include "librfb/rfbproto.h"
+#include "librfb/zrlekernels.h"
+#include "librfb/pixelkernels.h"
+
+using namespace rfb;
+
+enum { STALL_WINDOW_MSEC = 500 };
+
+
+
+//----------------------------------------------------------------------
+// Timing helpers
+
+static long long ClockUsec(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ((long long)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+static long long NowUsec()
+{
+    return ClockUsec(CLOCK_MONOTONIC);
+}
+
+// Runs body until at least 200 ms have passed and returns the time per run.
+template <class Body>
+static double UsecPerRun(Body& body)
+{
+    int       runs  = 0;
+    long long start = NowUsec();
+    long long elapsed;
+
+    do
+    {
+        for (int i = 0; i < 100; i++)
+            body();
+        runs   += 100;
+        elapsed = NowUsec() - start;
+    } while (elapsed < 200000);
+
+    return (double)elapsed / runs;
+}
+
+static void PrintLatencies(const char* name, std::vector<long long> latencies, long long cpuUsec)
+{
+    if (latencies.empty())
+    {
+        printf("  %-22s no messages received\n", name);
+        return;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+
+    long long sum = 0;
+    for (size_t i = 0; i < latencies.size(); i++)
+        sum += latencies[i];
+
+    printf( "  %-22s mean %6lld us  median %6lld us  p99 %6lld us  max %6lld us  reader CPU %7.1f ms\n",
+            name,
+            sum / (long long)latencies.size(),
+            latencies[latencies.size() / 2],
+            latencies[(latencies.size() * 99) / 100],
+            latencies.back(),
+            cpuUsec / 1000.0 );
+}
+
+
+
+//----------------------------------------------------------------------
+// Fake server
+
+struct FakeServer
+{
+    enum Script
+    {
+        SCRIPT_BELLS = 0,  // send numMessages Bell messages
+        SCRIPT_STALL,      // send half a FramebufferUpdate header, then shut down the sending side
+        SCRIPT_IDLE        // send nothing
+    };
+
+    int                     listenSock;
+    int                     sock;
+    bool                    sendHandshake;  // answer the handshake of an RFBProtocol
+    Script                  script;
+    int                     numMessages;
+    std::vector<long long>  sendTimes;
+    long long               stallTime;      // when the sending side was shut down
+    volatile bool           done;           // set by main() once the reader has returned
+
+    static int   Listen(unsigned& rfbPort);  // returns a socket listening on the loopback interface at rfbPort + CONNECT_PORT_OFFSET
+    static void* run(void* arg);
+};
+
+static bool WriteAll(int sock, const void* buf, size_t n)
+{
+    while (n > 0)
+    {
+        const ssize_t ne = write(sock, buf, n);
+        if (ne <= 0)
+            return false;
+        buf = (const char*)buf + ne;
+        n  -= ne;
+    }
+
+    return true;
+}
+
+int FakeServer::Listen(unsigned& rfbPort)  // static method
+{
+    const int s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s < 0)
+        return -1;
+
+    const int one = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    // Desktop numbers 50-99 are unlikely to be taken by a real server:
+    for (rfbPort = 50; rfbPort < 100; rfbPort++)
+    {
+        struct sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family      = AF_INET;
+        address.sin_port        = htons(rfbPort + 5900);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        if ((bind(s, (struct sockaddr*)&address, sizeof(address)) == 0) && (listen(s, 1) == 0))
+            return s;
+    }
+
+    close(s);
+    return -1;
+}
+
+void* FakeServer::run(void* arg)  // static method
+{
+    FakeServer* const server = (FakeServer*)arg;
+
+    server->sock = accept(server->listenSock, 0, 0);
+    if (server->sock < 0)
+        return 0;
+
+    // Send each message at once, as VNC servers do:
+    const int one = 1;
+    setsockopt(server->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (server->sendHandshake)
+    {
+        // RFB 3.3 without authentication and a 16x16 desktop; the client
+        // messages are left unread in the socket buffer:
+        char pv[sz_rfbProtocolVersionMsg+1];
+        sprintf(pv, rfbProtocolVersionFormat, rfbProtocolMajorVersion, rfbProtocolMinorVersion);
+
+        const rfbCARD32 authScheme = Swap32IfLE(rfbNoAuth);
+
+        rfbServerInitMsg si;
+        memset(&si, 0, sizeof(si));
+        si.framebufferWidth  = Swap16IfLE(16);
+        si.framebufferHeight = Swap16IfLE(16);
+        si.format.bitsPerPixel = 32;
+        si.format.depth        = 24;
+        si.format.trueColour   = 1;
+        si.format.redMax       = Swap16IfLE(255);
+        si.format.greenMax     = Swap16IfLE(255);
+        si.format.blueMax      = Swap16IfLE(255);
+        si.format.redShift     = 16;
+        si.format.greenShift   = 8;
+        si.format.blueShift    = 0;
+        si.nameLength          = Swap32IfLE(5);
+
+        if ( !WriteAll(server->sock, pv, sz_rfbProtocolVersionMsg) ||
+             !WriteAll(server->sock, &authScheme, sizeof(authScheme)) ||
+             !WriteAll(server->sock, &si, sz_rfbServerInitMsg) ||
+             !WriteAll(server->sock, "bench", 5) )
+        {
+            return 0;
+        }
+    }
+
+    usleep(50000);  // let the reader settle
+
+    switch (server->script)
+    {
+        case SCRIPT_BELLS:
+        {
+            unsigned seed = 1;
+            for (int i = 0; i < server->numMessages; i++)
+            {
+                usleep(rand_r(&seed) % 2000);
+
+                const rfbCARD8 bell = rfbBell;
+                server->sendTimes.push_back(NowUsec());
+                if (!WriteAll(server->sock, &bell, sizeof(bell)))
+                    break;
+            }
+        }
+        break;
+
+        case SCRIPT_STALL:
+        {
+            const rfbCARD8 header[2] = { rfbFramebufferUpdate, 0 };  // nRects is missing
+            WriteAll(server->sock, header, sizeof(header));
+            usleep(20000);
+
+            server->stallTime = NowUsec();
+            shutdown(server->sock, SHUT_WR);
+        }
+        break;
+
+        case SCRIPT_IDLE:
+            break;
+    }
+
+    // Keep the connection until the reader is done with it:
+    while (!server->done)
+        usleep(1000);
+
+    return 0;
+}
+
+
+
+//----------------------------------------------------------------------
+// Readers
+
+struct Reader
+{
+    std::vector<long long> receiveTimes;  // of the Bell messages
+    long long              cpuUsec;       // CPU time of the reading thread
+    long long              returnTime;    // when the reader gave up on the connection
+    long long              readCalls;     // read() calls made by the old loop; not counted for RFBProtocol
+
+    Reader() : cpuUsec(0), returnTime(0), readCalls(0) {}
+};
+
+// The client using RFBProtocol's reader:
+class BenchmarkProtocol : public RFBProtocol
+{
+public:
+    Reader reader;
+
+    static void* run(void* arg);
+
+protected:
+    virtual bool receivedSetColourMapEntries(const rfbSetColourMapEntriesMsg& msg) { return false; }
+    virtual bool receivedBell(const rfbBellMsg& msg)                               { reader.receiveTimes.push_back(NowUsec()); return true; }
+    virtual bool receivedServerCutText(const rfbServerCutTextMsg& msg)             { return false; }
+
+    virtual void copyRectData(void* data, int x, int y, size_t w, size_t h)           {}
+    virtual void copyRect(int fromX, int fromY, int toX, int toY, size_t w, size_t h) {}
+    virtual void fillRect(rfbCARD32 color, int x, int y, size_t w, size_t h)          {}
+
+    virtual char* returnPassword() { return 0; }
+};
+
+void* BenchmarkProtocol::run(void* arg)  // static method
+{
+    BenchmarkProtocol* const protocol = (BenchmarkProtocol*)arg;
+
+    const long long cpuStart = ClockUsec(CLOCK_THREAD_CPUTIME_ID);
+    while (protocol->handleRFBServerMessage())
+        ;
+    protocol->reader.returnTime = NowUsec();
+    protocol->reader.cpuUsec    = ClockUsec(CLOCK_THREAD_CPUTIME_ID) - cpuStart;
+
+    return 0;
+}
+
+// The client using a copy of the read()/usleep() loop that
+// checkAvailableFromRFBServer() used before, and of the way close()
+// stopped it:
+struct LegacyProtocol
+{
+    enum { COMM_BUFFER_SIZE = 4096 };
+
+    Reader        reader;
+    int           sock;
+    volatile bool isOpen;
+    char          commBuffer[COMM_BUFFER_SIZE];
+    size_t        commBufferPos;
+    size_t        commBufferFill;
+
+    LegacyProtocol() : sock(-1), isOpen(false), commBufferPos(0), commBufferFill(0) {}
+
+    bool checkAvailableFromRFBServer(size_t n)
+    {
+        if (commBufferPos > 0)
+        {
+            memmove(commBuffer, commBuffer+commBufferPos, commBufferFill-commBufferPos);
+
+            commBufferFill -= commBufferPos;
+            commBufferPos = 0;
+        }
+
+        bool lastReadReturnedZeroBytes = false;
+
+        while (n > commBufferFill)
+        {
+            const int ne = read(sock, commBuffer+commBufferFill, COMM_BUFFER_SIZE-commBufferFill);
+            reader.readCalls++;
+
+            if (!isOpen || (ne < 0))
+            {
+                return false;
+            }
+            else if (ne == 0)
+            {
+                if (lastReadReturnedZeroBytes)
+                    usleep(1000);
+
+                lastReadReturnedZeroBytes = true;
+            }
+            else
+            {
+                commBufferFill += (size_t)ne;
+
+                lastReadReturnedZeroBytes = false;
+            }
+        }
+
+        return true;
+    }
+
+    bool readFromRFBServer(void* buf, size_t n)
+    {
+        if (!checkAvailableFromRFBServer(n))
+            return false;
+
+        memcpy(buf, commBuffer+commBufferPos, n);
+        commBufferPos += n;
+
+        return true;
+    }
+
+    // Reads Bell messages, and FramebufferUpdate headers without rectangles:
+    bool handleRFBServerMessage()
+    {
+        rfbCARD8 type;
+        if (!readFromRFBServer(&type, 1))
+            return false;
+        else if (type == rfbBell)
+        {
+            reader.receiveTimes.push_back(NowUsec());
+            return true;
+        }
+        else if (type == rfbFramebufferUpdate)
+        {
+            rfbCARD8 rest[sz_rfbFramebufferUpdateMsg-1];
+            return readFromRFBServer(rest, sizeof(rest));
+        }
+        else
+            return false;
+    }
+
+    void close()
+    {
+        isOpen = false;
+        shutdown(sock, SHUT_RDWR);  // the socket itself is closed once the reader is gone
+    }
+
+    static void* run(void* arg);
+};
+
+void* LegacyProtocol::run(void* arg)  // static method
+{
+    LegacyProtocol* const protocol = (LegacyProtocol*)arg;
+
+    const long long cpuStart = ClockUsec(CLOCK_THREAD_CPUTIME_ID);
+    while (protocol->handleRFBServerMessage())
+        ;
+    protocol->reader.returnTime = NowUsec();
+    protocol->reader.cpuUsec    = ClockUsec(CLOCK_THREAD_CPUTIME_ID) - cpuStart;
+
+    return 0;
+}
+
+
+
+//----------------------------------------------------------------------
+// Benchmark sessions
+
+// What one reader did in a session with the fake server:
+struct Session
+{
+    bool                   ok;
+    Reader                 reader;
+    std::vector<long long> sendTimes;
+    long long              stallTime;
+    long long              closeTime;  // when close() was called; 0 if the reader returned by itself
+
+    Session() : ok(false), stallTime(0), closeTime(0) {}
+};
+
+// Runs script against one reader.  The reader is closed once it has run
+// for windowMsec after the script (or right away if closeAtOnce), unless
+// it has given up on the connection before.
+static Session RunSession(bool legacy, FakeServer::Script script, int numMessages, int windowMsec, bool closeAtOnce)
+{
+    Session session;
+
+    unsigned   rfbPort;
+    FakeServer server;
+    server.listenSock    = FakeServer::Listen(rfbPort);
+    server.sock          = -1;
+    server.sendHandshake = !legacy;
+    server.script        = script;
+    server.numMessages   = numMessages;
+    server.stallTime     = 0;
+    server.done          = false;
+
+    if (server.listenSock < 0)
+        return session;
+
+    pthread_t serverThread;
+    pthread_create(&serverThread, 0, FakeServer::run, &server);
+
+    BenchmarkProtocol* protocol = 0;
+    LegacyProtocol*    legacyProtocol = 0;
+    pthread_t          readerThread;
+    const Reader*      reader = 0;
+
+    if (!legacy)
+    {
+        protocol = new BenchmarkProtocol;
+        if (protocol->initViaConnect("127.0.0.1", rfbPort, protocol->getPixelFormat(), 0, false))
+        {
+            pthread_create(&readerThread, 0, BenchmarkProtocol::run, protocol);
+            reader = &protocol->reader;
+        }
+    }
+    else
+    {
+        legacyProtocol = new LegacyProtocol;
+
+        struct sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family      = AF_INET;
+        address.sin_port        = htons(rfbPort + 5900);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        legacyProtocol->sock = socket(AF_INET, SOCK_STREAM, 0);
+        if ((legacyProtocol->sock >= 0) && (connect(legacyProtocol->sock, (struct sockaddr*)&address, sizeof(address)) == 0))
+        {
+            legacyProtocol->isOpen = true;
+            pthread_create(&readerThread, 0, LegacyProtocol::run, legacyProtocol);
+            reader = &legacyProtocol->reader;
+        }
+    }
+
+    if (reader)
+    {
+        // Wait for the script to finish, then give the reader windowMsec:
+        if (script == FakeServer::SCRIPT_BELLS)
+            while (((int)server.sendTimes.size() < numMessages) || (reader->receiveTimes.size() < server.sendTimes.size()))
+                usleep(1000);
+        else if (script == FakeServer::SCRIPT_STALL)
+            while (!server.stallTime)
+                usleep(1000);
+        else
+            usleep(100000);
+
+        const long long deadline = NowUsec() + ((closeAtOnce ? 0 : windowMsec) * 1000LL);
+        while (!reader->returnTime && (NowUsec() < deadline))
+            usleep(1000);
+
+        if (!reader->returnTime)
+        {
+            session.closeTime = NowUsec();
+            if (protocol)
+                protocol->close();
+            else
+                legacyProtocol->close();
+        }
+
+        pthread_join(readerThread, 0);
+
+        session.ok        = true;
+        session.reader    = *reader;
+        session.sendTimes = server.sendTimes;
+        session.stallTime = server.stallTime;
+    }
+    else
+        shutdown(server.listenSock, SHUT_RDWR);  // in case accept() still waits
+
+    server.done = true;
+    pthread_join(serverThread, 0);
+
+    delete protocol;
+    if (legacyProtocol)
+    {
+        if (legacyProtocol->sock >= 0)
+            close(legacyProtocol->sock);
+        delete legacyProtocol;
+    }
+    if (server.sock >= 0)
+        close(server.sock);
+    close(server.listenSock);
+
+    return session;
+}
+
+
+
+//----------------------------------------------------------------------
+// Benchmarks
+
+static const char* const ReaderNames[2] = { "poll() reader", "read()/usleep() loop" };
+
+static bool BenchmarkStall(int runs)
+{
+    bool result = true;
+
+    printf("Reader stall: the server stops in the middle of a message and closes its end (%d runs):\n", runs);
+
+    for (int legacy = 0; legacy < 2; legacy++)
+    {
+        int       gaveUp = 0;
+        long long gaveUpUsec = 0, closeUsec = 0, cpuUsec = 0, readCalls = 0;
+
+        for (int run = 0; run < runs; run++)
+        {
+            const Session session = RunSession(legacy != 0, FakeServer::SCRIPT_STALL, 0, STALL_WINDOW_MSEC, false);
+            if (!session.ok)
+            {
+                result = false;
+                continue;
+            }
+
+            if (!session.closeTime)
+            {
+                gaveUp++;
+                gaveUpUsec += session.reader.returnTime - session.stallTime;
+            }
+            else
+                closeUsec += session.reader.returnTime - session.closeTime;
+
+            cpuUsec   += session.reader.cpuUsec;
+            readCalls += session.reader.readCalls;
+        }
+
+        printf("  %-22s gave up by itself in %d of %d runs", ReaderNames[legacy], gaveUp, runs);
+        if (gaveUp > 0)
+            printf(", after %lld us", gaveUpUsec / gaveUp);
+        if (gaveUp < runs)
+            printf(", %d ms later close() got it back in %lld us", (int)STALL_WINDOW_MSEC, closeUsec / (runs - gaveUp));
+        if (legacy)
+            printf(", %lld read() calls", readCalls / runs);
+        printf(", reader CPU %.1f ms\n", (cpuUsec / runs) / 1000.0);
+    }
+
+    printf("Reader wakeup: close() while the reader waits for the next message (%d runs):\n", runs);
+
+    for (int legacy = 0; legacy < 2; legacy++)
+    {
+        std::vector<long long> wakeups;
+
+        for (int run = 0; run < runs; run++)
+        {
+            const Session session = RunSession(legacy != 0, FakeServer::SCRIPT_IDLE, 0, 0, true);
+            if (!session.ok || !session.closeTime)
+                result = false;
+            else
+                wakeups.push_back(session.reader.returnTime - session.closeTime);
+        }
+
+        PrintLatencies(ReaderNames[legacy], wakeups, 0);
+    }
+
+    return result;
+}
+
+static std::vector<long long> Latencies(const std::vector<long long>& sendTimes, const std::vector<long long>& receiveTimes)
+{
+    std::vector<long long> result;
+    for (size_t i = 0; (i < sendTimes.size()) && (i < receiveTimes.size()); i++)
+        result.push_back(receiveTimes[i] - sendTimes[i]);
+    return result;
+}
+
+static bool BenchmarkLatency(int numMessages)
+{
+    bool result = true;
+
+    printf("Reader latency, %d Bell messages at random intervals of up to 2 ms:\n", numMessages);
+
+    for (int legacy = 0; legacy < 2; legacy++)
+    {
+        const Session session = RunSession(legacy != 0, FakeServer::SCRIPT_BELLS, numMessages, 0, true);
+        if (!session.ok)
+            result = false;
+        else
+            PrintLatencies(ReaderNames[legacy], Latencies(session.sendTimes, session.reader.receiveTimes), session.reader.cpuUsec);
+    }
+
+    return result;
+}
+
+
+
+//----------------------------------------------------------------------
+// ZRLE kernels
+
+enum { TILE_SIZE = 64 };
+
+template <class PIXEL>
+struct ZrleTypes;
+
+template <> struct ZrleTypes<rfbCARD8>
+{
+    static void lookup(rfbCARD8* dest, const rfbCARD8* indices, int count, const rfbCARD8* palette, int paletteSize) { ZrleKernels::lookup8(dest, indices, count, palette, paletteSize); }
+    static void fillRun(rfbCARD8* dest, rfbCARD8 pix, int count)                                                    { ZrleKernels::fillRun8(dest, pix, count); }
+};
+
+template <> struct ZrleTypes<rfbCARD16>
+{
+    static void lookup(rfbCARD16* dest, const rfbCARD8* indices, int count, const rfbCARD16* palette, int paletteSize) { ZrleKernels::lookup16(dest, indices, count, palette, paletteSize); }
+    static void fillRun(rfbCARD16* dest, rfbCARD16 pix, int count)                                                     { ZrleKernels::fillRun16(dest, pix, count); }
+};
+
+template <> struct ZrleTypes<rfbCARD32>
+{
+    static void lookup(rfbCARD32* dest, const rfbCARD8* indices, int count, const rfbCARD32* palette, int paletteSize) { ZrleKernels::lookup32(dest, indices, count, palette, paletteSize); }
+    static void fillRun(rfbCARD32* dest, rfbCARD32 pix, int count)                                                     { ZrleKernels::fillRun32(dest, pix, count); }
+};
+
+// Decodes a packed palette tile row by row, as zrle.cppinc does;
+// bitsPerIndex 8 stands for a palette of more than 16 colours.
+template <class PIXEL>
+struct PaletteTile
+{
+    int            bitsPerIndex;
+    int            paletteSize;
+    PIXEL          palette[128];
+    rfbCARD8       packed[TILE_SIZE*TILE_SIZE];
+    rfbCARD8       indices[TILE_SIZE];
+    PIXEL          dest[TILE_SIZE*TILE_SIZE];
+
+    PaletteTile(int sBitsPerIndex)
+        : bitsPerIndex(sBitsPerIndex),
+          paletteSize((sBitsPerIndex < 8) ? (1 << sBitsPerIndex) : 127)
+    {
+        for (int i = 0; i < 128; i++)
+            palette[i] = (PIXEL)(i * 0x01010101);
+
+        unsigned seed = 1;
+        for (int i = 0; i < TILE_SIZE*TILE_SIZE; i++)
+            packed[i] = (bitsPerIndex < 8) ? (rfbCARD8)rand_r(&seed) : (rfbCARD8)(rand_r(&seed) % paletteSize);
+    }
+
+    void operator()()
+    {
+        const int rowBytes = ((TILE_SIZE * bitsPerIndex) + 7) / 8;
+        for (int y = 0; y < TILE_SIZE; y++)
+        {
+            const rfbCARD8* const p = packed + (y * rowBytes);
+            PIXEL* const          d = dest + (y * TILE_SIZE);
+            if (bitsPerIndex == 8)
+                ZrleTypes<PIXEL>::lookup(d, p, TILE_SIZE, palette, paletteSize);
+            else
+            {
+                ZrleKernels::expandIndices(indices, p, TILE_SIZE, bitsPerIndex);
+                ZrleTypes<PIXEL>::lookup(d, indices, TILE_SIZE, palette, paletteSize);
+            }
+        }
+    }
+};
+
+// Fills a tile with runs of runLength pixels.
+template <class PIXEL>
+struct RunTile
+{
+    int   runLength;
+    PIXEL dest[TILE_SIZE*TILE_SIZE];
+
+    RunTile(int sRunLength) : runLength(sRunLength) {}
+
+    void operator()()
+    {
+        for (int i = 0; i < TILE_SIZE*TILE_SIZE; i += runLength)
+            ZrleTypes<PIXEL>::fillRun(dest + i, (PIXEL)i, runLength);
+    }
+};
+
+template <class PIXEL>
+static void BenchmarkZrleWidth()
+{
+    static const int bitsPerIndex[] = { 1, 2, 4, 8 };
+    static const int runLengths[]   = { 1, 4, 16, 64, 256, TILE_SIZE*TILE_SIZE };
+
+    const int pixelsPerTile = TILE_SIZE * TILE_SIZE;
+
+    printf("  %d-bit pixels:\n", 8 * (int)sizeof(PIXEL));
+
+    for (size_t i = 0; i < sizeof(bitsPerIndex) / sizeof(bitsPerIndex[0]); i++)
+    {
+        PaletteTile<PIXEL>* const tile = new PaletteTile<PIXEL>(bitsPerIndex[i]);
+        printf( "    palette, %3d colours %-12s %8.1f Mpixels/s\n",
+                tile->paletteSize,
+                (bitsPerIndex[i] < 8) ? "(packed)" : "(unpacked)",
+                pixelsPerTile / UsecPerRun(*tile) );
+        delete tile;
+    }
+
+    for (size_t i = 0; i < sizeof(runLengths) / sizeof(runLengths[0]); i++)
+    {
+        RunTile<PIXEL>* const tile = new RunTile<PIXEL>(runLengths[i]);
+        printf( "    runs of %4d pixels %-13s %8.1f Mpixels/s\n",
+                runLengths[i],
+                "",
+                pixelsPerTile / UsecPerRun(*tile) );
+        delete tile;
+    }
+}
+
+// The compressed (CPIXEL) 24A and 24B variants send 3 bytes per pixel,
+// which zrle.cppinc reads one at a time into 32-bit pixels, as these do;
+// the decoded pixels then go through the 32-bit kernels.
+struct Opaque24A
+{
+    static const char* getName() { return "24A"; }
+    static void get(rfbCARD32* pv, const rfbCARD8* p) { *pv = 0; ((rfbCARD8*)pv)[0] = p[0]; ((rfbCARD8*)pv)[1] = p[1]; ((rfbCARD8*)pv)[2] = p[2]; }
+};
+
+struct Opaque24B
+{
+    static const char* getName() { return "24B"; }
+    static void get(rfbCARD32* pv, const rfbCARD8* p) { *pv = 0; ((rfbCARD8*)pv)[1] = p[0]; ((rfbCARD8*)pv)[2] = p[1]; ((rfbCARD8*)pv)[3] = p[2]; }
+};
+
+// Decodes a raw tile of 3-byte pixels (paletteSize 0), or reads a
+// palette of paletteSize 3-byte pixels and decodes a packed palette
+// tile of 4 bits per index with it.
+template <class OPAQUE>
+struct CpixelTile
+{
+    int       paletteSize;
+    rfbCARD8  data[TILE_SIZE*TILE_SIZE*3];
+    rfbCARD8  indices[TILE_SIZE];
+    rfbCARD32 palette[128];
+    rfbCARD32 dest[TILE_SIZE*TILE_SIZE];
+
+    CpixelTile(int sPaletteSize)
+        : paletteSize(sPaletteSize)
+    {
+        unsigned seed = 1;
+        for (int i = 0; i < TILE_SIZE*TILE_SIZE*3; i++)
+            data[i] = (rfbCARD8)rand_r(&seed);
+    }
+
+    void operator()()
+    {
+        const rfbCARD8* p = data;
+
+        if (paletteSize == 0)
+        {
+            for (rfbCARD32* d = dest; d < dest + (TILE_SIZE*TILE_SIZE); d++, p += 3)
+                OPAQUE::get(d, p);
+        }
+        else
+        {
+            for (int i = 0; i < paletteSize; i++, p += 3)
+                OPAQUE::get(&palette[i], p);
+
+            const int rowBytes = TILE_SIZE / 2;
+            for (int y = 0; y < TILE_SIZE; y++, p += rowBytes)
+            {
+                ZrleKernels::expandIndices(indices, p, TILE_SIZE, 4);
+                ZrleKernels::lookup32(dest + (y * TILE_SIZE), indices, TILE_SIZE, palette, paletteSize);
+            }
+        }
+    }
+};
+
+template <class OPAQUE>
+static void BenchmarkZrleCpixel()
+{
+    const int pixelsPerTile = TILE_SIZE * TILE_SIZE;
+
+    printf("  %s pixels:\n", OPAQUE::getName());
+
+    CpixelTile<OPAQUE>* const rawTile = new CpixelTile<OPAQUE>(0);
+    printf( "    raw %-30s %8.1f Mpixels/s\n",
+            "",
+            pixelsPerTile / UsecPerRun(*rawTile) );
+    delete rawTile;
+
+    CpixelTile<OPAQUE>* const paletteTile = new CpixelTile<OPAQUE>(16);
+    printf( "    palette, %3d colours %-12s %8.1f Mpixels/s\n",
+            paletteTile->paletteSize,
+            "(packed)",
+            pixelsPerTile / UsecPerRun(*paletteTile) );
+    delete paletteTile;
+}
+
+static bool BenchmarkZrle()
+{
+    const ZrleKernels::Level savedLevel = ZrleKernels::getLevel();
+
+    for (int l = ZrleKernels::LEVEL_SCALAR; l <= ZrleKernels::getBestSupportedLevel(); l++)
+    {
+        if (!ZrleKernels::setLevel(ZrleKernels::Level(l)))
+            continue;
+
+        printf("ZRLE kernels, %s, 64x64 tiles:\n", ZrleKernels::getLevelName(ZrleKernels::Level(l)));
+        BenchmarkZrleWidth<rfbCARD8>();
+        BenchmarkZrleWidth<rfbCARD16>();
+        BenchmarkZrleWidth<rfbCARD32>();
+        BenchmarkZrleCpixel<Opaque24A>();
+        BenchmarkZrleCpixel<Opaque24B>();
+    }
+
+    ZrleKernels::setLevel(savedLevel);
+
+    return true;
+}
+
+
+
+//----------------------------------------------------------------------
+// Pixel conversion kernels
+
+enum { FRAME_WIDTH = 1920, FRAME_HEIGHT = 1080 };
+
+struct PixelLayout
+{
+    const char* name;
+    int         bitsPerPixel;
+    bool        bigEndian;
+    int         redShift, greenShift, blueShift;
+    int         redMax, greenMax, blueMax;
+};
+
+static const PixelLayout PixelLayouts[] =
+{
+    { "RGB888 big-endian",        32, true,  16,  8,  0,  255,  255,  255 },
+    { "RGB888 little-endian",     32, false, 16,  8,  0,  255,  255,  255 },
+    { "BGR888 little-endian",     32, false,  0,  8, 16,  255,  255,  255 },
+    { "RGB101010 little-endian",  32, false, 20, 10,  0, 1023, 1023, 1023 },
+    { "RGB565 little-endian",     16, false, 11,  5,  0,   31,   63,   31 },
+    { "RGB555 little-endian",     16, false, 10,  5,  0,   31,   31,   31 },
+    { "RGB444 little-endian",     16, false,  8,  4,  0,   15,   15,   15 },
+    { "BGR233",                    8, false,  0,  3,  6,    7,    7,    3 }
+};
+
+static rfbPixelFormat MakePixelFormat(const PixelLayout& layout)
+{
+    rfbPixelFormat format;
+    memset(&format, 0, sizeof(format));
+
+    format.bitsPerPixel = layout.bitsPerPixel;
+    format.depth        = layout.bitsPerPixel;
+    format.bigEndian    = layout.bigEndian;
+    format.trueColour   = 1;
+    format.redMax       = layout.redMax;
+    format.greenMax     = layout.greenMax;
+    format.blueMax      = layout.blueMax;
+    format.redShift     = layout.redShift;
+    format.greenShift   = layout.greenShift;
+    format.blueShift    = layout.blueShift;
+
+    return format;
+}
+
+struct ConvertFrame
+{
+    PixelKernels::Converter converter;
+    rfbPixelFormat          format;
+    const rfbCARD8*         src;
+    rfbCARD8*               rgb;
+
+    void operator()()
+    {
+        const int srcRowBytes = FRAME_WIDTH * (format.bitsPerPixel / 8);
+        for (int y = 0; y < FRAME_HEIGHT; y++)
+            converter(rgb + (y * FRAME_WIDTH * 3), src + (y * srcRowBytes), FRAME_WIDTH, format);
+    }
+};
+
+// The per-pixel conversion copyRectData() did before PixelKernels.
+struct ConvertFramePerPixel : public ConvertFrame
+{
+    static void store(rfbCARD8*& d, const rfbPixelFormat& format, rfbCARD32 pixel)
+    {
+        *d++ = (pixel >> format.redShift)   & format.redMax;
+        *d++ = (pixel >> format.greenShift) & format.greenMax;
+        *d++ = (pixel >> format.blueShift)  & format.blueMax;
+    }
+
+    void operator()()
+    {
+        const int count = FRAME_WIDTH * FRAME_HEIGHT;
+        rfbCARD8* d     = rgb;
+
+        switch (format.bitsPerPixel)
+        {
+            case 8:
+                for (int i = 0; i < count; i++)
+                    store(d, format, src[i]);
+                break;
+
+            case 16:
+                for (int i = 0; i < count; i++)
+                    store(d, format, Swap16IfLE(((const rfbCARD16*)src)[i]));
+                break;
+
+            case 32:
+                for (int i = 0; i < count; i++)
+                    store(d, format, Swap32IfLE(((const rfbCARD32*)src)[i]));
+                break;
+        }
+    }
+};
+
+static void PrintFrameRate(const char* name, double usecPerFrame)
+{
+    printf( "    %-24s %7.2f ms/frame  %8.1f Mpixels/s\n",
+            name,
+            usecPerFrame / 1000.0,
+            (FRAME_WIDTH * FRAME_HEIGHT) / usecPerFrame );
+}
+
+static bool BenchmarkPixels()
+{
+    rfbCARD8* const src = new rfbCARD8[FRAME_WIDTH * FRAME_HEIGHT * 4];
+    rfbCARD8* const rgb = new rfbCARD8[FRAME_WIDTH * FRAME_HEIGHT * 3];
+
+    unsigned seed = 1;
+    for (int i = 0; i < FRAME_WIDTH * FRAME_HEIGHT * 4; i++)
+        src[i] = (rfbCARD8)rand_r(&seed);
+
+    const PixelKernels::Level savedLevel = PixelKernels::getLevel();
+    bool result = true;
+
+    printf("Pixel conversion, %dx%d frames:\n", FRAME_WIDTH, FRAME_HEIGHT);
+
+    for (size_t i = 0; i < sizeof(PixelLayouts) / sizeof(PixelLayouts[0]); i++)
+    {
+        printf("  %d-bit %s:\n", PixelLayouts[i].bitsPerPixel, PixelLayouts[i].name);
+
+        ConvertFramePerPixel perPixel;
+        perPixel.converter = 0;
+        perPixel.format    = MakePixelFormat(PixelLayouts[i]);
+        perPixel.src       = src;
+        perPixel.rgb       = rgb;
+        PrintFrameRate("per pixel (before)", UsecPerRun(perPixel));
+
+        for (int l = PixelKernels::LEVEL_SCALAR; l <= PixelKernels::getBestSupportedLevel(); l++)
+        {
+            if (!PixelKernels::setLevel(PixelKernels::Level(l)))
+                continue;
+
+            ConvertFrame frame;
+            frame.format    = MakePixelFormat(PixelLayouts[i]);
+            frame.converter = PixelKernels::getConverter(frame.format);
+            frame.src       = src;
+            frame.rgb       = rgb;
+
+            if (!frame.converter)
+            {
+                printf("    %-24s no converter\n", PixelKernels::getLevelName(PixelKernels::Level(l)));
+                result = false;
+            }
+            else
+                PrintFrameRate(PixelKernels::getLevelName(PixelKernels::Level(l)), UsecPerRun(frame));
+        }
+    }
+
+    PixelKernels::setLevel(savedLevel);
+
+    delete[] src;
+    delete[] rgb;
+
+    return result;
+}
+
+
+
+//----------------------------------------------------------------------
+
+int main(int argc, char* argv[])
+{
+    const char* const mode = (argc > 1) ? argv[1] : "all";
+    const int         count = ((argc > 2) && (atoi(argv[2]) > 0)) ? atoi(argv[2]) : 0;
+
+    bool ran    = false;
+    bool result = true;
+
+    if ((strcasecmp(mode, "all") == 0) || (strcasecmp(mode, "stall") == 0))
+    {
+        result = BenchmarkStall(count ? count : 10) && result;
+        ran    = true;
+    }
+
+    if ((strcasecmp(mode, "all") == 0) || (strcasecmp(mode, "latency") == 0))
+    {
+        result = BenchmarkLatency(count ? count : 1000) && result;
+        ran    = true;
+    }
+
+    if ((strcasecmp(mode, "all") == 0) || (strcasecmp(mode, "zrle") == 0))
+    {
+        result = BenchmarkZrle() && result;
+        ran    = true;
+    }
+
+    if ((strcasecmp(mode, "all") == 0) || (strcasecmp(mode, "pixels") == 0))
+    {
+        result = BenchmarkPixels() && result;
+        ran    = true;
+    }
+
+    if (!ran)
+    {
+        fprintf(stderr, "Usage: %s [stall [runs] | latency [numMessages] | zrle | pixels]\n", argv[0]);
+        return 1;
+    }
+
+    return result ? 0 : 1;
+}
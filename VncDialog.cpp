@@ -128,6 +128,9 @@ VncDialog::VncDialog( const char*             sName,
     requestedEncodings(requestedEncodings ? requestedEncodings : ""),
     sharedDesktopFlag(sharedDesktopFlag),
     enableClickThrough(enableClickThrough),
+    localSocketPath(),
+    recordFileName(),
+    rfbProtocolStartupData(),
     initializedWithPassword(password != 0),
     password(password ? password : ""),
     passwordCompletionCallback(0),
@@ -135,11 +138,53 @@ VncDialog::VncDialog( const char*             sName,
     vncWidget(0),
     closeButton(0),
     messageLabel(0)
+{
+    rfbProtocolStartupData.initViaConnect    = initViaConnect;
+    rfbProtocolStartupData.rfbPort           = rfbPort;
+    rfbProtocolStartupData.sharedDesktopFlag = sharedDesktopFlag;
+
+    createAndStartVncWidget();
+}
+
+
+
+VncDialog::VncDialog( const char*                               sName,
+                      GLMotif::WidgetManager*                   sManager,
+                      const VncManager::RFBProtocolStartupData& rfbProtocolStartupData,
+                      const char*                               password,
+                      bool                                      enableClickThrough ) :
+    GLMotif::PopupWindow(sName, sManager, ""),
+    VncManager::MessageManager(),
+    VncManager::PasswordRetrievalThunk(),
+    serverInitFailed(false),
+    initViaConnect(rfbProtocolStartupData.initViaConnect),
+    hostname(rfbProtocolStartupData.desktopHost ? rfbProtocolStartupData.desktopHost : ""),
+    rfbPort(rfbProtocolStartupData.rfbPort),
+    requestedEncodings(rfbProtocolStartupData.requestedEncodings ? rfbProtocolStartupData.requestedEncodings : ""),
+    sharedDesktopFlag(rfbProtocolStartupData.sharedDesktopFlag),
+    enableClickThrough(enableClickThrough),
+    localSocketPath(rfbProtocolStartupData.localSocketPath ? rfbProtocolStartupData.localSocketPath : ""),
+    recordFileName(rfbProtocolStartupData.recordFileName ? rfbProtocolStartupData.recordFileName : ""),
+    rfbProtocolStartupData(rfbProtocolStartupData),
+    initializedWithPassword(password != 0),
+    password(password ? password : ""),
+    passwordCompletionCallback(0),
+    passwordKeyboardDialog(0),
+    vncWidget(0),
+    closeButton(0),
+    messageLabel(0)
+{
+    createAndStartVncWidget();
+}
+
+
+
+void VncDialog::createAndStartVncWidget()
 {
     // Create the popup window with the VncWidget and controls in it:
 
     std::string title = "Connection to: ";
-    title += (hostname ? hostname : "(unknown)");
+    title += (!hostname.empty() ? hostname : "(unknown)");
     this->setTitleString(title.c_str());
     {
         GLMotif::RowColumn* const topRowCol = new GLMotif::RowColumn("topRowCol", this, false);
@@ -174,13 +219,12 @@ VncDialog::VncDialog( const char*             sName,
     {
         vncWidget->setEnableClickThrough(enableClickThrough);
 
-        VncManager::RFBProtocolStartupData rfbProtocolStartupData;
-        rfbProtocolStartupData.initViaConnect     = this->initViaConnect;
         rfbProtocolStartupData.desktopHost        = this->hostname.c_str();
-        rfbProtocolStartupData.rfbPort            = this->rfbPort;
         rfbProtocolStartupData.requestedEncodings = this->requestedEncodings.c_str();
-        rfbProtocolStartupData.sharedDesktopFlag  = this->sharedDesktopFlag;
+        rfbProtocolStartupData.localSocketPath    = this->localSocketPath.empty() ? 0 : this->localSocketPath.c_str();
+        rfbProtocolStartupData.recordFileName     = this->recordFileName.empty()  ? 0 : this->recordFileName.c_str();
         vncWidget->startup(rfbProtocolStartupData);
+        rfbProtocolStartupData.preconnectedSocket = -1;  // now owned by the VncManager
     }
 }
 
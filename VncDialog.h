@@ -76,6 +76,15 @@ namespace Voltaic {
                    bool                    sharedDesktopFlag  = true,
                    bool                    enableClickThrough = true );
 
+        // The strings in rfbProtocolStartupData (desktopHost, requestedEncodings, etc.) are copied.
+        // Ownership of rfbProtocolStartupData.preconnectedSocket (if any) passes
+        // to the new dialog's VncManager.
+        VncDialog( const char*                               sName,
+                   GLMotif::WidgetManager*                   sManager,
+                   const VncManager::RFBProtocolStartupData& rfbProtocolStartupData,
+                   const char*                               password           = 0,
+                   bool                                      enableClickThrough = true );
+
         virtual ~VncDialog();
 
     public:
@@ -167,11 +176,15 @@ namespace Voltaic {
         bool getEnableClickThrough() const     { return !vncWidget ? false : vncWidget->getEnableClickThrough(); }
         void setEnableClickThrough(bool value) { if (vncWidget) vncWidget->setEnableClickThrough(value); }
 
+        GLfloat getMaxPointerMotionRate() const        { return !vncWidget ? (GLfloat)0 : vncWidget->getMaxPointerMotionRate(); }
+        void    setMaxPointerMotionRate(GLfloat value) { if (vncWidget) vncWidget->setMaxPointerMotionRate(value); }
+
         const char* getMessageString() const { return messageLabel ? messageLabel->getString() : ""; }
 
         bool getServerInitFailed() const { return serverInitFailed; }
 
     protected:
+        virtual void createAndStartVncWidget();  // called by the constructors
         virtual void closeButtonCallback(GLMotif::Button::CallbackData* cbData);
         template<class PopupWindowClass>
             void closePopupWindow(PopupWindowClass*& var);
@@ -179,20 +192,23 @@ namespace Voltaic {
         virtual void resetConnection();
 
     protected:
-        bool                              serverInitFailed;
-        bool                              initViaConnect;
-        std::string                       hostname;
-        unsigned                          rfbPort;
-        std::string                       requestedEncodings;
-        bool                              sharedDesktopFlag;
-        bool                              enableClickThrough;
-        bool                              initializedWithPassword;
-        std::string                       password;  // the password from the initialization arguments if initializedWithPassword is true
-        PasswordDialogCompletionCallback* passwordCompletionCallback;
-        KeyboardDialog*                   passwordKeyboardDialog;
-        VncWidget*                        vncWidget;
-        GLMotif::Button*                  closeButton;
-        GLMotif::Label*                   messageLabel;
+        bool                               serverInitFailed;
+        bool                               initViaConnect;
+        std::string                        hostname;
+        unsigned                           rfbPort;
+        std::string                        requestedEncodings;
+        bool                               sharedDesktopFlag;
+        bool                               enableClickThrough;
+        std::string                        localSocketPath;
+        std::string                        recordFileName;
+        VncManager::RFBProtocolStartupData rfbProtocolStartupData;  // its strings point into the std::string members above
+        bool                               initializedWithPassword;
+        std::string                        password;  // the password from the initialization arguments if initializedWithPassword is true
+        PasswordDialogCompletionCallback*  passwordCompletionCallback;
+        KeyboardDialog*                    passwordKeyboardDialog;
+        VncWidget*                         vncWidget;
+        GLMotif::Button*                   closeButton;
+        GLMotif::Label*                    messageLabel;
 
     private:
         // Disable these copiers:
@@ -18,6 +18,17 @@
   59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 ***********************************************************************/
 
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <GL/GLExtensionManager.h>
+#include <GL/Extensions/GLEXTFramebufferObject.h>
+
 #include "VncManager.h"
 
 
@@ -26,15 +37,6 @@ namespace Voltaic {
 
 //----------------------------------------------------------------------
 
-inline Images::RGBImage::Color convertPixelToRGB(const rfbPixelFormat& format, rfbCARD32 pixel)
-{
-    return Images::RGBImage::Color( ((pixel >> format.redShift)   & format.redMax),
-                                    ((pixel >> format.greenShift) & format.greenMax),
-                                    ((pixel >> format.blueShift)  & format.blueMax)   );
-}
-
-
-
 static void writeString(Comm::MulticastPipe& pipe, const std::string& s)
 {
     const std::string::size_type len = s.size();
@@ -66,6 +68,55 @@ static void readString(Comm::MulticastPipe& pipe, std::string& s)
 
 
 
+//----------------------------------------------------------------------
+// Pixel layouts (see VncManager::PixelLayout)
+
+struct PixelLayoutInfo
+{
+    const char* name;
+    size_t      size;               // bytes per pixel
+    GLint       texInternalFormat;
+    GLenum      texFormat;
+    GLenum      texType;
+};
+
+// PIXEL_LAYOUT_BGRA tiles are GL_RGB8 rather than GL_RGBA8: drivers store
+// both as 32-bit texels, but GL_RGBA8 would take its alpha from the
+// padding byte of the server's pixels, which is usually 0.
+// PIXEL_LAYOUT_RGB565 tiles are GL_RGB565 where ARB_ES2_compatibility
+// provides it (see getTexInternalFormat()), which keeps them 16-bit 5-6-5
+// texels, neither expanded on upload nor larger than the shadow
+// framebuffer.  Elsewhere they fall back to GL_RGB5, a 5-5-5 request: a
+// driver may store that as 5-6-5 too, or drop green's low bit or expand
+// the texels.
+// PIXEL_LAYOUT_INDEXED tiles hold the colours the indices are mapped to
+// by the pixel transfer; see TextureManager::beginPixelTransfer().
+static const PixelLayoutInfo PixelLayouts[VncManager::NUM_PIXEL_LAYOUTS] =
+{
+    { "rgb",     3, 3,       GL_RGB,         GL_UNSIGNED_BYTE             },  // PIXEL_LAYOUT_RGB
+    { "bgra",    4, GL_RGB8, GL_BGRA,        GL_UNSIGNED_INT_8_8_8_8_REV  },  // PIXEL_LAYOUT_BGRA
+    { "rgb565",  2, GL_RGB5, GL_RGB,         GL_UNSIGNED_SHORT_5_6_5      },  // PIXEL_LAYOUT_RGB565
+    { "indexed", 1, GL_RGB8, GL_COLOR_INDEX, GL_UNSIGNED_BYTE             }   // PIXEL_LAYOUT_INDEXED
+};
+
+#ifndef GL_RGB565
+#define GL_RGB565 0x8D62  // from ARB_ES2_compatibility
+#endif
+
+static GLint getTexInternalFormat(VncManager::PixelLayout layout)
+{
+    if ((layout == VncManager::PIXEL_LAYOUT_RGB565) && GLExtensionManager::isExtensionSupported("GL_ARB_ES2_compatibility"))
+        return GL_RGB565;
+    else
+        return PixelLayouts[layout].texInternalFormat;
+}
+
+// The pixel maps PIXEL_LAYOUT_INDEXED uploads replace, and their sizes:
+static const GLenum PixelMaps[3]     = { GL_PIXEL_MAP_I_TO_R,      GL_PIXEL_MAP_I_TO_G,      GL_PIXEL_MAP_I_TO_B      };
+static const GLenum PixelMapSizes[3] = { GL_PIXEL_MAP_I_TO_R_SIZE, GL_PIXEL_MAP_I_TO_G_SIZE, GL_PIXEL_MAP_I_TO_B_SIZE };
+
+
+
 //----------------------------------------------------------------------
 // VncManager::TextureManager methods
 
@@ -78,13 +129,16 @@ VncManager::TextureManager::~TextureManager()
 
 bool VncManager::TextureManager::init( GLsizei                 forWidth,
                                        GLsizei                 forHeight,
+                                       PixelLayout             forLayout,
                                        Images::RGBImage::Color initialColor )
 {
-    static const GLint  texLevel          = 0;
-    static const GLint  texInternalFormat = pixelBuf->numComponents;
-    static const GLint  texBorder         = 0;
-    static const GLenum texFormat         = GL_RGB;
-    static const GLenum texType           = GL_UNSIGNED_BYTE;
+    static const GLint texLevel  = 0;
+    static const GLint texBorder = 0;
+
+    const GLint  texInternalFormat = getTexInternalFormat(forLayout);
+    const GLenum texFormat         = PixelLayouts[forLayout].texFormat;
+    const GLenum texType           = PixelLayouts[forLayout].texType;
+    const size_t pixelSize         = PixelLayouts[forLayout].size;
 
     close();
 
@@ -107,6 +161,7 @@ bool VncManager::TextureManager::init( GLsizei                 forWidth,
                 {
                     width  = forWidth;
                     height = forHeight;
+                    layout = forLayout;
 
                     // Note: (forWidth + tileMaxWidth-tileXOverlap-1) might overflow GLsizei, so calculate with conditional...
                     tileXCount = (forWidth - tileXOverlap) / (tileMaxWidth - tileXOverlap);
@@ -161,11 +216,14 @@ bool VncManager::TextureManager::init( GLsizei                 forWidth,
                                     // BUG: tileMaxWidth*tileMaxHeight may overflow...
 
                                     pixelBufSize = tileMaxWidth*tileMaxHeight;
-                                    pixelBuf     = new Images::RGBImage::Color [pixelBufSize];  // may throw exception
+                                    pixelBuf     = new GLubyte [pixelBufSize*pixelSize];  // may throw exception
                                     if (pixelBuf)
                                     {
-                                        for (size_t i = 0; i < tileMaxWidth*tileMaxHeight; i++)
-                                            pixelBuf[i] = initialColor;
+                                        makePixel(layout, pixelBuf, initialColor, &colourMap);
+                                        for (size_t i = 1; i < tileMaxWidth*tileMaxHeight; i++)
+                                            memcpy(pixelBuf + (i*pixelSize), pixelBuf, pixelSize);
+
+                                        beginPixelTransfer();
 
                                         bool texAllocFailed = false;
                                         for (GLsizei xi = 0; !texAllocFailed && (xi < tileXCount); xi++)
@@ -200,6 +258,8 @@ bool VncManager::TextureManager::init( GLsizei                 forWidth,
                                             }
                                         }
 
+                                        endPixelTransfer();
+
                                         if (!texAllocFailed)
                                             valid = true;
                                     }
@@ -234,9 +294,11 @@ bool VncManager::TextureManager::reinit( GLsizei                 forWidth,
         return true;
     else
     {
+        const PixelLayout forLayout = layout;
+
         TextureManager priorState(*this);  // note: calls (*this).close()
 
-        if (init(forWidth, forHeight, initialColor))
+        if (init(forWidth, forHeight, forLayout, initialColor))
         {
             priorState.close();
             return true;
@@ -253,6 +315,24 @@ bool VncManager::TextureManager::reinit( GLsizei                 forWidth,
 
 void VncManager::TextureManager::close()
 {
+    if (copyFramebufferID)
+    {
+        glDeleteFramebuffersEXT(1, &copyFramebufferID);  // only created if GLEXTFramebufferObject is supported and initialized
+
+        copyFramebufferID = 0;
+    }
+
+    if (copyScratchTexID)
+    {
+        if (glIsTexture(copyScratchTexID))
+            glDeleteTextures(1, &copyScratchTexID);
+
+        copyScratchTexID = 0;
+    }
+
+    copyScratchWidth  = 0;
+    copyScratchHeight = 0;
+
     if (pixelBuf)
     {
         delete [] pixelBuf;
@@ -304,6 +384,7 @@ void VncManager::TextureManager::close()
 
     width  = 0;
     height = 0;
+    layout = PIXEL_LAYOUT_RGB;
 
     valid  = false;
 }
@@ -376,6 +457,49 @@ GLsizei VncManager::TextureManager::findLeastPow2GE(GLsizei n, size_t maxBits)
 
 
 
+void VncManager::TextureManager::beginPixelTransfer() const
+{
+    if ((layout == PIXEL_LAYOUT_INDEXED) && (pixelTransferDepth++ == 0))
+    {
+        // glPushAttrib(GL_PIXEL_MODE_BIT) saves the index shift and offset,
+        // but not the contents of the pixel maps, so those are read back
+        // here for endPixelTransfer() to restore:
+        glPushAttrib(GL_PIXEL_MODE_BIT);
+        for (int i = 0; i < 3; i++)
+        {
+            GLint size = 0;
+            glGetIntegerv(PixelMapSizes[i], &size);
+            savedPixelMaps[i].resize(size);
+            if (size > 0)
+                glGetPixelMapusv(PixelMaps[i], &savedPixelMaps[i][0]);
+        }
+
+        // Color indices are always converted to RGBA via the I_TO_* maps
+        // when they are written to an RGB texture; the indices are masked
+        // with (ColourMap::SIZE-1), and the index shift and offset must be 0:
+        glPixelTransferi(GL_INDEX_SHIFT,  0);
+        glPixelTransferi(GL_INDEX_OFFSET, 0);
+        glPixelMapusv(GL_PIXEL_MAP_I_TO_R, ColourMap::SIZE, colourMap.red);
+        glPixelMapusv(GL_PIXEL_MAP_I_TO_G, ColourMap::SIZE, colourMap.green);
+        glPixelMapusv(GL_PIXEL_MAP_I_TO_B, ColourMap::SIZE, colourMap.blue);
+    }
+}
+
+
+
+void VncManager::TextureManager::endPixelTransfer() const
+{
+    if ((layout == PIXEL_LAYOUT_INDEXED) && (pixelTransferDepth > 0) && (--pixelTransferDepth == 0))
+    {
+        for (int i = 0; i < 3; i++)
+            if (!savedPixelMaps[i].empty())
+                glPixelMapusv(PixelMaps[i], (GLsizei)savedPixelMaps[i].size(), &savedPixelMaps[i][0]);
+        glPopAttrib();
+    }
+}
+
+
+
 bool VncManager::TextureManager::getMaxTileSize( GLsizei& tileMaxWidth, GLsizei& tileMaxHeight,
                                                  GLsizei  forWidth,     GLsizei  forHeight,
                                                  size_t maxBits,
@@ -434,15 +558,18 @@ bool VncManager::TextureManager::getMaxTileSize( GLsizei& tileMaxWidth, GLsizei&
 
 
 
-bool VncManager::TextureManager::write( GLint                          destX,
-                                        GLint                          destY,
-                                        GLsizei                        srcWidth,
-                                        GLsizei                        srcHeight,
-                                        const Images::RGBImage::Color* srcData ) const
+bool VncManager::TextureManager::write( GLint          destX,
+                                        GLint          destY,
+                                        GLsizei        srcWidth,
+                                        GLsizei        srcHeight,
+                                        const GLubyte* srcData,
+                                        GLsizei        srcRowLength ) const
 {
-    static const GLint  texLevel  = 0;
-    static const GLenum texFormat = GL_RGB;
-    static const GLenum texType   = GL_UNSIGNED_BYTE;
+    static const GLint texLevel = 0;
+
+    const GLenum texFormat = PixelLayouts[layout].texFormat;
+    const GLenum texType   = PixelLayouts[layout].texType;
+    const size_t pixelSize = PixelLayouts[layout].size;
 
     if (!valid)
         return false;
@@ -463,6 +590,9 @@ bool VncManager::TextureManager::write( GLint                          destX,
         }
         else
         {
+            if (srcRowLength <= 0)
+                srcRowLength = srcWidth;
+
             // First, see if the srcData is contained in just one tile column.
             // If so, we can transfer the data directly.  Otherwise,
             // we'll have to extract individual scan lines into pixelBuf.
@@ -508,7 +638,7 @@ bool VncManager::TextureManager::write( GLint                          destX,
                 GLint   yOffset         = (destY < 0) ? 0 : (destY - tileYCoord[firstTileRow]);
                 GLsizei rowsTransferred = (destY < 0) ? -destY : 0;  // will skip -destY rows if destY < 0
 
-                const Images::RGBImage::Color* buf = (srcData + (rowsTransferred*srcWidth));
+                const GLubyte* buf = (srcData + (rowsTransferred*srcRowLength*pixelSize));
 
                 while ((tileRow < tileYCount) && (rowsTransferred < srcHeight))
                 {
@@ -529,9 +659,15 @@ bool VncManager::TextureManager::write( GLint                          destX,
                     }
 
                     bool xfError = false;
+                    glPushClientAttrib(GL_CLIENT_PIXEL_STORE_BIT);
+                    glPixelStorei(GL_UNPACK_ALIGNMENT,  1);  // rows of RGB pixels are not padded
+                    glPixelStorei(GL_UNPACK_ROW_LENGTH, srcRowLength);
+                    beginPixelTransfer();
                     glTexSubImage2D(GL_TEXTURE_2D, texLevel, xOffset, yOffset, w, h, texFormat, texType, buf);
                     if (glGetError() != GL_NO_ERROR)
                         xfError = true;
+                    endPixelTransfer();
+                    glPopClientAttrib();
 
                     glBindTexture(GL_TEXTURE_2D, 0);  // protect texture
 
@@ -546,7 +682,7 @@ bool VncManager::TextureManager::write( GLint                          destX,
                     yOffset = 0;
                     rowsTransferred += h;
 
-                    buf += (w * h);
+                    buf += (srcRowLength * h * pixelSize);
                 }
 
                 return true;
@@ -578,11 +714,11 @@ bool VncManager::TextureManager::write( GLint                          destX,
                             h = (tileHeight - yOffset);
 
                         // Stage the pixel data into pixelBuf:
-                        Images::RGBImage::Color* p = pixelBuf;
+                        GLubyte* p = pixelBuf;
                         for (GLsizei pr = rowsTransferred; pr < (rowsTransferred + h); pr++)
                         {
-                            memcpy(p, (srcData + ((pr*srcWidth) + colsTransferred)), w*sizeof(*srcData));
-                            p += w;
+                            memcpy(p, (srcData + (((pr*srcRowLength) + colsTransferred)*pixelSize)), w*pixelSize);
+                            p += (w*pixelSize);
                         }
 
                         glBindTexture(GL_TEXTURE_2D, tileTexID[tileCol][tileRow]);
@@ -593,9 +729,14 @@ bool VncManager::TextureManager::write( GLint                          destX,
                             return false;
 
                         bool xfError = false;
+                        glPushClientAttrib(GL_CLIENT_PIXEL_STORE_BIT);
+                        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);  // rows of RGB pixels are not padded
+                        beginPixelTransfer();
                         glTexSubImage2D(GL_TEXTURE_2D, texLevel, xOffset, yOffset, w, h, texFormat, texType, pixelBuf);
                         if (glGetError() != GL_NO_ERROR)
                             xfError = true;
+                        endPixelTransfer();
+                        glPopClientAttrib();
 
                         glBindTexture(GL_TEXTURE_2D, 0);  // protect texture
 
@@ -635,20 +776,164 @@ bool VncManager::TextureManager::copy( GLint   destX,
                                        GLsizei srcWidth,
                                        GLsizei srcHeight ) const
 {
-    return false;//!!! implement me !!!
+    static const GLint texLevel  = 0;
+    static const GLint texBorder = 0;
+
+    const GLint  texInternalFormat = getTexInternalFormat(layout);
+    const GLenum texFormat         = PixelLayouts[layout].texFormat;
+    const GLenum texType           = PixelLayouts[layout].texType;
+
+    if (!valid)
+        return false;
+    else if ((srcWidth <= 0) || (srcHeight <= 0))
+        return true;  // nothing to do...
+    else if ( (srcX  < 0) || ((srcX  + srcWidth)  > width)  ||
+              (srcY  < 0) || ((srcY  + srcHeight) > height) ||
+              (destX < 0) || ((destX + srcWidth)  > width)  ||
+              (destY < 0) || ((destY + srcHeight) > height)    )
+    {
+        return false;  // CopyRect rectangles are always entirely inside the framebuffer
+    }
+    else if (!GLEXTFramebufferObject::isSupported())
+        return false;
+    else
+    {
+        GLEXTFramebufferObject::initExtension();
+
+        // The copy is done entirely on the GPU: each piece of the source
+        // rectangle is copied from its tile into a scratch texture via a
+        // framebuffer object, and then each piece of the destination
+        // rectangle is copied from the scratch texture into its tile.
+        // Going through the scratch texture takes care of overlapping
+        // source and destination rectangles, and of rectangles that cross
+        // tile boundaries.  The tiles do not overlap (tileXOverlap and
+        // tileYOverlap are 0), so each pixel is in exactly one tile.
+
+        // The scratch texture and the framebuffer object are kept until
+        // close(); the scratch texture only grows, to the largest rectangle
+        // copied so far (rounded up to powers of 2).
+
+        GLint savedFramebufferID = 0;
+        glGetIntegerv(GL_FRAMEBUFFER_BINDING_EXT, &savedFramebufferID);
+        glPushAttrib(GL_PIXEL_MODE_BIT);  // saves the read buffer
+
+        bool result = true;
+
+        if (!copyScratchTexID)
+        {
+            glGenTextures(1, &copyScratchTexID);
+            copyScratchWidth  = 0;
+            copyScratchHeight = 0;
+        }
+
+        glBindTexture(GL_TEXTURE_2D, copyScratchTexID);
+
+        if ((srcWidth > copyScratchWidth) || (srcHeight > copyScratchHeight))
+        {
+            const GLsizei scratchWidth  = findLeastPow2GE(((srcWidth  > copyScratchWidth)  ? srcWidth  : copyScratchWidth),  8*sizeof(GLsizei)-1);
+            const GLsizei scratchHeight = findLeastPow2GE(((srcHeight > copyScratchHeight) ? srcHeight : copyScratchHeight), 8*sizeof(GLsizei)-1);
+
+            setTexParameters();
+            glTexImage2D(GL_TEXTURE_2D, texLevel, texInternalFormat, scratchWidth, scratchHeight, texBorder, texFormat, texType, NULL);
+            if (glGetError() != GL_NO_ERROR)
+            {
+                copyScratchWidth  = 0;  // try again next time
+                copyScratchHeight = 0;
+                result = false;
+            }
+            else
+            {
+                copyScratchWidth  = scratchWidth;
+                copyScratchHeight = scratchHeight;
+            }
+        }
+
+        if (!copyFramebufferID)
+            glGenFramebuffersEXT(1, &copyFramebufferID);
+        glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, copyFramebufferID);
+
+        // First pass: source tiles ==> scratch texture:
+        for (GLsizei tileRow = 0; result && (tileRow < tileYCount); tileRow++)
+            for (GLsizei tileCol = 0; result && (tileCol < tileXCount); tileCol++)
+            {
+                const GLint x0 = (srcX > tileXCoord[tileCol])                 ? srcX                 : tileXCoord[tileCol];
+                const GLint x1 = ((srcX + srcWidth) < tileXCoord[tileCol+1])  ? (srcX + srcWidth)    : tileXCoord[tileCol+1];
+                const GLint y0 = (srcY > tileYCoord[tileRow])                 ? srcY                 : tileYCoord[tileRow];
+                const GLint y1 = ((srcY + srcHeight) < tileYCoord[tileRow+1]) ? (srcY + srcHeight)   : tileYCoord[tileRow+1];
+
+                if ((x0 < x1) && (y0 < y1))
+                {
+                    glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, tileTexID[tileCol][tileRow], texLevel);
+                    if (glCheckFramebufferStatusEXT(GL_FRAMEBUFFER_EXT) != GL_FRAMEBUFFER_COMPLETE_EXT)
+                        result = false;
+                    else
+                    {
+                        glReadBuffer(GL_COLOR_ATTACHMENT0_EXT);
+                        glBindTexture(GL_TEXTURE_2D, copyScratchTexID);
+                        glCopyTexSubImage2D( GL_TEXTURE_2D, texLevel,
+                                             x0 - srcX, y0 - srcY,                                  // into scratch texture
+                                             x0 - tileXCoord[tileCol], y0 - tileYCoord[tileRow],    // from tile
+                                             x1 - x0, y1 - y0 );
+                        if (glGetError() != GL_NO_ERROR)
+                            result = false;
+                    }
+                }
+            }
+
+        // Second pass: scratch texture ==> destination tiles:
+        if (result)
+        {
+            glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, copyScratchTexID, texLevel);
+            if (glCheckFramebufferStatusEXT(GL_FRAMEBUFFER_EXT) != GL_FRAMEBUFFER_COMPLETE_EXT)
+                result = false;
+            else
+                glReadBuffer(GL_COLOR_ATTACHMENT0_EXT);
+        }
+
+        for (GLsizei tileRow = 0; result && (tileRow < tileYCount); tileRow++)
+            for (GLsizei tileCol = 0; result && (tileCol < tileXCount); tileCol++)
+            {
+                const GLint x0 = (destX > tileXCoord[tileCol])                 ? destX                : tileXCoord[tileCol];
+                const GLint x1 = ((destX + srcWidth) < tileXCoord[tileCol+1])  ? (destX + srcWidth)   : tileXCoord[tileCol+1];
+                const GLint y0 = (destY > tileYCoord[tileRow])                 ? destY                : tileYCoord[tileRow];
+                const GLint y1 = ((destY + srcHeight) < tileYCoord[tileRow+1]) ? (destY + srcHeight)  : tileYCoord[tileRow+1];
+
+                if ((x0 < x1) && (y0 < y1))
+                {
+                    glBindTexture(GL_TEXTURE_2D, tileTexID[tileCol][tileRow]);
+                    glCopyTexSubImage2D( GL_TEXTURE_2D, texLevel,
+                                         x0 - tileXCoord[tileCol], y0 - tileYCoord[tileRow],    // into tile
+                                         x0 - destX, y0 - destY,                                // from scratch texture
+                                         x1 - x0, y1 - y0 );
+                    if (glGetError() != GL_NO_ERROR)
+                        result = false;
+                }
+            }
+
+        glBindTexture(GL_TEXTURE_2D, 0);  // protect texture
+
+        glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, 0, texLevel);  // don't keep a tile attached
+        glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, savedFramebufferID);
+
+        glPopAttrib();
+
+        return result;
+    }
 }
 
 
 
-bool VncManager::TextureManager::fill( GLint                   destX,
-                                       GLint                   destY,
-                                       GLsizei                 destWidth,
-                                       GLsizei                 destHeight,
-                                       Images::RGBImage::Color color ) const
+bool VncManager::TextureManager::fill( GLint          destX,
+                                       GLint          destY,
+                                       GLsizei        destWidth,
+                                       GLsizei        destHeight,
+                                       const GLubyte* pixel ) const
 {
-    static const GLint  texLevel  = 0;
-    static const GLenum texFormat = GL_RGB;
-    static const GLenum texType   = GL_UNSIGNED_BYTE;
+    static const GLint texLevel = 0;
+
+    const GLenum texFormat = PixelLayouts[layout].texFormat;
+    const GLenum texType   = PixelLayouts[layout].texType;
+    const size_t pixelSize = PixelLayouts[layout].size;
 
     if (!valid)
         return false;
@@ -665,9 +950,9 @@ bool VncManager::TextureManager::fill( GLint                   destX,
         }
         else
         {
-            // First, fill the pixelBuf with pixels of the chosen color:
-            for (Images::RGBImage::Color* p = pixelBuf; p < pixelBuf+pixelBufSize; )
-                *p++ = color;
+            // First, fill the pixelBuf with the chosen pixel:
+            for (GLubyte* p = pixelBuf; p < pixelBuf+(pixelBufSize*pixelSize); p += pixelSize)
+                memcpy(p, pixel, pixelSize);
 
             GLsizei firstTileCol = 0;  // first tile column index that will contain fill
 
@@ -715,9 +1000,14 @@ bool VncManager::TextureManager::fill( GLint                   destX,
                         return false;
 
                     bool xfError = false;
+                    glPushClientAttrib(GL_CLIENT_PIXEL_STORE_BIT);
+                    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);  // rows of RGB pixels are not padded
+                    beginPixelTransfer();
                     glTexSubImage2D(GL_TEXTURE_2D, texLevel, xOffset, yOffset, w, h, texFormat, texType, pixelBuf);
                     if (glGetError() != GL_NO_ERROR)
                         xfError = true;
+                    endPixelTransfer();
+                    glPopClientAttrib();
 
                     glBindTexture(GL_TEXTURE_2D, 0);  // protect texture
 
@@ -818,8 +1108,15 @@ VncManager::TextureManager& VncManager::TextureManager::operator=(TextureManager
     tileXCoord   = other.tileXCoord;      other.tileXCoord   = 0;
     tileYCoord   = other.tileYCoord;      other.tileYCoord   = 0;
     tileTexID    = other.tileTexID;       other.tileTexID    = 0;
+    layout       = other.layout;          other.layout       = PIXEL_LAYOUT_RGB;
     pixelBuf     = other.pixelBuf;        other.pixelBuf     = 0;
     pixelBufSize = other.pixelBufSize;    other.pixelBufSize = 0;
+    colourMap    = other.colourMap;
+
+    copyScratchTexID  = other.copyScratchTexID;     other.copyScratchTexID  = 0;
+    copyScratchWidth  = other.copyScratchWidth;     other.copyScratchWidth  = 0;
+    copyScratchHeight = other.copyScratchHeight;    other.copyScratchHeight = 0;
+    copyFramebufferID = other.copyFramebufferID;    other.copyFramebufferID = 0;
 }
 
 
@@ -833,8 +1130,15 @@ VncManager::TextureManager::TextureManager(TextureManager& other) :
     tileXCoord(other.tileXCoord),
     tileYCoord(other.tileYCoord),
     tileTexID(other.tileTexID),
+    layout(other.layout),
     pixelBuf(other.pixelBuf),
-    pixelBufSize(other.pixelBufSize)
+    pixelBufSize(other.pixelBufSize),
+    colourMap(other.colourMap),
+    pixelTransferDepth(0),
+    copyScratchTexID(other.copyScratchTexID),
+    copyScratchWidth(other.copyScratchWidth),
+    copyScratchHeight(other.copyScratchHeight),
+    copyFramebufferID(other.copyFramebufferID)
 {
     other.valid        = false;
     other.width        = 0;
@@ -844,152 +1148,582 @@ VncManager::TextureManager::TextureManager(TextureManager& other) :
     other.tileXCoord   = 0;
     other.tileYCoord   = 0;
     other.tileTexID    = 0;
+    other.layout       = PIXEL_LAYOUT_RGB;
     other.pixelBuf     = 0;
     other.pixelBufSize = 0;
+
+    other.copyScratchTexID  = 0;
+    other.copyScratchWidth  = 0;
+    other.copyScratchHeight = 0;
+    other.copyFramebufferID = 0;
 }
 
 
 
 //----------------------------------------------------------------------
-// VncManager::ActionQueue::*Item methods
+// VncManager::ShadowFramebuffer methods
 
-VncManager::ActionQueue::Item::~Item()
+VncManager::ShadowFramebuffer::ShadowFramebuffer() :
+    mutex(),
+    width(0),
+    height(0),
+    layout(PIXEL_LAYOUT_RGB),
+    pixelSize(VncManager::getPixelSize(PIXEL_LAYOUT_RGB)),
+    pixels(0),
+    damageCols(0),
+    damageRows(0),
+    damageMap(0),
+    anyDamage(false),
+    pendingCopies(),
+    gpuCopyEnabled(true),
+    colourMapChanged(false)
 {
+    makeDefaultColourMap(colourMap);
 }
 
 
 
-bool VncManager::ActionQueue::Item::indicatesClose() const
+VncManager::ShadowFramebuffer::~ShadowFramebuffer()
 {
-    return false;
+    close();
 }
 
 
 
-VncManager::ActionQueue::Item* VncManager::ActionQueue::Item::createFromPipeContainingTypeCode(ActionQueue& actionQueue, Comm::MulticastPipe& pipe)  // static member
+bool VncManager::ShadowFramebuffer::resize( GLsizei                 newWidth,
+                                            GLsizei                 newHeight,
+                                            PixelLayout             newLayout,
+                                            Images::RGBImage::Color initialColor )
 {
-    ItemType itemType;
-    pipe.read(itemType);
+    close();
 
-    switch (itemType)
-    {
-        case ItemType_GetPasswordItem:              return GetPasswordItem::createFromPipe(pipe);
-        case ItemType_InitDisplayItem:              return InitDisplayItem::createFromPipe(pipe);
-        case ItemType_DesktopSizeItem:              return DesktopSizeItem::createFromPipe(pipe);
-        case ItemType_WriteItem:                    return WriteItem::createFromPipe(pipe);
-        case ItemType_CopyItem:                     return CopyItem::createFromPipe(pipe);
-        case ItemType_FillItem:                     return FillItem::createFromPipe(pipe);
-        case ItemType_InternalErrorMessageItem:     return InternalErrorMessageItem::createFromPipe(pipe);
-        case ItemType_ErrorMessageItem:             return ErrorMessageItem::createFromPipe(pipe);
-        case ItemType_ErrorMessageFromServerItem:   return ErrorMessageFromServerItem::createFromPipe(pipe);
-        case ItemType_InfoServerInitStartedItem:    return InfoServerInitStartedItem::createFromPipe(pipe);
-        case ItemType_InfoProtocolVersionItem:      return InfoProtocolVersionItem::createFromPipe(pipe);
-        case ItemType_InfoAuthenticationResultItem: return InfoAuthenticationResultItem::createFromPipe(pipe);
-        case ItemType_InfoServerInitCompletedItem:  return InfoServerInitCompletedItem::createFromPipe(pipe);
-        case ItemType_InfoDesktopSizeReceivedItem:  return InfoDesktopSizeReceivedItem::createFromPipe(pipe);
-        case ItemType_InfoCloseStartedItem:         return InfoCloseStartedItem::createFromPipe(pipe);
-        case ItemType_InfoCloseCompletedItem:       return InfoCloseCompletedItem::createFromPipe(pipe);
+    if ((newWidth <= 0) || (newHeight <= 0))
+        return false;
 
-        default:
-        {
-            std::string message = "Unknown ItemType from MulticastPipe: ";
-            message += (int)itemType;
-            actionQueue.addAndBroadcast(new ActionQueue::InternalErrorMessageItem("VncManager::ActionQueue::Item::createFromPipeContainingTypeCode", message.c_str()));
-            return 0;
-        }
+    const GLsizei newDamageCols = (newWidth  + DAMAGE_BLOCK_SIZE - 1) / DAMAGE_BLOCK_SIZE;
+    const GLsizei newDamageRows = (newHeight + DAMAGE_BLOCK_SIZE - 1) / DAMAGE_BLOCK_SIZE;
+
+    const size_t newPixelSize = VncManager::getPixelSize(newLayout);
+
+    GLubyte* newPixels    = 0;
+    bool*    newDamageMap = 0;
+    try
+    {
+        newPixels    = new GLubyte [newWidth*newHeight*newPixelSize];  // may throw exception
+        newDamageMap = new bool [newDamageCols*newDamageRows];         // may throw exception
+    }
+    catch (...)
+    {
+        if (newPixels)
+            delete [] newPixels;
+        return false;
     }
-}
 
+    mutex.lock();
+    makePixel(newLayout, newPixels, initialColor, &colourMap);
+    mutex.unlock();
+    for (GLubyte* p = newPixels+newPixelSize; p < newPixels+(newWidth*newHeight*newPixelSize); p += newPixelSize)
+        memcpy(p, newPixels, newPixelSize);
 
+    for (GLsizei i = 0; i < (newDamageCols*newDamageRows); i++)
+        newDamageMap[i] = true;
 
-VncManager::ActionQueue::GetPasswordItem* VncManager::ActionQueue::GetPasswordItem::createFromPipe(Comm::MulticastPipe& pipe)  // static member
-{
-    return new GetPasswordItem();
+    mutex.lock();
+    width      = newWidth;
+    height     = newHeight;
+    layout     = newLayout;
+    pixelSize  = newPixelSize;
+    pixels     = newPixels;
+    damageCols = newDamageCols;
+    damageRows = newDamageRows;
+    damageMap  = newDamageMap;
+    anyDamage  = true;
+    mutex.unlock();
+
+    return true;
 }
 
 
 
-void VncManager::ActionQueue::GetPasswordItem::broadcast(Comm::MulticastPipe& pipe) const
+void VncManager::ShadowFramebuffer::close()
 {
-    pipe.write(ItemType_GetPasswordItem);
+    mutex.lock();
 
-    pipe.finishMessage();
+    if (pixels)
+        delete [] pixels;
+    if (damageMap)
+        delete [] damageMap;
+
+    width      = 0;
+    height     = 0;
+    pixels     = 0;
+    damageCols = 0;
+    damageRows = 0;
+    damageMap  = 0;
+    anyDamage  = false;
+    pendingCopies.clear();
+
+    mutex.unlock();
 }
 
 
 
-bool VncManager::ActionQueue::GetPasswordItem::perform(VncManager& vncManager)
+GLubyte* VncManager::ShadowFramebuffer::beginWrite(GLint x, GLint y, GLsizei w, GLsizei h)
 {
-    vncManager.initiatePasswordRetrieval();
+    mutex.lock();
+
+    if (!pixels || !containsRect(x, y, w, h))
+    {
+        mutex.unlock();
+        return 0;
+    }
+    else
+        return pixels + (((y * width) + x) * pixelSize);  // still locked
 }
 
 
 
-VncManager::ActionQueue::InitDisplayItem* VncManager::ActionQueue::InitDisplayItem::createFromPipe(Comm::MulticastPipe& pipe)  // static member
+void VncManager::ShadowFramebuffer::endWrite(GLint x, GLint y, GLsizei w, GLsizei h)
 {
-    rfbServerInitMsg si;
-    memset(&si, 0, sizeof(si));
+    damage(x, y, w, h);
+    mutex.unlock();
+}
 
-    si.framebufferWidth    = pipe.read<unsigned int>();
-    si.framebufferHeight   = pipe.read<unsigned int>();
-    si.format.bitsPerPixel = pipe.read<unsigned char>();
-    si.format.depth        = pipe.read<unsigned char>();
-    si.format.bigEndian    = pipe.read<unsigned char>();
-    si.format.trueColour   = pipe.read<unsigned char>();
-    si.format.redMax       = pipe.read<unsigned int>();
-    si.format.greenMax     = pipe.read<unsigned int>();
-    si.format.blueMax      = pipe.read<unsigned int>();
-    si.format.redShift     = pipe.read<unsigned char>();
-    si.format.greenShift   = pipe.read<unsigned char>();
-    si.format.blueShift    = pipe.read<unsigned char>();
-    si.nameLength          = pipe.read<unsigned long>();
 
-    std::string desktopName;
-    readString(pipe, desktopName);
 
-    return new InitDisplayItem(si, desktopName.c_str());
+bool VncManager::ShadowFramebuffer::write( GLint          destX,
+                                           GLint          destY,
+                                           GLsizei        srcWidth,
+                                           GLsizei        srcHeight,
+                                           const GLubyte* srcData )
+{
+    GLubyte* const dest = beginWrite(destX, destY, srcWidth, srcHeight);
+    if (!dest || !srcData)
+    {
+        if (dest)
+            endWrite(destX, destY, 0, 0);
+        return false;
+    }
+    else
+    {
+        for (GLsizei j = 0; j < srcHeight; j++)
+            memcpy(dest + (j * width * pixelSize), srcData + (j * srcWidth * pixelSize), srcWidth*pixelSize);
+
+        endWrite(destX, destY, srcWidth, srcHeight);
+        return true;
+    }
 }
 
 
 
-void VncManager::ActionQueue::InitDisplayItem::broadcast(Comm::MulticastPipe& pipe) const
+bool VncManager::ShadowFramebuffer::copy( GLint   destX,
+                                          GLint   destY,
+                                          GLint   srcX,
+                                          GLint   srcY,
+                                          GLsizei srcWidth,
+                                          GLsizei srcHeight )
 {
-    pipe.write(ItemType_InitDisplayItem);
-
-    pipe.write<unsigned int>(si.framebufferWidth);
-    pipe.write<unsigned int>(si.framebufferHeight);
-    pipe.write<unsigned char>(si.format.bitsPerPixel);
-    pipe.write<unsigned char>(si.format.depth);
-    pipe.write<unsigned char>(si.format.bigEndian);
-    pipe.write<unsigned char>(si.format.trueColour);
-    pipe.write<unsigned int>(si.format.redMax);
-    pipe.write<unsigned int>(si.format.greenMax);
-    pipe.write<unsigned int>(si.format.blueMax);
-    pipe.write<unsigned char>(si.format.redShift);
-    pipe.write<unsigned char>(si.format.greenShift);
-    pipe.write<unsigned char>(si.format.blueShift);
-    pipe.write<unsigned long>(si.nameLength);
+    GLubyte* const dest = beginWrite(destX, destY, srcWidth, srcHeight);
+    if (!dest)
+        return false;
+    else if (!containsRect(srcX, srcY, srcWidth, srcHeight))
+    {
+        endWrite(destX, destY, 0, 0);
+        return false;
+    }
+    else
+    {
+        const GLubyte* const src      = pixels + (((srcY * width) + srcX) * pixelSize);
+        const size_t         rowBytes = width * pixelSize;
 
-    writeString(pipe, desktopName);
+        // Walk the rows away from the overlap, if any; memmove() takes care of overlap within a row:
+        if (destY <= srcY)
+            for (GLsizei j = 0; j < srcHeight; j++)
+                memmove(dest + (j * rowBytes), src + (j * rowBytes), srcWidth*pixelSize);
+        else
+            for (GLsizei j = srcHeight-1; j >= 0; j--)
+                memmove(dest + (j * rowBytes), src + (j * rowBytes), srcWidth*pixelSize);
+
+        // If the texture still holds the same source pixels, let the GPU do
+        // the copy instead of uploading the destination again:
+        if ( gpuCopyEnabled                                        &&
+             (pendingCopies.size() < MAX_PENDING_COPIES)           &&
+             !isDamaged(srcX, srcY, srcWidth, srcHeight)              )
+        {
+            PendingCopy pendingCopy;
+            pendingCopy.destX  = destX;
+            pendingCopy.destY  = destY;
+            pendingCopy.srcX   = srcX;
+            pendingCopy.srcY   = srcY;
+            pendingCopy.width  = srcWidth;
+            pendingCopy.height = srcHeight;
+            pendingCopies.push_back(pendingCopy);
+
+            endWrite(destX, destY, 0, 0);  // destination is not damaged
+        }
+        else
+            endWrite(destX, destY, srcWidth, srcHeight);
 
-    pipe.finishMessage();
+        return true;
+    }
 }
 
 
 
-bool VncManager::ActionQueue::InitDisplayItem::perform(VncManager& vncManager)
+bool VncManager::ShadowFramebuffer::fill( GLint          destX,
+                                          GLint          destY,
+                                          GLsizei        destWidth,
+                                          GLsizei        destHeight,
+                                          const GLubyte* pixel )
 {
-    TextureManager& remoteDisplay = vncManager.getRemoteDisplay();
-    remoteDisplay.close();
-    return remoteDisplay.init(si.framebufferWidth, si.framebufferHeight);
+    GLubyte* const dest = beginWrite(destX, destY, destWidth, destHeight);
+    if (!dest || !pixel)
+    {
+        if (dest)
+            endWrite(destX, destY, 0, 0);
+        return false;
+    }
+    else
+    {
+        // Fill the first row a pixel at a time, then copy it to the others:
+        for (GLsizei i = 0; i < destWidth; i++)
+            memcpy(dest + (i * pixelSize), pixel, pixelSize);
+
+        for (GLsizei j = 1; j < destHeight; j++)
+            memcpy(dest + (j * width * pixelSize), dest, destWidth*pixelSize);
+
+        endWrite(destX, destY, destWidth, destHeight);
+        return true;
+    }
 }
 
 
 
-VncManager::ActionQueue::DesktopSizeItem* VncManager::ActionQueue::DesktopSizeItem::createFromPipe(Comm::MulticastPipe& pipe)  // static member
+bool VncManager::ShadowFramebuffer::setColourMapEntries(int firstColour, int numColours, const rfbCARD16* rgb)
 {
-    GLsizei newWidth;
-    GLsizei newHeight;
+    if ((firstColour < 0) || (numColours < 0) || ((firstColour + numColours) > ColourMap::SIZE))
+        return false;
+
+    mutex.lock();
+
+    for (int i = 0; i < numColours; i++)
+    {
+        colourMap.red[firstColour+i]   = rgb[3*i];
+        colourMap.green[firstColour+i] = rgb[3*i + 1];
+        colourMap.blue[firstColour+i]  = rgb[3*i + 2];
+    }
+    colourMapChanged = true;
+
+    // Every pixel may use one of the new entries:
+    if (layout == PIXEL_LAYOUT_INDEXED)
+        damage(0, 0, width, height);
+
+    mutex.unlock();
+
+    return true;
+}
+
+
+
+bool VncManager::ShadowFramebuffer::upload(TextureManager& texture, bool& uploaded)
+{
+    bool result = true;
+
+    uploaded = false;
+
+    mutex.lock();
+
+    if ( (anyDamage || !pendingCopies.empty())  &&
+         texture.isValid()                       &&
+         (texture.getWidth()       == width)     &&
+         (texture.getHeight()      == height)    &&
+         (texture.getPixelLayout() == layout)       )
+    {
+        // setColourMapEntries() has damaged every pixel the new colour map
+        // affects, so it only has to be in place before they are written:
+        if (colourMapChanged)
+        {
+            texture.setColourMap(colourMap);
+            colourMapChanged = false;
+        }
+
+        // Replay the pending copies first; the damaged blocks written below
+        // are already up to date with respect to them:
+        for (std::vector<PendingCopy>::const_iterator it = pendingCopies.begin(); it != pendingCopies.end(); ++it)
+        {
+            if (gpuCopyEnabled && !texture.copy(it->destX, it->destY, it->srcX, it->srcY, it->width, it->height))
+                gpuCopyEnabled = false;  // e.g., no framebuffer object support; stop trying
+
+            if (!gpuCopyEnabled)
+                damage(it->destX, it->destY, it->width, it->height);  // upload from pixels instead
+        }
+
+        if (!pendingCopies.empty())
+            uploaded = true;
+        pendingCopies.clear();
+
+        // Merge the damaged blocks into rectangles: first into runs of
+        // adjacent blocks within each block row, then runs spanning the same
+        // columns in successive rows are combined.
+        std::vector<DamageRect> rects;
+        std::vector<DamageRect> open;  // rectangles that may still grow upward
+        std::vector<DamageRect> next;
+
+        for (GLsizei row = 0; row <= damageRows; row++)
+        {
+            next.clear();
+
+            for (GLsizei col = 0; row < damageRows; )
+            {
+                while ((col < damageCols) && !damageMap[(row * damageCols) + col])
+                    col++;
+                if (col >= damageCols)
+                    break;
+
+                const GLsizei col0 = col;
+                while ((col < damageCols) && damageMap[(row * damageCols) + col])
+                    damageMap[(row * damageCols) + col++] = false;
+
+                DamageRect run;
+                run.col0 = col0;
+                run.col1 = col;
+                run.row0 = row;
+                run.row1 = row + 1;
+
+                for (std::vector<DamageRect>::iterator it = open.begin(); it != open.end(); ++it)
+                    if ((it->col0 == run.col0) && (it->col1 == run.col1))
+                    {
+                        run.row0 = it->row0;
+                        open.erase(it);
+                        break;
+                    }
+
+                next.push_back(run);
+            }
+
+            rects.insert(rects.end(), open.begin(), open.end());  // these did not continue into this row
+            open.swap(next);
+        }
+
+        anyDamage = false;
+
+        if (!rects.empty())
+            texture.beginPixelTransfer();  // load the colour map once for all rectangles
+
+        for (std::vector<DamageRect>::const_iterator it = rects.begin(); it != rects.end(); ++it)
+        {
+            const GLint   x = it->col0 * DAMAGE_BLOCK_SIZE;
+            const GLint   y = it->row0 * DAMAGE_BLOCK_SIZE;
+            const GLsizei w = (((it->col1 * DAMAGE_BLOCK_SIZE) < width)  ? (it->col1 * DAMAGE_BLOCK_SIZE) : width)  - x;
+            const GLsizei h = (((it->row1 * DAMAGE_BLOCK_SIZE) < height) ? (it->row1 * DAMAGE_BLOCK_SIZE) : height) - y;
+
+            if (!texture.write(x, y, w, h, pixels + (((y * width) + x) * pixelSize), width))
+                result = false;
+        }
+
+        if (!rects.empty())
+        {
+            texture.endPixelTransfer();
+            uploaded = true;
+        }
+    }
+
+    mutex.unlock();
+
+    return result;
+}
+
+
+
+bool VncManager::ShadowFramebuffer::isDamaged(GLint x, GLint y, GLsizei w, GLsizei h) const  // mutex must be held
+{
+    if (anyDamage && (w > 0) && (h > 0))
+    {
+        const GLsizei col0 = x / DAMAGE_BLOCK_SIZE;
+        const GLsizei col1 = (x + w - 1) / DAMAGE_BLOCK_SIZE;
+        const GLsizei row0 = y / DAMAGE_BLOCK_SIZE;
+        const GLsizei row1 = (y + h - 1) / DAMAGE_BLOCK_SIZE;
+
+        for (GLsizei row = row0; row <= row1; row++)
+            for (GLsizei col = col0; col <= col1; col++)
+                if (damageMap[(row * damageCols) + col])
+                    return true;
+    }
+
+    return false;
+}
+
+
+
+void VncManager::ShadowFramebuffer::damage(GLint x, GLint y, GLsizei w, GLsizei h)  // mutex must be held
+{
+    if ((w > 0) && (h > 0))
+    {
+        const GLsizei col0 = x / DAMAGE_BLOCK_SIZE;
+        const GLsizei col1 = (x + w - 1) / DAMAGE_BLOCK_SIZE;
+        const GLsizei row0 = y / DAMAGE_BLOCK_SIZE;
+        const GLsizei row1 = (y + h - 1) / DAMAGE_BLOCK_SIZE;
+
+        for (GLsizei row = row0; row <= row1; row++)
+            for (GLsizei col = col0; col <= col1; col++)
+                damageMap[(row * damageCols) + col] = true;
+
+        anyDamage = true;
+    }
+}
+
+
+
+//----------------------------------------------------------------------
+// VncManager::ActionQueue::*Item methods
+
+VncManager::ActionQueue::Item::~Item()
+{
+}
+
+
+
+bool VncManager::ActionQueue::Item::indicatesClose() const
+{
+    return false;
+}
+
+
+
+VncManager::ActionQueue::Item* VncManager::ActionQueue::Item::createFromPipeContainingTypeCode(ActionQueue& actionQueue, Comm::MulticastPipe& pipe)  // static member
+{
+    ItemType itemType;
+    pipe.read(itemType);
+
+    switch (itemType)
+    {
+        case ItemType_GetPasswordItem:              return GetPasswordItem::createFromPipe(pipe);
+        case ItemType_InitDisplayItem:              return InitDisplayItem::createFromPipe(pipe);
+        case ItemType_DesktopSizeItem:              return DesktopSizeItem::createFromPipe(pipe);
+        case ItemType_WriteItem:                    return WriteItem::createFromPipe(pipe);
+        case ItemType_CopyItem:                     return CopyItem::createFromPipe(pipe);
+        case ItemType_FillItem:                     return FillItem::createFromPipe(pipe);
+        case ItemType_ColourMapItem:                return ColourMapItem::createFromPipe(pipe);
+        case ItemType_InternalErrorMessageItem:     return InternalErrorMessageItem::createFromPipe(pipe);
+        case ItemType_ErrorMessageItem:             return ErrorMessageItem::createFromPipe(pipe);
+        case ItemType_ErrorMessageFromServerItem:   return ErrorMessageFromServerItem::createFromPipe(pipe);
+        case ItemType_InfoServerInitStartedItem:    return InfoServerInitStartedItem::createFromPipe(pipe);
+        case ItemType_InfoProtocolVersionItem:      return InfoProtocolVersionItem::createFromPipe(pipe);
+        case ItemType_InfoAuthenticationResultItem: return InfoAuthenticationResultItem::createFromPipe(pipe);
+        case ItemType_InfoServerInitCompletedItem:  return InfoServerInitCompletedItem::createFromPipe(pipe);
+        case ItemType_InfoDesktopSizeReceivedItem:  return InfoDesktopSizeReceivedItem::createFromPipe(pipe);
+        case ItemType_InfoCloseStartedItem:         return InfoCloseStartedItem::createFromPipe(pipe);
+        case ItemType_InfoCloseCompletedItem:       return InfoCloseCompletedItem::createFromPipe(pipe);
+        case ItemType_InfoEncodingPolicyChangedItem: return InfoEncodingPolicyChangedItem::createFromPipe(pipe);
+
+        default:
+        {
+            std::string message = "Unknown ItemType from MulticastPipe: ";
+            message += (int)itemType;
+            actionQueue.addAndBroadcast(new ActionQueue::InternalErrorMessageItem("VncManager::ActionQueue::Item::createFromPipeContainingTypeCode", message.c_str()));
+            return 0;
+        }
+    }
+}
+
+
+
+VncManager::ActionQueue::GetPasswordItem* VncManager::ActionQueue::GetPasswordItem::createFromPipe(Comm::MulticastPipe& pipe)  // static member
+{
+    return new GetPasswordItem();
+}
+
+
+
+void VncManager::ActionQueue::GetPasswordItem::broadcast(Comm::MulticastPipe& pipe) const
+{
+    pipe.write(ItemType_GetPasswordItem);
+
+    pipe.finishMessage();
+}
+
+
+
+bool VncManager::ActionQueue::GetPasswordItem::perform(VncManager& vncManager)
+{
+    vncManager.initiatePasswordRetrieval();
+}
+
+
+
+VncManager::ActionQueue::InitDisplayItem* VncManager::ActionQueue::InitDisplayItem::createFromPipe(Comm::MulticastPipe& pipe)  // static member
+{
+    rfbServerInitMsg si;
+    memset(&si, 0, sizeof(si));
+
+    si.framebufferWidth    = pipe.read<unsigned int>();
+    si.framebufferHeight   = pipe.read<unsigned int>();
+    si.format.bitsPerPixel = pipe.read<unsigned char>();
+    si.format.depth        = pipe.read<unsigned char>();
+    si.format.bigEndian    = pipe.read<unsigned char>();
+    si.format.trueColour   = pipe.read<unsigned char>();
+    si.format.redMax       = pipe.read<unsigned int>();
+    si.format.greenMax     = pipe.read<unsigned int>();
+    si.format.blueMax      = pipe.read<unsigned int>();
+    si.format.redShift     = pipe.read<unsigned char>();
+    si.format.greenShift   = pipe.read<unsigned char>();
+    si.format.blueShift    = pipe.read<unsigned char>();
+    si.nameLength          = pipe.read<unsigned long>();
+
+    std::string desktopName;
+    readString(pipe, desktopName);
+
+    const PixelLayout layout = (PixelLayout)pipe.read<int>();
+
+    return new InitDisplayItem(si, desktopName.c_str(), layout);
+}
+
+
+
+void VncManager::ActionQueue::InitDisplayItem::broadcast(Comm::MulticastPipe& pipe) const
+{
+    pipe.write(ItemType_InitDisplayItem);
+
+    pipe.write<unsigned int>(si.framebufferWidth);
+    pipe.write<unsigned int>(si.framebufferHeight);
+    pipe.write<unsigned char>(si.format.bitsPerPixel);
+    pipe.write<unsigned char>(si.format.depth);
+    pipe.write<unsigned char>(si.format.bigEndian);
+    pipe.write<unsigned char>(si.format.trueColour);
+    pipe.write<unsigned int>(si.format.redMax);
+    pipe.write<unsigned int>(si.format.greenMax);
+    pipe.write<unsigned int>(si.format.blueMax);
+    pipe.write<unsigned char>(si.format.redShift);
+    pipe.write<unsigned char>(si.format.greenShift);
+    pipe.write<unsigned char>(si.format.blueShift);
+    pipe.write<unsigned long>(si.nameLength);
+
+    writeString(pipe, desktopName);
+
+    pipe.write<int>(layout);
+
+    pipe.finishMessage();
+}
+
+
+
+bool VncManager::ActionQueue::InitDisplayItem::perform(VncManager& vncManager)
+{
+    // The master node's remoteCommThread has already sized the remoteFramebuffer:
+    if (vncManager.getIsSlave() && !vncManager.getRemoteFramebuffer().resize(si.framebufferWidth, si.framebufferHeight, layout))
+        return false;
+
+    TextureManager& remoteDisplay = vncManager.getRemoteDisplay();
+    remoteDisplay.close();
+    return remoteDisplay.init(si.framebufferWidth, si.framebufferHeight, layout);
+}
+
+
+
+VncManager::ActionQueue::DesktopSizeItem* VncManager::ActionQueue::DesktopSizeItem::createFromPipe(Comm::MulticastPipe& pipe)  // static member
+{
+    GLsizei newWidth;
+    GLsizei newHeight;
 
     pipe.read(newWidth);
     pipe.read(newHeight);
@@ -1013,9 +1747,12 @@ void VncManager::ActionQueue::DesktopSizeItem::broadcast(Comm::MulticastPipe& pi
 
 bool VncManager::ActionQueue::DesktopSizeItem::perform(VncManager& vncManager)
 {
-    TextureManager& remoteDisplay = vncManager.getRemoteDisplay();
+    TextureManager&    remoteDisplay     = vncManager.getRemoteDisplay();
+    ShadowFramebuffer& remoteFramebuffer = vncManager.getRemoteFramebuffer();
 
-    const bool succeeded = remoteDisplay.reinit(newWidth, newHeight);
+    // The master node's remoteCommThread has already resized the remoteFramebuffer:
+    const bool succeeded = ( (!vncManager.getIsSlave() || remoteFramebuffer.resize(newWidth, newHeight, remoteFramebuffer.getPixelLayout())) &&
+                             remoteDisplay.reinit(newWidth, newHeight) );
     if (!succeeded)
         vncManager.shutdown();  // cannot safely continue
 
@@ -1026,23 +1763,25 @@ bool VncManager::ActionQueue::DesktopSizeItem::perform(VncManager& vncManager)
 
 VncManager::ActionQueue::WriteItem* VncManager::ActionQueue::WriteItem::createFromPipe(Comm::MulticastPipe& pipe)  // static member
 {
-    GLint                    destX;
-    GLint                    destY;
-    GLsizei                  srcWidth;
-    GLsizei                  srcHeight;
-    Images::RGBImage::Color* srcData;
+    GLint    destX;
+    GLint    destY;
+    GLsizei  srcWidth;
+    GLsizei  srcHeight;
+    size_t   pixelSize;
+    GLubyte* srcData;
 
     pipe.read(destX);
     pipe.read(destY);
     pipe.read(srcWidth);
     pipe.read(srcHeight);
+    pipe.read(pixelSize);
 
-    srcData = new Images::RGBImage::Color [srcWidth*srcHeight];
+    srcData = new GLubyte [srcWidth*srcHeight*pixelSize];
     try
     {
-        pipe.readRaw(srcData, srcWidth*srcHeight*sizeof(*srcData));
+        pipe.readRaw(srcData, srcWidth*srcHeight*pixelSize);
 
-        return new WriteItem(destX, destY, srcWidth, srcHeight, srcData);
+        return new WriteItem(destX, destY, srcWidth, srcHeight, pixelSize, srcData);
     }
     catch (...)
     {
@@ -1061,7 +1800,8 @@ void VncManager::ActionQueue::WriteItem::broadcast(Comm::MulticastPipe& pipe) co
     pipe.write(destY);
     pipe.write(srcWidth);
     pipe.write(srcHeight);
-    pipe.writeRaw(srcData, srcWidth*srcHeight*sizeof(*srcData));
+    pipe.write(pixelSize);
+    pipe.writeRaw(srcData, srcWidth*srcHeight*pixelSize);
 
     pipe.finishMessage();
 }
@@ -1070,8 +1810,10 @@ void VncManager::ActionQueue::WriteItem::broadcast(Comm::MulticastPipe& pipe) co
 
 bool VncManager::ActionQueue::WriteItem::perform(VncManager& vncManager)
 {
-    TextureManager& remoteDisplay = vncManager.getRemoteDisplay();
-    return remoteDisplay.write(destX, destY, srcWidth, srcHeight, srcData);
+    if (pixelSize != vncManager.getRemoteFramebuffer().getPixelSize())
+        return false;
+
+    return vncManager.getRemoteFramebuffer().write(destX, destY, srcWidth, srcHeight, srcData);
 }
 
 
@@ -1123,27 +1865,26 @@ void VncManager::ActionQueue::CopyItem::broadcast(Comm::MulticastPipe& pipe) con
 
 bool VncManager::ActionQueue::CopyItem::perform(VncManager& vncManager)
 {
-    TextureManager& remoteDisplay = vncManager.getRemoteDisplay();
-    return remoteDisplay.copy(destX, destY, srcX, srcY, srcWidth, srcHeight);
+    return vncManager.getRemoteFramebuffer().copy(destX, destY, srcX, srcY, srcWidth, srcHeight);
 }
 
 
 
 VncManager::ActionQueue::FillItem* VncManager::ActionQueue::FillItem::createFromPipe(Comm::MulticastPipe& pipe)  // static member
 {
-    GLint                   destX;
-    GLint                   destY;
-    GLsizei                 destWidth;
-    GLsizei                 destHeight;
-    Images::RGBImage::Color color;
+    GLint   destX;
+    GLint   destY;
+    GLsizei destWidth;
+    GLsizei destHeight;
+    GLubyte pixel[MAX_PIXEL_SIZE];
 
     pipe.read(destX);
     pipe.read(destY);
     pipe.read(destWidth);
     pipe.read(destHeight);
-    pipe.readRaw(&color, sizeof(color));
+    pipe.readRaw(pixel, sizeof(pixel));
 
-    return new FillItem(destX, destY, destWidth, destHeight, color);
+    return new FillItem(destX, destY, destWidth, destHeight, pixel, sizeof(pixel));
 }
 
 
@@ -1156,7 +1897,7 @@ void VncManager::ActionQueue::FillItem::broadcast(Comm::MulticastPipe& pipe) con
     pipe.write(destY);
     pipe.write(destWidth);
     pipe.write(destHeight);
-    pipe.writeRaw(&color, sizeof(color));
+    pipe.writeRaw(pixel, sizeof(pixel));
 
     pipe.finishMessage();
 }
@@ -1165,8 +1906,50 @@ void VncManager::ActionQueue::FillItem::broadcast(Comm::MulticastPipe& pipe) con
 
 bool VncManager::ActionQueue::FillItem::perform(VncManager& vncManager)
 {
-    TextureManager& remoteDisplay = vncManager.getRemoteDisplay();
-    return remoteDisplay.fill(destX, destY, destWidth, destHeight, color);
+    return vncManager.getRemoteFramebuffer().fill(destX, destY, destWidth, destHeight, pixel);
+}
+
+
+
+VncManager::ActionQueue::ColourMapItem* VncManager::ActionQueue::ColourMapItem::createFromPipe(Comm::MulticastPipe& pipe)  // static member
+{
+    int firstColour;
+    int numColours;
+
+    pipe.read(firstColour);
+    pipe.read(numColours);
+
+    // the master only broadcasts ranges that fit the colour map, so any
+    // other range means the pipe is corrupt; don't allocate for it
+    if ((firstColour < 0) || (numColours < 0) || ((firstColour + numColours) > ColourMap::SIZE))
+        return 0;
+
+    std::vector<rfbCARD16> rgb(3*numColours);
+    if (numColours > 0)
+        pipe.read(&rgb[0], rgb.size());
+
+    return new ColourMapItem(firstColour, numColours, rgb.empty() ? 0 : &rgb[0]);
+}
+
+
+
+void VncManager::ActionQueue::ColourMapItem::broadcast(Comm::MulticastPipe& pipe) const
+{
+    pipe.write(ItemType_ColourMapItem);
+
+    pipe.write(firstColour);
+    pipe.write(numColours);
+    if (numColours > 0)
+        pipe.write(&rgb[0], rgb.size());
+
+    pipe.finishMessage();
+}
+
+
+
+bool VncManager::ActionQueue::ColourMapItem::perform(VncManager& vncManager)
+{
+    return vncManager.getRemoteFramebuffer().setColourMapEntries(firstColour, numColours, rgb.empty() ? 0 : &rgb[0]);
 }
 
 
@@ -1427,7 +2210,7 @@ void VncManager::ActionQueue::InfoDesktopSizeReceivedItem::broadcast(Comm::Multi
 bool VncManager::ActionQueue::InfoDesktopSizeReceivedItem::perform(VncManager& vncManager)
 {
     vncManager.messageManager.infoDesktopSizeReceived(newWidth, newHeight);
-    return vncManager.sendFramebufferUpdateRequest(0, 0, newWidth, newHeight, false);
+    return vncManager.enqueueFramebufferUpdateRequest(0, 0, newWidth, newHeight, false);
 }
 
 
@@ -1487,10 +2270,51 @@ bool VncManager::ActionQueue::InfoCloseCompletedItem::indicatesClose() const
 
 
 
-//----------------------------------------------------------------------
-// VncManager::ActionQueue methods
-
-VncManager::ActionQueue::~ActionQueue()
+VncManager::ActionQueue::InfoEncodingPolicyChangedItem* VncManager::ActionQueue::InfoEncodingPolicyChangedItem::createFromPipe(Comm::MulticastPipe& pipe)  // static member
+{
+    rfb::RFBProtocol::EncodingPolicyStats stats;
+    int                                   policy;
+
+    pipe.read(policy);
+    pipe.read(stats.linkThroughput);
+    pipe.read(stats.decodeNsecPerPixel);
+    pipe.read(stats.bytesPerPixel);
+    pipe.read(stats.changes);
+
+    stats.policy = (rfb::RFBProtocol::EncodingPolicy)policy;
+
+    return new InfoEncodingPolicyChangedItem(stats);
+}
+
+
+
+void VncManager::ActionQueue::InfoEncodingPolicyChangedItem::broadcast(Comm::MulticastPipe& pipe) const
+{
+    pipe.write(ItemType_InfoEncodingPolicyChangedItem);
+
+    pipe.write((int)stats.policy);
+    pipe.write(stats.linkThroughput);
+    pipe.write(stats.decodeNsecPerPixel);
+    pipe.write(stats.bytesPerPixel);
+    pipe.write(stats.changes);
+
+    pipe.finishMessage();
+}
+
+
+
+bool VncManager::ActionQueue::InfoEncodingPolicyChangedItem::perform(VncManager& vncManager)
+{
+    vncManager.messageManager.infoEncodingPolicyChanged(stats);
+    return true;
+}
+
+
+
+//----------------------------------------------------------------------
+// VncManager::ActionQueue methods
+
+VncManager::ActionQueue::~ActionQueue()
 {
     flush(true);
 
@@ -1529,6 +2353,19 @@ void VncManager::ActionQueue::addAndBroadcast(Item* item)  // called from remote
 
 
 
+void VncManager::ActionQueue::broadcastOnly(Item* item)  // called from remoteCommThread
+{
+    if (item)
+    {
+        if (clusterMulticastPipe)
+            item->broadcast(*clusterMulticastPipe);
+
+        delete item;
+    }
+}
+
+
+
 VncManager::ActionQueue::Item* VncManager::ActionQueue::removeNext()  // called from remoteCommThread
 {
     mutex.lock();
@@ -1623,7 +2460,17 @@ VncManager::RFBProtocolStartupData::RFBProtocolStartupData() :
     rfbPort(0),
     requestedPixelFormat(DefaultRequestedPixelFormat),
     requestedEncodings(0),
-    sharedDesktopFlag(false)
+    sharedDesktopFlag(false),
+    commBufferSize(0),
+    connectTimeout(0),
+    socketOptions(),
+    localSocketPath(0),
+    recordFileName(0),
+    replayFileName(0),
+    replayRealTime(false),
+    adaptiveEncodings(false),
+    pixelLayout(PIXEL_LAYOUT_RGB),
+    preconnectedSocket(-1)
 {
 }
 
@@ -1639,6 +2486,459 @@ void VncManager::MessageManager::errorMessageFromServer(const char* where, const
 
 
 
+void VncManager::MessageManager::infoEncodingPolicyChanged(const rfb::RFBProtocol::EncodingPolicyStats& stats)
+{
+    // default implementation does nothing...
+}
+
+
+
+//----------------------------------------------------------------------
+// VncManager::OutboundQueue methods
+
+VncManager::OutboundQueue::OutboundQueue() :
+    head(0),
+    tail(0),
+    consumerWaiting(false),
+    stopRequested(false),
+    mutex(),
+    cond()
+{
+    memset(messages, 0, sizeof(messages));
+}
+
+
+
+VncManager::OutboundQueue::~OutboundQueue()
+{
+    reset();
+}
+
+
+
+bool VncManager::OutboundQueue::enqueue(const Message& message)  // called from main thread
+{
+    const unsigned t = tail;
+    if ((t - head) >= CAPACITY)
+        return false;  // full
+    else
+    {
+        Message& slot = messages[t & (CAPACITY-1)];
+        slot     = message;
+        slot.str = 0;
+
+        if (message.str)
+        {
+            try
+            {
+                slot.str = new char [message.len];  // may throw exception
+            }
+            catch (...)
+            {
+                return false;
+            }
+
+            memcpy(slot.str, message.str, message.len);
+        }
+
+        __sync_synchronize();  // publish the slot contents before the new tail
+        tail = t + 1;
+        __sync_synchronize();  // publish the new tail before checking consumerWaiting
+
+        if (consumerWaiting)
+        {
+            mutex.lock();
+            cond.signal();
+            mutex.unlock();
+        }
+
+        return true;
+    }
+}
+
+
+
+void VncManager::OutboundQueue::requestStop()  // called from main thread
+{
+    mutex.lock();
+    stopRequested = true;
+    cond.signal();
+    mutex.unlock();
+}
+
+
+
+void VncManager::OutboundQueue::reset()  // called from main thread while sendThread is not running
+{
+    for ( ; head != tail; head++)
+    {
+        Message& slot = messages[head & (CAPACITY-1)];
+        if (slot.str)
+        {
+            delete [] slot.str;
+            slot.str = 0;
+        }
+    }
+
+    stopRequested = false;
+}
+
+
+
+bool VncManager::OutboundQueue::dequeue(Message& message)  // called from sendThread
+{
+    const unsigned h = head;
+    if (h == tail)
+        return false;  // empty
+    else
+    {
+        __sync_synchronize();  // read the slot contents only after seeing the new tail
+        message = messages[h & (CAPACITY-1)];
+        __sync_synchronize();  // finish reading the slot before releasing it
+        head = h + 1;
+
+        return true;
+    }
+}
+
+
+
+bool VncManager::OutboundQueue::waitForMessage()  // called from sendThread
+{
+    mutex.lock();
+
+    consumerWaiting = true;
+    __sync_synchronize();  // publish consumerWaiting before re-checking tail
+
+    while (!stopRequested && (head == tail))
+        cond.wait(mutex);
+
+    consumerWaiting = false;
+
+    const bool result = !stopRequested;
+
+    mutex.unlock();
+
+    return result;
+}
+
+
+
+//----------------------------------------------------------------------
+// VncManager::ConnectionPool methods
+
+VncManager::ConnectionPool::ConnectionPool(unsigned maxRetrySeconds) :
+    maxRetrySeconds(maxRetrySeconds),
+    entries(),
+    mutex(),
+    thread(),
+    threadStarted(false),
+    stopRequested(false)
+{
+    if (pipe(wakeupPipe) < 0)
+        wakeupPipe[0] = wakeupPipe[1] = -1;
+    else
+    {
+        fcntl(wakeupPipe[0], F_SETFL, fcntl(wakeupPipe[0], F_GETFL) | O_NONBLOCK);
+        fcntl(wakeupPipe[1], F_SETFL, fcntl(wakeupPipe[1], F_GETFL) | O_NONBLOCK);
+    }
+}
+
+
+
+VncManager::ConnectionPool::~ConnectionPool()
+{
+    stop();
+
+    for (std::vector<Entry>::iterator it = entries.begin(); it != entries.end(); ++it)
+        if (it->sock >= 0)
+        {
+            ::close(it->sock);
+            it->sock = -1;
+        }
+
+    if (wakeupPipe[0] >= 0) ::close(wakeupPipe[0]);
+    if (wakeupPipe[1] >= 0) ::close(wakeupPipe[1]);
+}
+
+
+
+void VncManager::ConnectionPool::addDesktop(const RFBProtocolStartupData& startupData)  // called from main thread
+{
+    if (!threadStarted)
+    {
+        Entry entry;
+        entry.desktopHost     = startupData.desktopHost ? startupData.desktopHost : "";
+        entry.rfbPort         = startupData.rfbPort;
+        entry.connectTimeout  = startupData.connectTimeout;
+        entry.socketOptions   = startupData.socketOptions;
+        entry.localSocketPath = startupData.localSocketPath ? startupData.localSocketPath : "";
+        entry.sock            = -1;
+        entry.retryTime       = 0;
+        entry.failures        = 0;
+
+        entries.push_back(entry);
+    }
+}
+
+
+
+void VncManager::ConnectionPool::start()  // called from main thread
+{
+    if (!threadStarted && !entries.empty())
+    {
+        stopRequested = false;
+        threadStarted = true;
+        thread.start(this, &ConnectionPool::threadStart);
+    }
+}
+
+
+
+void VncManager::ConnectionPool::stop()  // called from main thread
+{
+    if (threadStarted)
+    {
+        stopRequested = true;
+        if (wakeupPipe[1] >= 0)
+        {
+            const char wakeup = 0;
+            (void)::write(wakeupPipe[1], &wakeup, 1);
+        }
+
+        // Hostname resolution may block for a long time, so don't wait for it.
+        thread.cancel();
+
+        if (!thread.isJoined())
+            thread.join();
+
+        threadStarted = false;
+    }
+}
+
+
+
+int VncManager::ConnectionPool::take(const char* desktopHost, unsigned rfbPort)  // called from main thread
+{
+    if (!desktopHost)
+        desktopHost = "";
+
+    int result = -1;
+
+    mutex.lock();
+    for (std::vector<Entry>::iterator it = entries.begin(); it != entries.end(); ++it)
+        if ((it->rfbPort == rfbPort) && (it->desktopHost == desktopHost))
+        {
+            if (it->sock >= 0)
+            {
+                if (checkSpareSocket(it->sock))
+                    result = it->sock;
+                else
+                    ::close(it->sock);
+            }
+
+            // The spare has been used (or at least asked for), so replace it right away:
+            it->sock      = -1;
+            it->retryTime = 0;
+            it->failures  = 0;
+            break;
+        }
+    mutex.unlock();
+
+    if (wakeupPipe[1] >= 0)
+    {
+        const char wakeup = 0;
+        (void)::write(wakeupPipe[1], &wakeup, 1);
+    }
+
+    return result;
+}
+
+
+
+void* VncManager::ConnectionPool::threadStart()  // called from thread
+{
+    // Cancellation is only enabled around ConnectToServer() and the idle wait,
+    // never while the mutex is held or a new socket is not yet in entries.
+    Threads::Thread::setCancelState(Threads::Thread::CANCEL_DISABLE);
+    Threads::Thread::setCancelType(Threads::Thread::CANCEL_DEFERRED);
+
+    while (!stopRequested)
+    {
+        // Find a desktop that needs a (new) spare socket.  A spare is only
+        // replaced once it has been taken or the server has closed it, so
+        // servers do not see a stream of unauthenticated connections.
+        const time_t now = time(0);
+        int          next = -1;
+
+        mutex.lock();
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            Entry& entry = entries[i];
+
+            if ((entry.sock >= 0) && !checkSpareSocket(entry.sock))
+            {
+                ::close(entry.sock);
+                entry.sock = -1;
+                scheduleRetry(i);
+            }
+
+            if ((next < 0) && (entry.sock < 0) && (now >= entry.retryTime))
+                next = (int)i;
+        }
+        mutex.unlock();
+
+        if (next >= 0)
+        {
+            // Connect without holding the mutex; entries itself never changes once started.
+            struct sockaddr_in address;
+            const char*        failure = 0;
+
+            Threads::Thread::setCancelState(Threads::Thread::CANCEL_ENABLE);
+            int sock = -1;
+            if (!entries[next].localSocketPath.empty())
+                sock = rfb::RFBProtocol::ConnectToLocalServer(entries[next].localSocketPath.c_str(), failure);
+            if (sock < 0)
+                sock = rfb::RFBProtocol::ConnectToServer(entries[next].desktopHost.c_str(), entries[next].rfbPort, entries[next].connectTimeout, address, failure, -1, &entries[next].socketOptions);
+            Threads::Thread::setCancelState(Threads::Thread::CANCEL_DISABLE);
+
+            // Go as far into the handshake as possible without the password:
+            if ((sock >= 0) && !waitForGreeting(sock, (entries[next].connectTimeout > 0) ? entries[next].connectTimeout : (unsigned)GREETING_TIMEOUT_MSEC))
+            {
+                ::close(sock);
+                sock = -1;
+            }
+
+            mutex.lock();
+            Entry& entry = entries[next];
+            if (sock < 0)
+            {
+                if (!stopRequested)
+                    scheduleRetry(next);
+            }
+            else if (entry.sock >= 0)
+                ::close(sock);  // should not happen
+            else
+                entry.sock = sock;
+            mutex.unlock();
+        }
+        else
+        {
+            struct pollfd pfd;
+            pfd.fd      = wakeupPipe[0];
+            pfd.events  = POLLIN;
+            pfd.revents = 0;
+
+            Threads::Thread::setCancelState(Threads::Thread::CANCEL_ENABLE);
+            const int pollResult = poll(&pfd, ((wakeupPipe[0] >= 0) ? 1 : 0), CHECK_INTERVAL_MSEC);
+            Threads::Thread::setCancelState(Threads::Thread::CANCEL_DISABLE);
+
+            if (pollResult > 0)
+            {
+                char buf[64];
+                while (::read(wakeupPipe[0], buf, sizeof(buf)) > 0)
+                    ;
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+
+bool VncManager::ConnectionPool::waitForGreeting(int sock, unsigned timeoutMsec)
+{
+    // The server sends its ProtocolVersion message as soon as the
+    // connection is accepted.  It is only peeked at, so that the
+    // RFBProtocol that takes over sock reads it as usual.  This runs with
+    // cancellation disabled, so stop() gets through via wakeupPipe.
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (!stopRequested)
+    {
+        rfbProtocolVersionMsg pv;
+        const ssize_t ne = recv(sock, pv, sz_rfbProtocolVersionMsg, MSG_PEEK | MSG_DONTWAIT);
+        if (ne == sz_rfbProtocolVersionMsg)
+        {
+            pv[sz_rfbProtocolVersionMsg] = 0;
+
+            int major, minor;
+            return (sscanf(pv, rfbProtocolVersionFormat, &major, &minor) == 2);
+        }
+        else if ((ne == 0) || ((ne < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)))
+            return false;
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        const long elapsedMsec = ((now.tv_sec - start.tv_sec) * 1000L) + ((now.tv_nsec - start.tv_nsec) / 1000000L);
+        if (elapsedMsec >= (long)timeoutMsec)
+            return false;
+
+        // Wait for more data, or for stop():
+        struct pollfd pfds[2];
+        pfds[0].fd      = sock;
+        pfds[0].events  = POLLIN;
+        pfds[0].revents = 0;
+        pfds[1].fd      = wakeupPipe[0];
+        pfds[1].events  = POLLIN;
+        pfds[1].revents = 0;
+
+        if ((poll(pfds, ((wakeupPipe[0] >= 0) ? 2 : 1), (int)(timeoutMsec - elapsedMsec)) > 0) && (pfds[1].revents & POLLIN))
+        {
+            char buf[64];
+            while (::read(wakeupPipe[0], buf, sizeof(buf)) > 0)
+                ;  // take() only asks for a replacement, which is what we are doing
+        }
+    }
+
+    return false;
+}
+
+
+
+void VncManager::ConnectionPool::scheduleRetry(size_t entryIndex)
+{
+    Entry& entry = entries[entryIndex];
+
+    // RETRY_SECONDS, doubled for each further consecutive failure:
+    unsigned delay = RETRY_SECONDS;
+    for (unsigned i = 0; (i < entry.failures) && (delay < maxRetrySeconds); i++)
+        delay *= 2;
+    if (delay > maxRetrySeconds)
+        delay = maxRetrySeconds;
+
+    entry.retryTime = time(0) + delay;
+    entry.failures++;
+}
+
+
+
+bool VncManager::ConnectionPool::checkSpareSocket(int sock) const
+{
+    // The server sends its ProtocolVersion as soon as we connect, so data
+    // waiting on sock is expected; only EOF or an error means it is gone.
+    struct pollfd pfd;
+    pfd.fd      = sock;
+    pfd.events  = POLLIN;
+    pfd.revents = 0;
+
+    if (poll(&pfd, 1, 0) < 0)
+        return false;
+    else if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+        return false;
+    else if (pfd.revents & POLLIN)
+    {
+        char c;
+        return (recv(sock, &c, 1, MSG_PEEK) > 0);
+    }
+    else
+        return true;
+}
+
+
+
 //----------------------------------------------------------------------
 // VncManager::RFBProtocolImplementation methods
 
@@ -1647,9 +2947,34 @@ void* VncManager::RFBProtocolImplementation::threadStartForMasterNode(RFBProtoco
     Threads::Thread::setCancelState(Threads::Thread::CANCEL_ENABLE);
     Threads::Thread::setCancelType(Threads::Thread::CANCEL_ASYNCHRONOUS);
 
-    bool initSucceeded = (startupData.initViaConnect)
-                             ? initViaConnect(startupData.desktopHost, startupData.rfbPort, startupData.requestedPixelFormat, startupData.requestedEncodings, startupData.sharedDesktopFlag)
-                             : initViaListen(startupData.rfbPort, startupData.requestedPixelFormat, startupData.requestedEncodings, startupData.sharedDesktopFlag);
+    (void)setCommBufferSize(startupData.commBufferSize);
+    (void)setConnectTimeout(startupData.connectTimeout);
+    (void)setSocketOptions(startupData.socketOptions);
+    (void)setLocalSocketPath(startupData.localSocketPath);
+    (void)setRecordFileName(startupData.recordFileName);
+    (void)setAdaptiveEncodings(startupData.adaptiveEncodings);
+    (void)setPreconnectedSocket(startupData.preconnectedSocket);  // only used by initViaConnect(); closed by close() otherwise
+
+    // Layouts other than PIXEL_LAYOUT_RGB take the server's pixels as they
+    // are, so the server must send them in exactly that layout:
+    rfbPixelFormat requestedPixelFormat = startupData.requestedPixelFormat;
+    pixelLayout = startupData.pixelLayout;
+    if ((pixelLayout < 0) || (pixelLayout >= NUM_PIXEL_LAYOUTS))
+        pixelLayout = PIXEL_LAYOUT_RGB;
+    (void)getPixelLayoutFormat(pixelLayout, requestedPixelFormat);
+
+    bool initSucceeded = (startupData.replayFileName)
+                             ? initViaReplay(startupData.replayFileName, requestedPixelFormat, startupData.requestedEncodings, startupData.replayRealTime)
+                             : (startupData.initViaConnect)
+                                 ? initViaConnect(startupData.desktopHost, startupData.rfbPort, requestedPixelFormat, startupData.requestedEncodings, startupData.sharedDesktopFlag)
+                                 : initViaListen(startupData.rfbPort, requestedPixelFormat, startupData.requestedEncodings, startupData.sharedDesktopFlag);
+
+    if (initSucceeded)
+    {
+        // The server sends pixels in the requested format from now on:
+        pixelConverter = rfb::PixelKernels::getConverter(getPixelFormat());
+        bytesPerPixel  = getPixelFormat().bitsPerPixel/8;
+    }
 
     if (initSucceeded)
         initSucceeded = ( sendSetPixelFormat() &&
@@ -1660,6 +2985,9 @@ void* VncManager::RFBProtocolImplementation::threadStartForMasterNode(RFBProtoco
         while (getIsOpen() && handleRFBServerMessage())
             ;
 
+    if (getIsReplaying())
+        close();  // the recording has ended; this stops the clock for getReceiveStats()
+
     return 0;
 }
 
@@ -1683,9 +3011,29 @@ void VncManager::RFBProtocolImplementation::close()
 
 bool VncManager::RFBProtocolImplementation::receivedSetColourMapEntries(const rfbSetColourMapEntriesMsg& msg)
 {
-    // We're using true color, so we don't expect to get this message...
-    errorMessage("VncManager::RFBProtocolImplementation::receivedSetColourMapEntries", "received unexpected SetColourMapEntries message");
-    return false;
+    // The colours follow the message; they are read even if the pixel
+    // format is true color, so that the following messages stay in step:
+    std::vector<rfbCARD16> rgb(3*msg.nColours);
+    if (!rgb.empty() && !readFromRFBServer(&rgb[0], rgb.size()*sizeof(rfbCARD16)))
+    {
+        if (getIsOpen()) errorMessage("VncManager::RFBProtocolImplementation::receivedSetColourMapEntries", "socket read error");
+        return false;
+    }
+
+    for (size_t i = 0; i < rgb.size(); i++)
+        rgb[i] = rfb::Swap16IfLE(rgb[i]);
+
+    const rfbCARD16* const colours = rgb.empty() ? 0 : &rgb[0];
+
+    if (!vncManager.getRemoteFramebuffer().setColourMapEntries(msg.firstColour, msg.nColours, colours))
+    {
+        errorMessage1l("VncManager::RFBProtocolImplementation::receivedSetColourMapEntries", "colour map entries out of range; first colour", msg.firstColour);
+        return false;
+    }
+    else if (actionQueue.getIsClustered())
+        actionQueue.broadcastOnly(new ActionQueue::ColourMapItem(msg.firstColour, msg.nColours, colours));
+
+    return true;
 }
 
 
@@ -1708,69 +3056,66 @@ void VncManager::RFBProtocolImplementation::copyRectData(void* data, int x, int
 {
     if ((w > 0) && (h > 0))
     {
-        const size_t pixelCount = (w * h);
+        ShadowFramebuffer& remoteFramebuffer = vncManager.getRemoteFramebuffer();
 
-        Images::RGBImage::Color* srcData = 0;
-        try
-        {
-            srcData = new Images::RGBImage::Color [pixelCount];  // may throw exception
-        }
-        catch (...)
-        {
-            // nothing...
-        }
+        // Note: bitmaps are handed to us in top-to-bottom row order, while
+        // remoteFramebuffer is bottom-to-top to be compatible with OpenGL.
+        const GLint destY = (GLint)framebufferHeight - y - (GLint)h;
 
-        if (!srcData)
-            errorMessage("VncManager::RFBProtocolImplementation::copyRectData", "unable to allocate pixel buffer");
+        GLubyte* const dest = remoteFramebuffer.beginWrite(x, destY, w, h);
+        if (!dest)
+            errorMessageRect("VncManager::RFBProtocolImplementation::copyRectData", "rectangle outside framebuffer", x, y, w, h);
         else
         {
-            Images::RGBImage::Color* dest = srcData;
+            const size_t   pixelSize    = remoteFramebuffer.getPixelSize();
+            const size_t   destRowBytes = remoteFramebuffer.getWidth()*pixelSize;
+            const GLubyte* src          = (const GLubyte*)data;
 
-            // Note: bitmaps are handed to us in top-to-bottom row order.
-            // We switch them to bottom-to-top to be compatible with OpenGL.
+            if (pixelLayout != PIXEL_LAYOUT_RGB)
+            {
+                // The server sends pixels in the remoteFramebuffer's layout:
+                for (size_t j = 0; j < h; j++)
+                    memcpy(dest + (j*destRowBytes), src + ((h-1-j)*w*bytesPerPixel), w*pixelSize);
+            }
+            else if (pixelConverter)
+            {
+                // Rows are converted by the rfb::PixelKernels converter selected
+                // for the pixel format, which writes the three GLubytes of each
+                // Images::RGBImage::Color:
+                for (size_t j = 0; j < h; j++)
+                    pixelConverter(dest + (j*destRowBytes), src + ((h-1-j)*w*bytesPerPixel), w, getPixelFormat());
+            }
+            else
+            {
+                remoteFramebuffer.endWrite(x, destY, 0, 0);  // nothing was written
+                errorMessage1l("VncManager::RFBProtocolImplementation::copyRectData", "illegal pixel format; not true color with bits/pixel 8, 16 or 32", getPixelFormat().bitsPerPixel);
+                return;
+            }
 
-            switch (si.format.bitsPerPixel)
+            // Slave nodes get their own copy of the stored pixels:
+            GLubyte* srcData = 0;
+            if (actionQueue.getIsClustered())
             {
-                case 8:
+                try
                 {
-                    for (size_t j = 0; j < h; j++)
-                    {
-                        const rfbCARD8* src = (const rfbCARD8*)data + ((h-1-j)*w);
-                        for (size_t i = 0; i < w; i++)
-                            *dest++ = convertPixelToRGB(si.format, *src++);
-                    }
+                    srcData = new GLubyte [w*h*pixelSize];  // may throw exception
                 }
-                break;
-
-                case 16:
+                catch (...)
                 {
-                    for (size_t j = 0; j < h; j++)
-                    {
-                        const rfbCARD16* src = (const rfbCARD16*)data + ((h-1-j)*w);
-                        for (size_t i = 0; i < w; i++)
-                            *dest++ = convertPixelToRGB(si.format, rfb::Swap16IfLE(*src++));
-                    }
+                    // nothing...
                 }
-                break;
 
-                case 32:
-                {
+                if (srcData)
                     for (size_t j = 0; j < h; j++)
-                    {
-                        const rfbCARD32* src = (const rfbCARD32*)data + ((h-1-j)*w);
-                        for (size_t i = 0; i < w; i++)
-                            *dest++ = convertPixelToRGB(si.format, rfb::Swap32IfLE(*src++));
-                    }
-                }
-                break;
-
-                default:
-                    errorMessage1l("VncManager::RFBProtocolImplementation::copyRectData", "illegal pixel format; bits/pixel not 8, 16 or 32", si.format.bitsPerPixel);
-                    delete [] srcData;
-                    return;
+                        memcpy(srcData + (j*w*pixelSize), dest + (j*destRowBytes), w*pixelSize);
             }
 
-            actionQueue.addAndBroadcast(new ActionQueue::WriteItem(x, framebufferHeight-1-y-h, w, h, srcData));  // srcData will be deleted by ~WriteItem()
+            remoteFramebuffer.endWrite(x, destY, w, h);
+
+            if (srcData)
+                actionQueue.broadcastOnly(new ActionQueue::WriteItem(x, destY, w, h, pixelSize, srcData));  // srcData will be deleted by ~WriteItem()
+            else if (actionQueue.getIsClustered())
+                errorMessage("VncManager::RFBProtocolImplementation::copyRectData", "unable to allocate pixel buffer");
         }
     }
 }
@@ -1779,14 +3124,46 @@ void VncManager::RFBProtocolImplementation::copyRectData(void* data, int x, int
 
 void VncManager::RFBProtocolImplementation::copyRect(int fromX, int fromY, int toX, int toY, size_t w, size_t h)
 {
-    actionQueue.addAndBroadcast(new ActionQueue::CopyItem(toX, toY, fromX, fromY, w, h));
+    const GLint srcY  = (GLint)framebufferHeight - fromY - (GLint)h;
+    const GLint destY = (GLint)framebufferHeight - toY   - (GLint)h;
+
+    if (!vncManager.getRemoteFramebuffer().copy(toX, destY, fromX, srcY, w, h))
+        errorMessageRect("VncManager::RFBProtocolImplementation::copyRect", "rectangle outside framebuffer", toX, toY, w, h);
+    else if (actionQueue.getIsClustered())
+        actionQueue.broadcastOnly(new ActionQueue::CopyItem(toX, destY, fromX, srcY, w, h));
 }
 
 
 
 void VncManager::RFBProtocolImplementation::fillRect(rfbCARD32 color, int x, int y, size_t w, size_t h)
 {
-    actionQueue.addAndBroadcast(new ActionQueue::FillItem(x, y, w, h, convertPixelToRGB(si.format, color)));
+    // color holds a pixel of the received width with its bytes as received,
+    // just like the data passed to copyRectData(), so it is narrowed back
+    // to that width and stored the same way:
+    const rfbCARD8  pixel8  = (rfbCARD8)color;
+    const rfbCARD16 pixel16 = (rfbCARD16)color;
+    const void*     src     = (bytesPerPixel == 1) ? (const void*)&pixel8 : (bytesPerPixel == 2) ? (const void*)&pixel16 : (const void*)&color;
+
+    GLubyte pixel[MAX_PIXEL_SIZE];
+
+    if (pixelLayout != PIXEL_LAYOUT_RGB)
+        memcpy(pixel, src, bytesPerPixel);
+    else if (pixelConverter)
+        pixelConverter(pixel, src, 1, getPixelFormat());
+    else
+    {
+        errorMessage1l("VncManager::RFBProtocolImplementation::fillRect", "illegal pixel format; not true color with bits/pixel 8, 16 or 32", getPixelFormat().bitsPerPixel);
+        return;
+    }
+
+    ShadowFramebuffer& remoteFramebuffer = vncManager.getRemoteFramebuffer();
+
+    const GLint destY = (GLint)framebufferHeight - y - (GLint)h;
+
+    if (!remoteFramebuffer.fill(x, destY, w, h, pixel))
+        errorMessageRect("VncManager::RFBProtocolImplementation::fillRect", "rectangle outside framebuffer", x, y, w, h);
+    else if (actionQueue.getIsClustered())
+        actionQueue.broadcastOnly(new ActionQueue::FillItem(x, destY, w, h, pixel, remoteFramebuffer.getPixelSize()));
 }
 
 
@@ -1800,12 +3177,12 @@ void VncManager::RFBProtocolImplementation::errorMessage(const char* where, cons
 
 void VncManager::RFBProtocolImplementation::errorMessageForSend(const char* where, const char* message) const
 {
-    // This happens on the main thread as opposed to
-    // the other error and info messages which happen
-    // on the remoteCommThread. Therefore, we call
-    // the messageManager directly.
+    // This happens on the sendThread or the remoteCommThread,
+    // so queue the message for the main thread.  It is not
+    // broadcast because the cluster pipe is written by the
+    // remoteCommThread only.
 
-    vncManager.messageManager.errorMessage(where, message);
+    actionQueue.add(new ActionQueue::ErrorMessageItem(where, message));
 }
 
 
@@ -1841,7 +3218,13 @@ void VncManager::RFBProtocolImplementation::infoAuthenticationResult(bool succee
 void VncManager::RFBProtocolImplementation::infoServerInitCompleted(bool succeeded) const
 {
     if (succeeded)
-        actionQueue.addAndBroadcast(new ActionQueue::InitDisplayItem(si, desktopName));
+    {
+        // Size the remoteFramebuffer now, before any rectangles are decoded into it:
+        if (!vncManager.getRemoteFramebuffer().resize(si.framebufferWidth, si.framebufferHeight, pixelLayout))
+            errorMessage("VncManager::RFBProtocolImplementation::infoServerInitCompleted", "unable to allocate framebuffer");
+
+        actionQueue.addAndBroadcast(new ActionQueue::InitDisplayItem(si, desktopName, pixelLayout));
+    }
 
     actionQueue.addAndBroadcast(new ActionQueue::InfoServerInitCompletedItem(succeeded));
 }
@@ -1850,6 +3233,9 @@ void VncManager::RFBProtocolImplementation::infoServerInitCompleted(bool succeed
 
 void VncManager::RFBProtocolImplementation::infoDesktopSizeReceived(rfbCARD16 newWidth, rfbCARD16 newHeight) const
 {
+    if (!vncManager.getRemoteFramebuffer().resize(newWidth, newHeight, pixelLayout))
+        errorMessage("VncManager::RFBProtocolImplementation::infoDesktopSizeReceived", "unable to allocate framebuffer");
+
     // Send then DesktopSizeItem action first so that resize happens before
     // the call to sendFramebufferUpdateRequest() in VncManager::ActionQueue::InfoDesktopSizeReceivedItem:
     actionQueue.addAndBroadcast(new ActionQueue::DesktopSizeItem(newWidth, newHeight));
@@ -1873,6 +3259,13 @@ void VncManager::RFBProtocolImplementation::infoCloseCompleted() const
 
 
 
+void VncManager::RFBProtocolImplementation::infoEncodingPolicyChanged(const EncodingPolicyStats& stats) const
+{
+    actionQueue.addAndBroadcast(new ActionQueue::InfoEncodingPolicyChangedItem(stats));
+}
+
+
+
 char* VncManager::RFBProtocolImplementation::returnPassword()
 {
     return strdup("password");  // not used; password is retrieved within VncManager::RFBProtocolImplementation::encryptChallenge()
@@ -1983,6 +3376,138 @@ const rfbPixelFormat VncManager::DefaultRequestedPixelFormat =  // static member
 
 
 
+size_t VncManager::getPixelSize(PixelLayout layout)  // static method
+{
+    return PixelLayouts[layout].size;
+}
+
+
+
+const char* VncManager::getPixelLayoutName(PixelLayout layout)  // static method
+{
+    return ((layout >= 0) && (layout < NUM_PIXEL_LAYOUTS)) ? PixelLayouts[layout].name : "unknown";
+}
+
+
+
+bool VncManager::findPixelLayout(const char* name, PixelLayout& layout)  // static method
+{
+    for (int i = 0; i < NUM_PIXEL_LAYOUTS; i++)
+        if (name && (strcasecmp(name, PixelLayouts[i].name) == 0))
+        {
+            layout = (PixelLayout)i;
+            return true;
+        }
+
+    return false;
+}
+
+
+
+bool VncManager::getPixelLayoutFormat(PixelLayout layout, rfbPixelFormat& format)  // static method
+{
+    static const rfbCARD32 endianTest = 1;
+
+    switch (layout)
+    {
+        case PIXEL_LAYOUT_BGRA:
+            // DefaultRequestedPixelFormat in host byte order:
+            format           = DefaultRequestedPixelFormat;
+            format.bigEndian = (*(const rfbCARD8*)&endianTest == 0);
+            return true;
+
+        case PIXEL_LAYOUT_RGB565:
+            format              = DefaultRequestedPixelFormat;
+            format.bitsPerPixel = 16;
+            format.depth        = 16;
+            format.bigEndian    = (*(const rfbCARD8*)&endianTest == 0);
+            format.redMax       = 31;
+            format.greenMax     = 63;
+            format.blueMax      = 31;
+            format.redShift     = 11;
+            format.greenShift   = 5;
+            format.blueShift    = 0;
+            return true;
+
+        case PIXEL_LAYOUT_INDEXED:
+            // The shifts and maxes are ignored for colour-map formats:
+            format              = DefaultRequestedPixelFormat;
+            format.bitsPerPixel = 8;
+            format.depth        = 8;
+            format.trueColour   = 0;
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+
+
+void VncManager::makePixel(PixelLayout layout, GLubyte* pixel, Images::RGBImage::Color color, const ColourMap* colourMap)  // static method
+{
+    switch (layout)
+    {
+        case PIXEL_LAYOUT_BGRA:
+        {
+            const rfbCARD32 word = ((rfbCARD32)color[0] << 16) | ((rfbCARD32)color[1] << 8) | (rfbCARD32)color[2];
+            memcpy(pixel, &word, sizeof(word));
+        }
+        break;
+
+        case PIXEL_LAYOUT_RGB565:
+        {
+            const rfbCARD16 word = (rfbCARD16)(((color[0] >> 3) << 11) | ((color[1] >> 2) << 5) | (color[2] >> 3));
+            memcpy(pixel, &word, sizeof(word));
+        }
+        break;
+
+        case PIXEL_LAYOUT_INDEXED:
+            if (!colourMap)
+            {
+                // the index of the nearest colour of the default colour map:
+                pixel[0] = (GLubyte)(((color[2] >> 6) << 6) | ((color[1] >> 5) << 3) | (color[0] >> 5));
+            }
+            else
+            {
+                long bestDistance = -1;
+                for (int i = 0; i < ColourMap::SIZE; i++)
+                {
+                    const long dr       = (long)(colourMap->red[i]   >> 8) - (long)color[0];
+                    const long dg       = (long)(colourMap->green[i] >> 8) - (long)color[1];
+                    const long db       = (long)(colourMap->blue[i]  >> 8) - (long)color[2];
+                    const long distance = (dr * dr) + (dg * dg) + (db * db);
+
+                    if ((bestDistance < 0) || (distance < bestDistance))
+                    {
+                        bestDistance = distance;
+                        pixel[0]     = (GLubyte)i;
+                    }
+                }
+            }
+            break;
+
+        default:
+            memcpy(pixel, &color, sizeof(color));
+            break;
+    }
+}
+
+
+
+void VncManager::makeDefaultColourMap(ColourMap& colourMap)  // static method
+{
+    // BGR233: blue in bits 6-7, green in 3-5, red in 0-2:
+    for (int i = 0; i < ColourMap::SIZE; i++)
+    {
+        colourMap.red[i]   = (GLushort)(( i       & 7) * 65535 / 7);
+        colourMap.green[i] = (GLushort)(((i >> 3) & 7) * 65535 / 7);
+        colourMap.blue[i]  = (GLushort)(((i >> 6) & 3) * 65535 / 3);
+    }
+}
+
+
+
 VncManager::~VncManager()
 {
     shutdown();
@@ -2011,6 +3536,10 @@ void VncManager::startup(const RFBProtocolStartupData& rfbProtocolStartupData)
         rfbProto = new RFBProtocolImplementation(*this, actionQueue);
         remoteCommThreadStarted = true;
         remoteCommThread.start(rfbProto, &RFBProtocolImplementation::threadStartForMasterNode, rfbProtocolStartupData);
+
+        outboundQueue.reset();
+        sendThreadStarted = true;
+        sendThread.start(this, &VncManager::sendThreadStart);
     }
 }
 
@@ -2037,20 +3566,41 @@ void VncManager::shutdown()
         remoteCommThreadStarted = false;
     }
 
+    if (sendThreadStarted)
+    {
+        // rp has been closed, so any write the sendThread is blocked in
+        // has failed and the remaining queued messages are dropped quickly.
+        outboundQueue.requestStop();
+
+        if (!sendThread.isJoined())
+            sendThread.join();
+
+        sendThreadStarted = false;
+    }
+    outboundQueue.reset();
+
     // We wait to delete rp (which was the value of rfbProto) until
-    // after joining the remoteCommThread so we don't pull the rug
-    // out from any pending operation on the remoteCommThread.
+    // after joining the remoteCommThread and the sendThread so we don't
+    // pull the rug out from any pending operation on those threads.
     if (rp)
         delete rp;
 
     remoteDisplay.close();
+    remoteFramebuffer.close();
 }
 
 
 
 bool VncManager::performQueuedActions()
 {
-    return actionQueue.performQueuedActions(*this);
+    const bool anyActionsPerformed = actionQueue.performQueuedActions(*this);
+
+    // Upload everything decoded since the last call at once:
+    bool anyRegionsUploaded = false;
+    if (!remoteFramebuffer.upload(remoteDisplay, anyRegionsUploaded))
+        messageManager.internalErrorMessage("VncManager::performQueuedActions", "texture upload failed");
+
+    return (anyActionsPerformed || anyRegionsUploaded);
 }
 
 
@@ -2102,4 +3652,163 @@ bool VncManager::sendClientCutText(const char* str, size_t len)
     return (rfbProto != 0) && rfbProto->sendClientCutText(str, len);
 }
 
+
+
+
+bool VncManager::enqueueFramebufferUpdateRequest(int x, int y, size_t w, size_t h, bool incremental)
+{
+    if (!rfbProto || !sendThreadStarted)
+        return false;
+    else
+    {
+        OutboundQueue::Message message;
+        memset(&message, 0, sizeof(message));
+        message.type = OutboundQueue::Message::Type_FramebufferUpdateRequest;
+        message.x    = x;
+        message.y    = y;
+        message.w    = w;
+        message.h    = h;
+        message.flag = incremental;
+
+        return outboundQueue.enqueue(message);
+    }
+}
+
+
+
+bool VncManager::enqueueKeyEvent(rfbCARD32 key, bool down)
+{
+    if (!rfbProto || !sendThreadStarted)
+        return false;
+    else
+    {
+        OutboundQueue::Message message;
+        memset(&message, 0, sizeof(message));
+        message.type = OutboundQueue::Message::Type_KeyEvent;
+        message.key  = key;
+        message.flag = down;
+
+        return outboundQueue.enqueue(message);
+    }
+}
+
+
+
+bool VncManager::enqueuePointerEvent(int x, int y, int buttonMask)
+{
+    if (!rfbProto || !sendThreadStarted)
+        return false;
+    else
+    {
+        OutboundQueue::Message message;
+        memset(&message, 0, sizeof(message));
+        message.type       = OutboundQueue::Message::Type_PointerEvent;
+        message.x          = x;
+        message.y          = y;
+        message.buttonMask = buttonMask;
+
+        return outboundQueue.enqueue(message);
+    }
+}
+
+
+
+bool VncManager::enqueueClientCutText(const char* str, size_t len)
+{
+    if (!rfbProto || !sendThreadStarted || !str)
+        return false;
+    else
+    {
+        OutboundQueue::Message message;
+        memset(&message, 0, sizeof(message));
+        message.type = OutboundQueue::Message::Type_ClientCutText;
+        message.str  = (char*)str;  // copied by enqueue()
+        message.len  = len;
+
+        return outboundQueue.enqueue(message);
+    }
+}
+
+
+
+bool VncManager::enqueueStringViaKeyEvents( const char* str,
+                                            size_t      len,
+                                            rfbCARD32   tabKeySym,
+                                            rfbCARD32   enterKeySym,
+                                            rfbCARD32   leftControlKeySym )
+{
+    if (!rfbProto || !sendThreadStarted || (!str && (len > 0)))
+        return false;
+    else if (len <= 0)
+        return true;
+    else
+    {
+        OutboundQueue::Message message;
+        memset(&message, 0, sizeof(message));
+        message.type              = OutboundQueue::Message::Type_StringViaKeyEvents;
+        message.str               = (char*)str;  // copied by enqueue()
+        message.len               = len;
+        message.tabKeySym         = tabKeySym;
+        message.enterKeySym       = enterKeySym;
+        message.leftControlKeySym = leftControlKeySym;
+
+        return outboundQueue.enqueue(message);
+    }
+}
+
+
+
+void* VncManager::sendThreadStart()  // called from sendThread; master node only
+{
+    RFBProtocolImplementation* const rp = rfbProto;  // rfbProto is reset to 0 by shutdown() before this thread is stopped
+
+    while (outboundQueue.waitForMessage())
+    {
+        // Coalesce whatever has been queued into as few writes as possible;
+        // the batch is sent once the queue is empty, or after
+        // OUT_BUFFER_DEADLINE_USEC if messages keep coming:
+        if (rp)
+            rp->beginOutputBatch();
+
+        OutboundQueue::Message message;
+        while (outboundQueue.dequeue(message))
+        {
+            if (rp)
+            {
+                // Errors are reported through errorMessageForSend():
+                switch (message.type)
+                {
+                    case OutboundQueue::Message::Type_KeyEvent:
+                        (void)rp->sendKeyEvent(message.key, message.flag);
+                        break;
+
+                    case OutboundQueue::Message::Type_PointerEvent:
+                        (void)rp->sendPointerEvent(message.x, message.y, message.buttonMask);
+                        break;
+
+                    case OutboundQueue::Message::Type_FramebufferUpdateRequest:
+                        (void)rp->sendFramebufferUpdateRequest(message.x, message.y, message.w, message.h, message.flag);
+                        break;
+
+                    case OutboundQueue::Message::Type_ClientCutText:
+                        (void)rp->sendClientCutText(message.str, message.len);
+                        break;
+
+                    case OutboundQueue::Message::Type_StringViaKeyEvents:
+                        (void)rp->sendStringViaKeyEvents(message.str, message.len, message.tabKeySym, message.enterKeySym, message.leftControlKeySym);
+                        break;
+                }
+            }
+
+            if (message.str)
+                delete [] message.str;
+        }
+
+        if (rp)
+            (void)rp->endOutputBatch();  // errors are reported through errorMessageForSend()
+    }
+
+    return 0;
+}
+
 }  // end of namespace Voltaic
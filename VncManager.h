@@ -23,16 +23,20 @@
 
 #include <string>
 #include <deque>
+#include <vector>
 #include <string.h>
+#include <time.h>
 #include <Vrui/Vrui.h>
 #include <GLMotif/Types.h>
 #include <Images/RGBImage.h>
 #include <Threads/Thread.h>
 #include <Threads/Mutex.h>
+#include <Threads/Cond.h>
 #include <Threads/Barrier.h>
 #include <Comm/MulticastPipe.h>
 
 #include "librfb/rfbproto.h"
+#include "librfb/pixelkernels.h"
 
 
 
@@ -43,18 +47,72 @@ namespace Voltaic {
     public:
         static const rfbPixelFormat DefaultRequestedPixelFormat;
 
+    //----------------------------------------------------------------------
+    public:
+        // PixelLayout is the layout of the pixels held by the ShadowFramebuffer
+        // and uploaded by the TextureManager.  PIXEL_LAYOUT_RGB pixels are
+        // converted from whatever true-color format the server sends.  For the
+        // other layouts, the server is asked for pixels in exactly that layout
+        // (see getPixelLayoutFormat()), which are stored and uploaded as
+        // received.
+        enum PixelLayout
+        {
+            PIXEL_LAYOUT_RGB = 0,  // Images::RGBImage::Color, i.e., three GLubytes; uploaded as GL_RGB/GL_UNSIGNED_BYTE
+            PIXEL_LAYOUT_BGRA,     // 32-bit words in host byte order, red in bits 16-23, green in 8-15, blue in 0-7; uploaded as GL_BGRA/GL_UNSIGNED_INT_8_8_8_8_REV
+            PIXEL_LAYOUT_RGB565,   // 16-bit words in host byte order, red in bits 11-15, green in 5-10, blue in 0-4; uploaded as GL_RGB/GL_UNSIGNED_SHORT_5_6_5
+            PIXEL_LAYOUT_INDEXED,  // 8-bit indices into the ColourMap; uploaded as GL_COLOR_INDEX/GL_UNSIGNED_BYTE and looked up via glPixelMap
+            NUM_PIXEL_LAYOUTS
+        };
+
+        enum { MAX_PIXEL_SIZE = 4 };  // bytes per pixel of the largest PixelLayout
+
+        static size_t      getPixelSize(PixelLayout layout);  // bytes per pixel
+        static const char* getPixelLayoutName(PixelLayout layout);
+        static bool        findPixelLayout(const char* name, PixelLayout& layout);  // layout is the PixelLayout named by name; false if there is none
+        static bool        getPixelLayoutFormat(PixelLayout layout, rfbPixelFormat& format);  // format is the pixel format to request for layout; false (and format unchanged) if any true-color format will do
+
+        // ColourMap holds the colours of PIXEL_LAYOUT_INDEXED pixels as sent
+        // by the server in SetColourMapEntries messages, i.e., with 16-bit
+        // components, which is also what glPixelMapusv() takes.  The indices
+        // are uploaded unchanged and resolved by OpenGL's pixel transfer.
+        struct ColourMap
+        {
+            enum { SIZE = 256 };
+
+            GLushort red[SIZE];
+            GLushort green[SIZE];
+            GLushort blue[SIZE];
+        };
+
+        static void makeDefaultColourMap(ColourMap& colourMap);  // the BGR233 colour map, which makePixel() uses for PIXEL_LAYOUT_INDEXED by default
+
+        // makePixel() stores color at pixel in layout.  PIXEL_LAYOUT_INDEXED
+        // pixels get the index of the nearest colour in colourMap, which
+        // should be the map the server sent, if any; 0 ==> the default map.
+        static void makePixel(PixelLayout layout, GLubyte* pixel, Images::RGBImage::Color color, const ColourMap* colourMap = 0);
+
     //----------------------------------------------------------------------
     public:
         struct RFBProtocolStartupData
         {
             RFBProtocolStartupData();
 
-            bool           initViaConnect;
-            const char*    desktopHost;
-            unsigned       rfbPort;
-            rfbPixelFormat requestedPixelFormat;
-            const char*    requestedEncodings;
-            bool           sharedDesktopFlag;
+            bool                            initViaConnect;
+            const char*                     desktopHost;
+            unsigned                        rfbPort;
+            rfbPixelFormat                  requestedPixelFormat;
+            const char*                     requestedEncodings;
+            bool                            sharedDesktopFlag;
+            size_t                          commBufferSize;      // size of the receive ring buffer; 0 ==> rfb::RFBProtocol::DEFAULT_COMM_BUFFER_SIZE
+            unsigned                        connectTimeout;      // in milliseconds; 0 ==> rfb::RFBProtocol::DEFAULT_CONNECT_TIMEOUT_MSEC
+            rfb::RFBProtocol::SocketOptions socketOptions;
+            const char*                     localSocketPath;     // Unix-domain socket of a server on this machine, tried before TCP; 0 ==> TCP only
+            const char*                     recordFileName;      // see rfb::RFBProtocol::setRecordFileName(); 0 ==> don't record
+            const char*                     replayFileName;      // see rfb::RFBProtocol::initViaReplay(); non-0 ==> replay instead of connecting or listening
+            bool                            replayRealTime;      // replay at the recorded pace rather than as fast as possible
+            bool                            adaptiveEncodings;   // see rfb::RFBProtocol::setAdaptiveEncodings()
+            PixelLayout                     pixelLayout;         // overrides requestedPixelFormat unless PIXEL_LAYOUT_RGB; see PixelLayout
+            int                             preconnectedSocket;  // -1 ==> none; otherwise a socket connected to desktopHost/rfbPort (e.g., from a ConnectionPool), owned by startup()
         };
 
     //----------------------------------------------------------------------
@@ -79,12 +137,23 @@ namespace Voltaic {
             GLint*                   tileXCoord;
             GLint*                   tileYCoord;
             GLuint**                 tileTexID;
-            Images::RGBImage::Color* pixelBuf;
+            PixelLayout              layout;
+            GLubyte*                 pixelBuf;
             GLsizei                  pixelBufSize;
+            ColourMap                colourMap;   // used for PIXEL_LAYOUT_INDEXED only; kept by init() and close()
+
+            mutable int                   pixelTransferDepth;  // number of unmatched beginPixelTransfer() calls; not copied
+            mutable std::vector<GLushort> savedPixelMaps[3];   // OpenGL's I_TO_R/G/B maps before the outermost beginPixelTransfer()
+
+            mutable GLuint                copyScratchTexID;    // scratch texture used by copy(); 0 until its first call, freed by close()
+            mutable GLsizei               copyScratchWidth;    // size of copyScratchTexID; only grows until close()
+            mutable GLsizei               copyScratchHeight;
+            mutable GLuint                copyFramebufferID;   // framebuffer object used by copy(); 0 until its first call, freed by close()
 
             // INVARIANTS:
             //
-            // If valid is false, then width, height, tileXCount, tileYCount, tileXCoord, tileYCoord and tileTexID, pixelBuf, pixelBufSize are all 0.
+            // If valid is false, then width, height, tileXCount, tileYCount, tileXCoord, tileYCoord and tileTexID, pixelBuf, pixelBufSize are all 0,
+            // and layout is PIXEL_LAYOUT_RGB.
             //
             // If valid is true, then:
             //
@@ -104,8 +173,8 @@ namespace Voltaic {
             //
             //     tileTexID is not 0 and tileTexName[xi][yi] is the (xi, yi) openGL texture ID for 0 <= xi < tileXCount and 0 <= yi < tileYCount.
             //
-            //     pixelBuf is not zero and contains enough entries for the largest tile.
-            //     pixelBufSize is the number of entries in pixelBuf.
+            //     pixelBuf is not zero and contains enough pixels in layout for the largest tile.
+            //     pixelBufSize is the number of pixels in pixelBuf.
 
         public:
             TextureManager() :
@@ -114,18 +183,26 @@ namespace Voltaic {
                 tileXCount(0), tileYCount(0),
                 tileXCoord(0), tileYCoord(0),
                 tileTexID(0),
+                layout(PIXEL_LAYOUT_RGB),
                 pixelBuf(0),
-                pixelBufSize(0)
+                pixelBufSize(0),
+                pixelTransferDepth(0),
+                copyScratchTexID(0),
+                copyScratchWidth(0),
+                copyScratchHeight(0),
+                copyFramebufferID(0)
             {
+                makeDefaultColourMap(colourMap);
             }
 
             virtual ~TextureManager();  // calls close(); override close() instead of destructor in derived classes
 
             virtual bool init( GLsizei                 forWidth,
                                GLsizei                 forHeight,
+                               PixelLayout             forLayout    = PIXEL_LAYOUT_RGB,
                                Images::RGBImage::Color initialColor = Images::RGBImage::Color(0, 0, 255) );  // isValid() iff true is returned
 
-            // reinit() will do nothing and return true if forWidth and forHeight match the current values of width and height
+            // reinit() keeps the current layout; it will do nothing and return true if forWidth and forHeight match the current values of width and height
             virtual bool reinit( GLsizei                 forWidth,
                                  GLsizei                 forHeight,
                                  Images::RGBImage::Color initialColor = Images::RGBImage::Color(0, 0, 255) );  // object is left in prior state if false is returned
@@ -148,6 +225,23 @@ namespace Voltaic {
             GLsizei getWidth()  const { return width;  }
             GLsizei getHeight() const { return height; }
 
+            PixelLayout getPixelLayout() const { return layout; }
+
+            // setColourMap() affects later writes only; the texels already
+            // written keep the colours they were written with.
+            const ColourMap& getColourMap() const                      { return colourMap; }
+            void             setColourMap(const ColourMap& newColourMap) { colourMap = newColourMap; }
+
+            // beginPixelTransfer() saves OpenGL's pixel maps and loads the
+            // colourMap into them for PIXEL_LAYOUT_INDEXED, and the matching
+            // endPixelTransfer() restores them; both do nothing for other
+            // layouts.  Calls nest, and only the outermost pair touches
+            // OpenGL, so a caller writing many rectangles in one pass (e.g.,
+            // ShadowFramebuffer::upload()) brackets the whole pass to load the
+            // maps once.  The colourMap must not change within a bracket.
+            virtual void beginPixelTransfer() const;
+            virtual void endPixelTransfer() const;
+
             GLsizei getTileXCount() const { return tileXCount; }
             GLsizei getTileYCount() const { return tileYCount; }
 
@@ -158,11 +252,13 @@ namespace Voltaic {
             GLsizei getTileHeight(GLsizei yi) const { return (tileYCoord[yi+1] - tileYCoord[yi] + ((yi < (tileYCount-1)) ? tileYOverlap : 0)); }
 
         public:
-            virtual bool write( GLint                          destX,
-                                GLint                          destY,
-                                GLsizei                        srcWidth,
-                                GLsizei                        srcHeight,
-                                const Images::RGBImage::Color* srcData ) const;
+            // srcData holds pixels in getPixelLayout():
+            virtual bool write( GLint          destX,
+                                GLint          destY,
+                                GLsizei        srcWidth,
+                                GLsizei        srcHeight,
+                                const GLubyte* srcData,
+                                GLsizei        srcRowLength = 0 ) const;  // distance between rows of srcData in pixels; 0 ==> srcWidth
 
             virtual bool copy( GLint                          destX,
                                GLint                          destY,
@@ -171,11 +267,12 @@ namespace Voltaic {
                                GLsizei                        srcWidth,
                                GLsizei                        srcHeight ) const;
 
-            virtual bool fill( GLint                   destX,
-                               GLint                   destY,
-                               GLsizei                 destWidth,
-                               GLsizei                 destHeight,
-                               Images::RGBImage::Color color ) const;
+            // pixel is one pixel in getPixelLayout():
+            virtual bool fill( GLint          destX,
+                               GLint          destY,
+                               GLsizei        destWidth,
+                               GLsizei        destHeight,
+                               const GLubyte* pixel ) const;
 
         public:
             virtual bool displayInRectangle( GLfloat x00, GLfloat y00, GLfloat z00,
@@ -194,6 +291,144 @@ namespace Voltaic {
             TextureManager(TextureManager& other);
         };
 
+    //----------------------------------------------------------------------
+    public:
+        // ShadowFramebuffer is a copy of the remote framebuffer in main
+        // memory.  Decoded rectangles are written into it (on the master node
+        // by the remoteCommThread, on slave nodes by the ActionQueue items),
+        // and the parts changed since the last upload() are recorded in a grid
+        // of DAMAGE_BLOCK_SIZE x DAMAGE_BLOCK_SIZE blocks.  Once per frame,
+        // upload() merges the damaged blocks into rectangles and writes only
+        // those to the TextureManager, so the number of texture uploads no
+        // longer depends on the number of rectangles sent by the server.
+        // Rows are stored bottom-to-top and all coordinates are OpenGL
+        // coordinates, i.e., y == 0 is the bottom row.  Pixels are stored in
+        // the PixelLayout given to resize(), which must match the layout of
+        // the TextureManager passed to upload().  All methods may be called
+        // from any thread.
+        //
+        // PIXEL_LAYOUT_INDEXED pixels are looked up in the colour map when
+        // they are uploaded, so setColourMapEntries() damages the whole
+        // framebuffer, and upload() passes the new colour map to the
+        // TextureManager.  The colour map is kept by resize() and close().
+        //
+        // A copy() whose source rectangle has no pending damage is not
+        // damaged either; it is recorded and replayed on the GPU by upload()
+        // via TextureManager::copy(), before the damaged blocks are written.
+        // If that fails, the destination is uploaded from main memory instead.
+        class ShadowFramebuffer
+        {
+        public:
+            enum
+            {
+                DAMAGE_BLOCK_SIZE   = 64,
+                MAX_PENDING_COPIES  = 64   // further copies before the next upload() are damaged instead
+            };
+
+        public:
+            ShadowFramebuffer();
+            virtual ~ShadowFramebuffer();  // calls close()
+
+            // resize() damages the whole framebuffer; it is left closed if false is returned
+            virtual bool resize( GLsizei                 newWidth,
+                                 GLsizei                 newHeight,
+                                 PixelLayout             newLayout,
+                                 Images::RGBImage::Color initialColor = Images::RGBImage::Color(0, 0, 255) );
+
+            virtual void close();  // keeps the layout
+
+            GLsizei     getWidth()       const { return width;  }
+            GLsizei     getHeight()      const { return height; }
+            PixelLayout getPixelLayout() const { return layout; }
+            size_t      getPixelSize()   const { return pixelSize; }  // bytes per pixel
+
+        public:
+            // beginWrite() locks the framebuffer and returns the address of
+            // pixel (x, y), or returns 0 without locking if the rectangle is
+            // empty or not entirely inside the framebuffer.  Successive rows
+            // of the rectangle are getWidth()*getPixelSize() bytes apart.  A
+            // non-0 result must be followed by a call to endWrite() with the
+            // same rectangle, which damages it and unlocks the framebuffer.
+            virtual GLubyte* beginWrite(GLint x, GLint y, GLsizei w, GLsizei h);
+            virtual void     endWrite(GLint x, GLint y, GLsizei w, GLsizei h);
+
+            // These return false if the rectangles are not entirely inside the
+            // framebuffer.  srcData and pixel are in getPixelLayout().
+            virtual bool write( GLint          destX,
+                                GLint          destY,
+                                GLsizei        srcWidth,
+                                GLsizei        srcHeight,
+                                const GLubyte* srcData );
+
+            virtual bool copy( GLint   destX,
+                               GLint   destY,
+                               GLint   srcX,
+                               GLint   srcY,
+                               GLsizei srcWidth,
+                               GLsizei srcHeight );
+
+            virtual bool fill( GLint          destX,
+                               GLint          destY,
+                               GLsizei        destWidth,
+                               GLsizei        destHeight,
+                               const GLubyte* pixel );
+
+            // setColourMapEntries() sets numColours colour map entries starting
+            // at firstColour from rgb, which holds numColours red, green, blue
+            // triples.  It returns false if the entries are not all inside the
+            // colour map.
+            virtual bool setColourMapEntries(int firstColour, int numColours, const rfbCARD16* rgb);
+
+            // upload() writes the damaged parts to texture and clears the
+            // damage.  It does nothing until texture has the same size and
+            // layout as this framebuffer.  Call it with the OpenGL context current.
+            virtual bool upload(TextureManager& texture, bool& uploaded);  // false if a texture write failed; uploaded is set iff anything was written
+
+        protected:
+            struct DamageRect  // rectangle of damage blocks, as merged by upload()
+            {
+                GLsizei col0, col1;  // damaged block columns [col0, col1)
+                GLsizei row0, row1;  // damaged block rows    [row0, row1)
+            };
+
+            struct PendingCopy  // copy() still to be performed on the texture
+            {
+                GLint   destX, destY;
+                GLint   srcX,  srcY;
+                GLsizei width, height;
+            };
+
+        protected:
+            bool containsRect(GLint x, GLint y, GLsizei w, GLsizei h) const
+            {
+                return ((w > 0) && (h > 0) && (x >= 0) && (y >= 0) && ((x + w) <= width) && ((y + h) <= height));
+            }
+
+            void damage(GLint x, GLint y, GLsizei w, GLsizei h);          // mutex must be held
+            bool isDamaged(GLint x, GLint y, GLsizei w, GLsizei h) const;  // mutex must be held; true iff any block overlapping the rectangle is damaged
+
+        protected:
+            Threads::Mutex           mutex;       // protects all of the following
+            GLsizei                  width;
+            GLsizei                  height;
+            PixelLayout              layout;
+            size_t                   pixelSize;   // getPixelSize(layout)
+            GLubyte*                 pixels;      // width*height pixels in layout, bottom row first; allocated via new[]
+            GLsizei                  damageCols;  // number of blocks across
+            GLsizei                  damageRows;  // number of blocks up
+            bool*                    damageMap;   // damageCols*damageRows flags, bottom row first; allocated via new[]
+            bool                     anyDamage;   // true iff any flag in damageMap is set
+            std::vector<PendingCopy> pendingCopies;  // in the order performed on pixels
+            bool                     gpuCopyEnabled;  // cleared when TextureManager::copy() fails
+            ColourMap                colourMap;
+            bool                     colourMapChanged;  // since it was last passed to a TextureManager by upload()
+
+        private:
+            // Disable these copiers:
+            ShadowFramebuffer& operator=(const ShadowFramebuffer&);
+            ShadowFramebuffer(const ShadowFramebuffer&);
+        };
+
     //----------------------------------------------------------------------
     public:
         class MessageManager
@@ -217,6 +452,7 @@ namespace Voltaic {
             virtual void infoDesktopSizeReceived(rfbCARD16 newWidth, rfbCARD16 newHeight) = 0;
             virtual void infoCloseStarted() = 0;
             virtual void infoCloseCompleted() = 0;
+            virtual void infoEncodingPolicyChanged(const rfb::RFBProtocol::EncodingPolicyStats& stats);  // default implementation does nothing
         };
 
     //----------------------------------------------------------------------
@@ -264,6 +500,7 @@ namespace Voltaic {
                     ItemType_WriteItem,
                     ItemType_CopyItem,
                     ItemType_FillItem,
+                    ItemType_ColourMapItem,
                     ItemType_InternalErrorMessageItem,
                     ItemType_ErrorMessageItem,
                     ItemType_ErrorMessageFromServerItem,
@@ -273,7 +510,8 @@ namespace Voltaic {
                     ItemType_InfoServerInitCompletedItem,
                     ItemType_InfoDesktopSizeReceivedItem,
                     ItemType_InfoCloseStartedItem,
-                    ItemType_InfoCloseCompletedItem
+                    ItemType_InfoCloseCompletedItem,
+                    ItemType_InfoEncodingPolicyChangedItem
                 };
 
                 const ItemType itemType;
@@ -315,12 +553,14 @@ namespace Voltaic {
             protected:
                 const rfbServerInitMsg si;
                 const std::string      desktopName;
+                const PixelLayout      layout;
 
             public:
-                InitDisplayItem(const rfbServerInitMsg& si, const char* desktopName) :
+                InitDisplayItem(const rfbServerInitMsg& si, const char* desktopName, PixelLayout layout) :
                     Item(ItemType_InitDisplayItem),
                     si(si),
-                    desktopName(desktopName)
+                    desktopName(desktopName),
+                    layout(layout)
                 {
                 }
 
@@ -352,26 +592,33 @@ namespace Voltaic {
                 virtual bool perform(VncManager& vncManager);
             };
 
+            // WriteItem, CopyItem and FillItem use OpenGL coordinates (see
+            // ShadowFramebuffer).  The master node applies the updates to its
+            // remoteFramebuffer directly and only broadcasts these items, so
+            // they are only performed on slave nodes.
             class WriteItem : public Item
             {
             protected:
-                const GLint                    destX;
-                const GLint                    destY;
-                const GLsizei                  srcWidth;
-                const GLsizei                  srcHeight;
-                Images::RGBImage::Color* const srcData;
-
-            public:
-                WriteItem( GLint                    destX,
-                           GLint                    destY,
-                           GLsizei                  srcWidth,
-                           GLsizei                  srcHeight,
-                           Images::RGBImage::Color* srcData ) :
+                const GLint    destX;
+                const GLint    destY;
+                const GLsizei  srcWidth;
+                const GLsizei  srcHeight;
+                const size_t   pixelSize;  // bytes per pixel of srcData
+                GLubyte* const srcData;    // srcWidth*srcHeight pixels in the remoteFramebuffer's layout; allocated via new[]
+
+            public:
+                WriteItem( GLint    destX,
+                           GLint    destY,
+                           GLsizei  srcWidth,
+                           GLsizei  srcHeight,
+                           size_t   pixelSize,
+                           GLubyte* srcData ) :
                     Item(ItemType_WriteItem),
                     destX(destX),
                     destY(destY),
                     srcWidth(srcWidth),
                     srcHeight(srcHeight),
+                    pixelSize(pixelSize),
                     srcData(srcData)
                 {
                 }
@@ -422,25 +669,27 @@ namespace Voltaic {
             class FillItem : public Item
             {
             protected:
-                const GLint                   destX;
-                const GLint                   destY;
-                const GLsizei                 destWidth;
-                const GLsizei                 destHeight;
-                const Images::RGBImage::Color color;
-
-            public:
-                FillItem( GLint                   destX,
-                          GLint                   destY,
-                          GLsizei                 destWidth,
-                          GLsizei                 destHeight,
-                          Images::RGBImage::Color color ) :
+                const GLint   destX;
+                const GLint   destY;
+                const GLsizei destWidth;
+                const GLsizei destHeight;
+                GLubyte       pixel[MAX_PIXEL_SIZE];  // in the remoteFramebuffer's layout; unused bytes are 0
+
+            public:
+                FillItem( GLint          destX,
+                          GLint          destY,
+                          GLsizei        destWidth,
+                          GLsizei        destHeight,
+                          const GLubyte* pixel,
+                          size_t         pixelSize ) :
                     Item(ItemType_FillItem),
                     destX(destX),
                     destY(destY),
                     destWidth(destWidth),
-                    destHeight(destHeight),
-                    color(color)
+                    destHeight(destHeight)
                 {
+                    memset(this->pixel, 0, sizeof(this->pixel));
+                    memcpy(this->pixel, pixel, pixelSize);
                 }
 
                 static FillItem* createFromPipe(Comm::MulticastPipe& pipe);
@@ -450,6 +699,30 @@ namespace Voltaic {
                 virtual bool perform(VncManager& vncManager);
             };
 
+            // ColourMapItem is only performed on slave nodes, like WriteItem.
+            class ColourMapItem : public Item
+            {
+            protected:
+                const int              firstColour;
+                const int              numColours;
+                std::vector<rfbCARD16> rgb;  // numColours red, green, blue triples
+
+            public:
+                ColourMapItem(int firstColour, int numColours, const rfbCARD16* rgb) :
+                    Item(ItemType_ColourMapItem),
+                    firstColour(firstColour),
+                    numColours(numColours),
+                    rgb(rgb, rgb + (3*numColours))
+                {
+                }
+
+                static ColourMapItem* createFromPipe(Comm::MulticastPipe& pipe);
+
+            public:
+                virtual void broadcast(Comm::MulticastPipe& pipe) const;
+                virtual bool perform(VncManager& vncManager);
+            };
+
             class InternalErrorMessageItem : public Item
             {
             protected:
@@ -640,6 +913,25 @@ namespace Voltaic {
                 virtual bool indicatesClose() const;  // returns true; ActionQueue::threadStartForSlaveNodes() uses this to know when to quit
             };
 
+            class InfoEncodingPolicyChangedItem : public Item
+            {
+            protected:
+                const rfb::RFBProtocol::EncodingPolicyStats stats;
+
+            public:
+                InfoEncodingPolicyChangedItem(const rfb::RFBProtocol::EncodingPolicyStats& stats) :
+                    Item(ItemType_InfoEncodingPolicyChangedItem),
+                    stats(stats)
+                {
+                }
+
+                static InfoEncodingPolicyChangedItem* createFromPipe(Comm::MulticastPipe& pipe);
+
+            public:
+                virtual void broadcast(Comm::MulticastPipe& pipe) const;
+                virtual bool perform(VncManager& vncManager);
+            };
+
         public:
             ActionQueue(Comm::MulticastPipe* clusterMulticastPipe) :  // takes ownership of clusterMulticastPipe
                 mutex(),
@@ -654,6 +946,8 @@ namespace Voltaic {
             // Remote communication thread operations:
             virtual void  add(Item* item);                               // does nothing if item == 0
             virtual void  addAndBroadcast(Item* item);                   // broadcasts item to clusterMulticastPipe if clusterMulticastPipe != 0, the performs add(item)
+            virtual void  broadcastOnly(Item* item);                     // broadcasts item to clusterMulticastPipe if clusterMulticastPipe != 0, then deletes item
+                    bool  getIsClustered() const { return (clusterMulticastPipe != 0); }
 
         public:
             // Main thread operations:
@@ -681,6 +975,145 @@ namespace Voltaic {
             ActionQueue(const ActionQueue&);
         };
 
+    //----------------------------------------------------------------------
+    public:
+        // OutboundQueue carries client-to-server messages from the main thread
+        // to the sendThread, which performs the (possibly blocking) socket
+        // writes.  It is a lock-free single-producer/single-consumer ring:
+        // enqueue() is only called from the main thread and dequeue() only
+        // from the sendThread.  The mutex and condition variable are used
+        // only to put the sendThread to sleep when the ring is empty.
+        class OutboundQueue
+        {
+        public:
+            struct Message
+            {
+                enum Type
+                {
+                    Type_KeyEvent,
+                    Type_PointerEvent,
+                    Type_FramebufferUpdateRequest,
+                    Type_ClientCutText,
+                    Type_StringViaKeyEvents
+                };
+
+                Type      type;
+                int       x;                  // Type_PointerEvent, Type_FramebufferUpdateRequest
+                int       y;                  // Type_PointerEvent, Type_FramebufferUpdateRequest
+                size_t    w;                  // Type_FramebufferUpdateRequest
+                size_t    h;                  // Type_FramebufferUpdateRequest
+                bool      flag;               // Type_KeyEvent: down; Type_FramebufferUpdateRequest: incremental
+                rfbCARD32 key;                // Type_KeyEvent
+                int       buttonMask;         // Type_PointerEvent
+                char*     str;                // Type_ClientCutText, Type_StringViaKeyEvents; allocated via new[], owned by the queue
+                size_t    len;                // Type_ClientCutText, Type_StringViaKeyEvents
+                rfbCARD32 tabKeySym;          // Type_StringViaKeyEvents
+                rfbCARD32 enterKeySym;        // Type_StringViaKeyEvents
+                rfbCARD32 leftControlKeySym;  // Type_StringViaKeyEvents
+            };
+
+            enum { CAPACITY = 1024 };  // must be a power of 2
+
+        public:
+            OutboundQueue();
+            virtual ~OutboundQueue();  // deletes the str of any messages still queued
+
+        public:
+            // Main thread operations:
+            virtual bool enqueue(const Message& message);  // never blocks; copies message.str; returns false if the queue is full
+            virtual void requestStop();                    // wakes up the sendThread and makes waitForMessage() return false
+            virtual void reset();                          // discards queued messages and clears the stop request; sendThread must not be running
+
+        public:
+            // sendThread operations:
+            virtual bool dequeue(Message& message);        // returns false if empty; caller must delete [] message.str
+            virtual bool waitForMessage();                 // blocks while empty; returns false if a stop was requested
+
+        protected:
+            volatile unsigned head;             // index of next message to dequeue; written only by the sendThread
+            volatile unsigned tail;             // index of next message to enqueue; written only by the main thread
+            volatile bool     consumerWaiting;  // true while the sendThread is (about to be) blocked in waitForMessage()
+            volatile bool     stopRequested;
+            Threads::Mutex    mutex;
+            Threads::Cond     cond;
+            Message           messages[CAPACITY];
+
+        private:
+            // Disable these copiers:
+            OutboundQueue& operator=(const OutboundQueue&);
+            OutboundQueue(const OutboundQueue&);
+        };
+
+    //----------------------------------------------------------------------
+    public:
+        // ConnectionPool keeps one spare connected socket for each desktop
+        // added to it, so that a VncManager can be started up without waiting
+        // for hostname resolution and connect().  The sockets are connected on
+        // the pool's own thread, which also waits for the server's
+        // ProtocolVersion message; the handshake cannot go further ahead of
+        // time, as authentication needs the user's password.  A spare socket
+        // is only replaced once it has been taken or has failed; after a
+        // failed connect, or a spare the server has closed (servers may drop
+        // connections that do not authenticate in time), the pool backs off
+        // exponentially from RETRY_SECONDS up to maxRetrySeconds.  Only the
+        // master node of a cluster should use a ConnectionPool.
+        class ConnectionPool
+        {
+        public:
+            enum { DEFAULT_MAX_RETRY_SECONDS = 300 };
+            enum { RETRY_SECONDS             = 5 };      // delay before reconnecting after the first failure
+            enum { GREETING_TIMEOUT_MSEC     = 10000 };  // wait for the ProtocolVersion message if the desktop has no connectTimeout
+            enum { CHECK_INTERVAL_MSEC       = 1000 };
+
+        public:
+            ConnectionPool(unsigned maxRetrySeconds = DEFAULT_MAX_RETRY_SECONDS);
+            virtual ~ConnectionPool();  // calls stop() and closes all spare sockets
+
+        public:
+            virtual void addDesktop(const RFBProtocolStartupData& startupData);  // only before start(); uses desktopHost, rfbPort, connectTimeout, socketOptions and localSocketPath
+            virtual void start();
+            virtual void stop();
+
+            // take() returns the spare socket connected to the given desktop and
+            // starts connecting a replacement, or returns -1 if none is ready.
+            // Ownership of the socket passes to the caller; pass it on through
+            // RFBProtocolStartupData::preconnectedSocket.  The server's
+            // ProtocolVersion message is still unread on the socket.
+            virtual int take(const char* desktopHost, unsigned rfbPort);
+
+        protected:
+            virtual void* threadStart();
+            virtual bool  checkSpareSocket(int sock) const;                 // false if the server has closed sock
+            virtual bool  waitForGreeting(int sock, unsigned timeoutMsec);  // false if no valid ProtocolVersion message arrived on sock in time or stop() was called
+            void          scheduleRetry(size_t entryIndex);                 // call with mutex locked
+
+        protected:
+            struct Entry
+            {
+                std::string                     desktopHost;
+                unsigned                        rfbPort;
+                unsigned                        connectTimeout;
+                rfb::RFBProtocol::SocketOptions socketOptions;
+                std::string                     localSocketPath;
+                int                             sock;       // -1 if not (yet) connected
+                time_t                          retryTime;  // earliest time to (re)connect if sock < 0
+                unsigned                        failures;   // consecutive failed connects or spares lost before they were taken
+            };
+
+            const unsigned     maxRetrySeconds;
+            std::vector<Entry> entries;          // fixed once started
+            Threads::Mutex     mutex;            // protects the sock, retryTime and failures members of entries
+            Threads::Thread    thread;
+            bool               threadStarted;
+            volatile bool      stopRequested;
+            int                wakeupPipe[2];    // take() and stop() write to wakeupPipe[1] to wake up the thread; -1 if unavailable
+
+        private:
+            // Disable these copiers:
+            ConnectionPool& operator=(const ConnectionPool&);
+            ConnectionPool(const ConnectionPool&);
+        };
+
     //----------------------------------------------------------------------
     public:
         class RFBProtocolImplementation :
@@ -696,7 +1129,10 @@ namespace Voltaic {
                 vncManager(vncManager),
                 actionQueue(actionQueue),
                 passwordRetrievalBarrier(2),
-                retrievedPassword()
+                retrievedPassword(),
+                pixelLayout(PIXEL_LAYOUT_RGB),
+                pixelConverter(0),
+                bytesPerPixel(0)
             {
             }
 
@@ -750,6 +1186,8 @@ namespace Voltaic {
             virtual void infoCloseStarted()   const;  // warning: if not closed when destructor called, this will be called after derived instance destructor has already completed...
             virtual void infoCloseCompleted() const;  // warning: if not closed when destructor called, this will be called after derived instance destructor has already completed...
 
+            virtual void infoEncodingPolicyChanged(const EncodingPolicyStats& stats) const;
+
         protected:
             // We implement an asynchronous password retrieval (with respect to the main UI
             // thread) through the use of the passwordRetrievalBarrier semaphore.
@@ -773,6 +1211,12 @@ namespace Voltaic {
             Threads::Barrier passwordRetrievalBarrier;
             std::string      retrievedPassword;
 
+            // The pixel format is fixed once the server init completes, so
+            // the converter for it is selected then rather than per rectangle:
+            PixelLayout                  pixelLayout;     // of the remoteFramebuffer; pixels are only converted for PIXEL_LAYOUT_RGB
+            rfb::PixelKernels::Converter pixelConverter;  // 0 if the pixel format is not supported
+            size_t                       bytesPerPixel;
+
         private:
             // Disable these copiers:
             RFBProtocolImplementation& operator=(const RFBProtocolImplementation&);
@@ -811,9 +1255,13 @@ namespace Voltaic {
             isSlave(isSlave),
             actionQueue(clusterMulticastPipe),
             remoteDisplay(),
+            remoteFramebuffer(),
             remoteCommThread(),
             remoteCommThreadStarted(false),
-            rfbProto(0)
+            rfbProto(0),
+            outboundQueue(),
+            sendThread(),
+            sendThreadStarted(false)
         {
         }
 
@@ -854,14 +1302,18 @@ namespace Voltaic {
         rfbCARD8                  getRfbCurrentEncoding()    const { return !rfbProto ? (rfbCARD8)rfbEncodingRaw     : rfbProto->getCurrentEncoding(); }
         bool                      getRfbIsBigEndian()        const { return !rfbProto ? false                        : rfbProto->getIsBigEndian(); }
 
+        rfb::RFBProtocol::ReceiveStats getRfbReceiveStats() const { return !rfbProto ? rfb::RFBProtocol::ReceiveStats() : rfbProto->getReceiveStats(); }
+
     public:
         virtual void startup(const RFBProtocolStartupData& rfbProtocolStartupData);
         virtual void shutdown();
 
         // performQueuedActions() must be called periodically
         // to make sure that updates from the remote desktop
-        // are posted to the remoteDisplay object.  true is
-        // returned iff something changed.
+        // are posted to the remoteDisplay object.  After the
+        // queued actions, it uploads the parts of
+        // remoteFramebuffer changed since the last call.  true
+        // is returned iff something changed.
         virtual bool performQueuedActions();
 
         // Use drawRemoteDisplaySurface() to send OpenGL commands
@@ -900,9 +1352,35 @@ namespace Voltaic {
             return (rfbProto != 0) && rfbProto->sendCStringViaKeyEvents(cstr, tabKeySym, enterKeySym, leftControlKeySym);
         }
 
+        // The enqueue* methods hand the message to the sendThread and return
+        // immediately, so the main thread never blocks on the socket.  They
+        // must only be called from the main thread.  They return false if
+        // isSlave is true, if not started up, or if the outbound queue is full.
+        virtual bool enqueueFramebufferUpdateRequest(int x, int y, size_t w, size_t h, bool incremental);
+        virtual bool enqueueKeyEvent(rfbCARD32 key, bool down);
+        virtual bool enqueuePointerEvent(int x, int y, int buttonMask);
+        virtual bool enqueueClientCutText(const char* str, size_t len);
+        virtual bool enqueueStringViaKeyEvents( const char* str,
+                                                size_t      len,
+                                                rfbCARD32   tabKeySym         = 0xff09,
+                                                rfbCARD32   enterKeySym       = 0xff0d,
+                                                rfbCARD32   leftControlKeySym = 0xffe3 );
+
+        bool enqueueCStringViaKeyEvents( const char* cstr,
+                                         rfbCARD32   tabKeySym         = 0xff09,
+                                         rfbCARD32   enterKeySym       = 0xff0d,
+                                         rfbCARD32   leftControlKeySym = 0xffe3)
+        {
+            return !cstr || enqueueStringViaKeyEvents(cstr, (size_t)::strlen(cstr), tabKeySym, enterKeySym, leftControlKeySym);
+        }
+
+    protected:
+        virtual void* sendThreadStart();  // drains outboundQueue into rfbProto; master node only
+
     public:
-        bool            getIsSlave()       const { return isSlave; }
-        TextureManager& getRemoteDisplay()       { return remoteDisplay; }
+        bool               getIsSlave()           const { return isSlave; }
+        TextureManager&    getRemoteDisplay()           { return remoteDisplay; }
+        ShadowFramebuffer& getRemoteFramebuffer()       { return remoteFramebuffer; }
 
     public:
         MessageManager& messageManager;
@@ -913,9 +1391,13 @@ namespace Voltaic {
         const bool                         isSlave;
         ActionQueue                        actionQueue;
         TextureManager                     remoteDisplay;
+        ShadowFramebuffer                  remoteFramebuffer;  // decoded updates; uploaded to remoteDisplay by performQueuedActions()
         Threads::Thread                    remoteCommThread;
         bool                               remoteCommThreadStarted;
         RFBProtocolImplementation*         rfbProto;  // 0 if isSlave
+        OutboundQueue                      outboundQueue;
+        Threads::Thread                    sendThread;
+        bool                               sendThreadStarted;
 
     private:
         // Disable these copiers:
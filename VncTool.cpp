@@ -299,13 +299,16 @@ VncToolFactory::HostDescriptor::HostDescriptor() :
     VncManager::RFBProtocolStartupData(),
     desktopHostString(),
     requestedEncodingsString(),
+    localSocketPathString(),
+    recordFileNameString(),
     beginDataString(),
     interDatumString(),
     endDataString(),
     initialEnableClickThrough(false),
     initialTimestampBeamedData(false),
     initialBeamedDataTag(),
-    initialAutoBeam(false)
+    initialAutoBeam(false),
+    maxPointerMotionRate(60.0)
 {
 }
 
@@ -317,13 +320,16 @@ VncToolFactory::HostDescriptor::HostDescriptor( Misc::ConfigurationFileSection&
     VncManager::RFBProtocolStartupData(),
     desktopHostString(hostName ? hostName : ""),
     requestedEncodingsString(),
+    localSocketPathString(),
+    recordFileNameString(),
     beginDataString(),
     interDatumString(),
     endDataString(),
     initialEnableClickThrough(false),
     initialTimestampBeamedData(false),
     initialBeamedDataTag(),
-    initialAutoBeam(false)
+    initialAutoBeam(false),
+    maxPointerMotionRate(60.0)
 {
     if (hostName && strchr(hostName, '/'))
         Misc::throwStdErr("Illegal hostname format \"%s\"", (hostName ? hostName : ""));
@@ -335,12 +341,27 @@ VncToolFactory::HostDescriptor::HostDescriptor( Misc::ConfigurationFileSection&
     initialTimestampBeamedData = cfs.retrieveValue<bool>(        "initialTimestampBeamedData", true  );
     initialBeamedDataTag       = cfs.retrieveValue<std::string>( "initialBeamedDataTag",       ""    );
     initialAutoBeam            = cfs.retrieveValue<bool>(        "initialAutoBeam",            false );
+    maxPointerMotionRate       = cfs.retrieveValue<float>(       "maxPointerMotionRate",       60.0  );
 
     requestedEncodingsString   = cfs.retrieveValue<std::string>( "requestedEncodings",         ""    );
+    localSocketPathString      = cfs.retrieveValue<std::string>( "localSocketPath",            ""    );
+    recordFileNameString       = cfs.retrieveValue<std::string>( "recordFileName",             ""    );
 
     this->RFBProtocolStartupData::initViaConnect    = cfs.retrieveValue<bool>(     "initViaConnect",    true  );
     this->RFBProtocolStartupData::rfbPort           = cfs.retrieveValue<unsigned>( "rfbPort",           0     );
     this->RFBProtocolStartupData::sharedDesktopFlag = cfs.retrieveValue<bool>(     "sharedDesktopFlag", true  );
+    this->RFBProtocolStartupData::commBufferSize    = cfs.retrieveValue<unsigned>( "commBufferSize",    0     );
+    this->RFBProtocolStartupData::connectTimeout    = cfs.retrieveValue<unsigned>( "connectTimeout",    0     );
+    this->RFBProtocolStartupData::adaptiveEncodings = cfs.retrieveValue<bool>(     "adaptiveEncodings", false );
+
+    std::string pixelLayoutString = cfs.retrieveValue<std::string>( "pixelLayout", VncManager::getPixelLayoutName(VncManager::PIXEL_LAYOUT_RGB) );
+
+    rfb::RFBProtocol::SocketOptions& so = this->RFBProtocolStartupData::socketOptions;
+    so.receiveBufferSize = cfs.retrieveValue<int>(  "socketReceiveBufferSize", so.receiveBufferSize );
+    so.sendBufferSize    = cfs.retrieveValue<int>(  "socketSendBufferSize",    so.sendBufferSize    );
+    so.noDelay           = cfs.retrieveValue<bool>( "socketNoDelay",           so.noDelay           );
+    so.quickAck          = cfs.retrieveValue<bool>( "socketQuickAck",          so.quickAck          );
+    so.busyPollUsec      = cfs.retrieveValue<int>(  "socketBusyPoll",          so.busyPollUsec      );
 
     if (hostName)
     {
@@ -356,18 +377,37 @@ VncToolFactory::HostDescriptor::HostDescriptor( Misc::ConfigurationFileSection&
         initialTimestampBeamedData = cfs.retrieveValue<bool>(        ( prefix+"initialTimestampBeamedData" ).c_str(), initialTimestampBeamedData );
         initialBeamedDataTag       = cfs.retrieveValue<std::string>( ( prefix+"initialBeamedDataTag"       ).c_str(), initialBeamedDataTag );
         initialAutoBeam            = cfs.retrieveValue<bool>(        ( prefix+"initialAutoBeam"            ).c_str(), initialAutoBeam );
+        maxPointerMotionRate       = cfs.retrieveValue<float>(       ( prefix+"maxPointerMotionRate"       ).c_str(), maxPointerMotionRate );
 
         requestedEncodingsString   = cfs.retrieveValue<std::string>( ( prefix+"requestedEncodings"         ).c_str(), requestedEncodingsString );
+        localSocketPathString      = cfs.retrieveValue<std::string>( ( prefix+"localSocketPath"            ).c_str(), localSocketPathString );
+        recordFileNameString       = cfs.retrieveValue<std::string>( ( prefix+"recordFileName"             ).c_str(), recordFileNameString );
 
         this->RFBProtocolStartupData::initViaConnect    = cfs.retrieveValue<bool>(     ( prefix+"initViaConnect"    ).c_str(), this->RFBProtocolStartupData::initViaConnect);
         this->RFBProtocolStartupData::rfbPort           = cfs.retrieveValue<unsigned>( ( prefix+"rfbPort"           ).c_str(), this->RFBProtocolStartupData::rfbPort);
         this->RFBProtocolStartupData::sharedDesktopFlag = cfs.retrieveValue<bool>(     ( prefix+"sharedDesktopFlag" ).c_str(), this->RFBProtocolStartupData::sharedDesktopFlag);
+        this->RFBProtocolStartupData::commBufferSize    = cfs.retrieveValue<unsigned>( ( prefix+"commBufferSize"    ).c_str(), (unsigned)this->RFBProtocolStartupData::commBufferSize);
+        this->RFBProtocolStartupData::connectTimeout    = cfs.retrieveValue<unsigned>( ( prefix+"connectTimeout"    ).c_str(), this->RFBProtocolStartupData::connectTimeout);
+        this->RFBProtocolStartupData::adaptiveEncodings = cfs.retrieveValue<bool>(     ( prefix+"adaptiveEncodings" ).c_str(), this->RFBProtocolStartupData::adaptiveEncodings);
+
+        pixelLayoutString = cfs.retrieveValue<std::string>( ( prefix+"pixelLayout" ).c_str(), pixelLayoutString );
+
+        so.receiveBufferSize = cfs.retrieveValue<int>(  ( prefix+"socketReceiveBufferSize" ).c_str(), so.receiveBufferSize );
+        so.sendBufferSize    = cfs.retrieveValue<int>(  ( prefix+"socketSendBufferSize"    ).c_str(), so.sendBufferSize    );
+        so.noDelay           = cfs.retrieveValue<bool>( ( prefix+"socketNoDelay"           ).c_str(), so.noDelay           );
+        so.quickAck          = cfs.retrieveValue<bool>( ( prefix+"socketQuickAck"          ).c_str(), so.quickAck          );
+        so.busyPollUsec      = cfs.retrieveValue<int>(  ( prefix+"socketBusyPoll"          ).c_str(), so.busyPollUsec      );
     }
 
+    if (!VncManager::findPixelLayout(pixelLayoutString.c_str(), this->RFBProtocolStartupData::pixelLayout))
+        Misc::throwStdErr("Unknown pixel layout \"%s\"", pixelLayoutString.c_str());
+
     this->RFBProtocolStartupData::desktopHost        = this->desktopHostString.c_str();
     this->RFBProtocolStartupData::requestedEncodings = this->requestedEncodingsString.c_str();
     if (this->RFBProtocolStartupData::requestedEncodings && !*this->RFBProtocolStartupData::requestedEncodings)
         this->RFBProtocolStartupData::requestedEncodings = 0;
+    this->RFBProtocolStartupData::localSocketPath    = this->localSocketPathString.empty() ? 0 : this->localSocketPathString.c_str();
+    this->RFBProtocolStartupData::recordFileName     = this->recordFileNameString.empty()  ? 0 : this->recordFileNameString.c_str();
 
     expandStringEscapes(beginDataString);
     expandStringEscapes(interDatumString);
@@ -388,15 +428,25 @@ VncToolFactory::HostDescriptor::HostDescriptor(const HostDescriptor& other)
     this->initialTimestampBeamedData                 = other.initialTimestampBeamedData;
     this->initialBeamedDataTag                       = other.initialBeamedDataTag;
     this->initialAutoBeam                            = other.initialAutoBeam;
+    this->maxPointerMotionRate                       = other.maxPointerMotionRate;
 
     this->desktopHostString                          = other.desktopHostString;
     this->requestedEncodingsString                   = other.requestedEncodingsString;
+    this->localSocketPathString                      = other.localSocketPathString;
+    this->recordFileNameString                       = other.recordFileNameString;
 
     this->RFBProtocolStartupData::initViaConnect     = other.RFBProtocolStartupData::initViaConnect;
     this->RFBProtocolStartupData::desktopHost        = this->desktopHostString.c_str();
     this->RFBProtocolStartupData::rfbPort            = other.RFBProtocolStartupData::rfbPort;
     this->RFBProtocolStartupData::requestedEncodings = this->requestedEncodingsString.c_str();
     this->RFBProtocolStartupData::sharedDesktopFlag  = other.RFBProtocolStartupData::sharedDesktopFlag;
+    this->RFBProtocolStartupData::commBufferSize     = other.RFBProtocolStartupData::commBufferSize;
+    this->RFBProtocolStartupData::connectTimeout     = other.RFBProtocolStartupData::connectTimeout;
+    this->RFBProtocolStartupData::adaptiveEncodings  = other.RFBProtocolStartupData::adaptiveEncodings;
+    this->RFBProtocolStartupData::pixelLayout        = other.RFBProtocolStartupData::pixelLayout;
+    this->RFBProtocolStartupData::socketOptions      = other.RFBProtocolStartupData::socketOptions;
+    this->RFBProtocolStartupData::localSocketPath    = this->localSocketPathString.empty() ? 0 : this->localSocketPathString.c_str();
+    this->RFBProtocolStartupData::recordFileName     = this->recordFileNameString.empty()  ? 0 : this->recordFileNameString.c_str();
 
     if (this->RFBProtocolStartupData::requestedEncodings && !*this->RFBProtocolStartupData::requestedEncodings)
         this->RFBProtocolStartupData::requestedEncodings = 0;
@@ -414,15 +464,25 @@ VncToolFactory::HostDescriptor::HostDescriptor& VncToolFactory::HostDescriptor::
     this->initialTimestampBeamedData                 = other.initialTimestampBeamedData;
     this->initialBeamedDataTag                       = other.initialBeamedDataTag;
     this->initialAutoBeam                            = other.initialAutoBeam;
+    this->maxPointerMotionRate                       = other.maxPointerMotionRate;
 
     this->desktopHostString                          = other.desktopHostString;
     this->requestedEncodingsString                   = other.requestedEncodingsString;
+    this->localSocketPathString                      = other.localSocketPathString;
+    this->recordFileNameString                       = other.recordFileNameString;
 
     this->RFBProtocolStartupData::initViaConnect     = other.RFBProtocolStartupData::initViaConnect;
     this->RFBProtocolStartupData::desktopHost        = this->desktopHostString.c_str();
     this->RFBProtocolStartupData::rfbPort            = other.RFBProtocolStartupData::rfbPort;
     this->RFBProtocolStartupData::requestedEncodings = this->requestedEncodingsString.c_str();
     this->RFBProtocolStartupData::sharedDesktopFlag  = other.RFBProtocolStartupData::sharedDesktopFlag;
+    this->RFBProtocolStartupData::commBufferSize     = other.RFBProtocolStartupData::commBufferSize;
+    this->RFBProtocolStartupData::connectTimeout     = other.RFBProtocolStartupData::connectTimeout;
+    this->RFBProtocolStartupData::adaptiveEncodings  = other.RFBProtocolStartupData::adaptiveEncodings;
+    this->RFBProtocolStartupData::pixelLayout        = other.RFBProtocolStartupData::pixelLayout;
+    this->RFBProtocolStartupData::socketOptions      = other.RFBProtocolStartupData::socketOptions;
+    this->RFBProtocolStartupData::localSocketPath    = this->localSocketPathString.empty() ? 0 : this->localSocketPathString.c_str();
+    this->RFBProtocolStartupData::recordFileName     = this->recordFileNameString.empty()  ? 0 : this->recordFileNameString.c_str();
 
     if (this->RFBProtocolStartupData::requestedEncodings && !*this->RFBProtocolStartupData::requestedEncodings)
         this->RFBProtocolStartupData::requestedEncodings = 0;
@@ -445,7 +505,8 @@ void VncToolFactory::HostDescriptor::setDesktopHost(const char* hostName)
 VncToolFactory::VncToolFactory(Vrui::ToolManager& toolManager) :
     ToolFactory("VncTool", toolManager),
     blankHostDescriptor(),
-    hostDescriptors()
+    hostDescriptors(),
+    connectionPool(0)
 {
     // Initialize tool layout:
     layout.setNumButtons(1);
@@ -473,6 +534,18 @@ VncToolFactory::VncToolFactory(Vrui::ToolManager& toolManager) :
     for (StringList::const_iterator it = hostNames.begin(); it != hostNames.end(); ++it)
         hostDescriptors.push_back(HostDescriptor(cfs, 0, it->c_str()));
 
+    // Optionally keep a connection to each configured host ready in the
+    // background so that switching desktops does not wait for connect().
+    // Only the master node connects to the servers.
+    if (cfs.retrieveValue<bool>("./prewarmConnections", false) && Vrui::isMaster())
+    {
+        connectionPool = new VncManager::ConnectionPool(cfs.retrieveValue<unsigned>("./prewarmMaxRetrySeconds", VncManager::ConnectionPool::DEFAULT_MAX_RETRY_SECONDS));
+        for (HostDescriptorList::const_iterator it = hostDescriptors.begin(); it != hostDescriptors.end(); ++it)
+            if (it->initViaConnect)
+                connectionPool->addDesktop(*it);
+        connectionPool->start();
+    }
+
     // Set tool class' factory pointer:
     VncTool::factory = this;
 }
@@ -483,6 +556,12 @@ VncToolFactory::~VncToolFactory()
 {
     // Reset tool class' factory pointer:
     VncTool::factory = 0;
+
+    if (connectionPool)
+    {
+        delete connectionPool;
+        connectionPool = 0;
+    }
 }
 
 
@@ -501,6 +580,16 @@ Vrui::Tool* VncToolFactory::createTool(const Vrui::ToolInputAssignment& inputAss
 
 
 
+int VncToolFactory::takePreconnectedSocket(const HostDescriptor& hostDescriptor) const
+{
+    if (!connectionPool || !hostDescriptor.initViaConnect)
+        return -1;
+    else
+        return connectionPool->take(hostDescriptor.desktopHost, hostDescriptor.rfbPort);
+}
+
+
+
 void VncToolFactory::destroyTool(Vrui::Tool* tool) const
 {
     delete tool;
@@ -1272,17 +1361,17 @@ void VncTool::startVncDialogWithHostDescriptor(const VncToolFactory::HostDescrip
         if (timestampBeamedDataToggle) timestampBeamedDataToggle->setToggle(hostDescriptor->initialTimestampBeamedData);
         if (beamedDataTagField)        beamedDataTagField->setString(hostDescriptor->initialBeamedDataTag.c_str());
 
-        // Start up a new VncDialog instance:
+        // Start up a new VncDialog instance, using a prewarmed connection if there is one:
+        VncManager::RFBProtocolStartupData startupData = *hostDescriptor;
+        startupData.preconnectedSocket = VncTool::factory->takePreconnectedSocket(*hostDescriptor);
+
         vncDialog = new VncDialog( "VncDialog",
                                    Vrui::getWidgetManager(),
-                                   hostDescriptor->desktopHost,
+                                   startupData,
                                    0 /* no password specified */,
-                                   hostDescriptor->rfbPort,
-                                   hostDescriptor->initViaConnect,
-                                   hostDescriptor->requestedEncodings,
-                                   hostDescriptor->sharedDesktopFlag,
                                    (enableClickThroughToggle && enableClickThroughToggle->getToggle()) );
 
+        vncDialog->setMaxPointerMotionRate(hostDescriptor->maxPointerMotionRate);
         vncDialog->addCloseButtonCallback(this, &VncTool::vncDialogCloseButtonCallback);
     }
 }
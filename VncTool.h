@@ -74,10 +74,13 @@ namespace Voltaic {
             bool        initialTimestampBeamedData;
             std::string initialBeamedDataTag;
             bool        initialAutoBeam;
+            float       maxPointerMotionRate;  // pointer motion events per second sent to the server; <= 0 ==> unlimited
 
         protected:
             std::string desktopHostString;
             std::string requestedEncodingsString;
+            std::string localSocketPathString;
+            std::string recordFileNameString;
         };
 
         typedef std::vector<HostDescriptor> HostDescriptorList;
@@ -93,9 +96,14 @@ namespace Voltaic {
         const HostDescriptorList& getHostDescriptors()     const { return hostDescriptors; }
         const HostDescriptor&     getBlankHostDescriptor() const { return blankHostDescriptor; }
 
+        // Returns a socket already connected to the given host (see
+        // VncManager::ConnectionPool), or -1 if none is available.
+        int takePreconnectedSocket(const HostDescriptor& hostDescriptor) const;
+
     protected:
-        HostDescriptor     blankHostDescriptor;  // blank hostName but initialized from configuration file defaults
-        HostDescriptorList hostDescriptors;
+        HostDescriptor              blankHostDescriptor;  // blank hostName but initialized from configuration file defaults
+        HostDescriptorList          hostDescriptors;
+        VncManager::ConnectionPool* connectionPool;       // 0 unless prewarmConnections is set; master node only
 
     private:
         // Disable these copiers:
@@ -44,7 +44,13 @@ VncWidget::VncWidget( VncManager::MessageManager&         messageManager,
     displayWidthMultiplier(DefaultDisplayWidthMultiplier),
     displayHeightMultiplier(DefaultDisplayHeightMultiplier),
     configuredInteriorSize(DefaultConfiguredInteriorSizeX, DefaultConfiguredInteriorSizeY, DefaultConfiguredInteriorSizeZ),
-    lastClickPoint()
+    lastClickPoint(),
+    maxPointerMotionRate(DefaultMaxPointerMotionRate),
+    lastSentButtonMask(-1),
+    lastPointerEventTime(),
+    pointerMotionPending(false),
+    pendingPointerX(0),
+    pendingPointerY(0)
 {
     if (sManageChild)
         manageChild();  // this has not been safe to do during construction...
@@ -155,7 +161,7 @@ void VncWidget::handlePointerEvent(GLMotif::Event& event, int buttonMask)
                 const GLfloat y = vncManager->getRemoteDisplayHeight() * (py / interiorH);
 
                 lastClickPoint = point;
-                (void)sendPointerEvent((int)(x+0.5), (int)(y+0.5), buttonMask);
+                queuePointerEvent((int)(x+0.5), (int)(y+0.5), buttonMask);
             }
         }
     }
@@ -163,6 +169,45 @@ void VncWidget::handlePointerEvent(GLMotif::Event& event, int buttonMask)
 
 
 
+void VncWidget::queuePointerEvent(int x, int y, int buttonMask)
+{
+    pendingPointerX      = x;
+    pendingPointerY      = y;
+    pointerMotionPending = true;
+
+    if (buttonMask != lastSentButtonMask)
+    {
+        // Button transitions are always sent at once, carrying the
+        // latest position (which supersedes any pending motion):
+        lastSentButtonMask = buttonMask;
+        flushPendingPointerMotion(true);
+    }
+    else
+        flushPendingPointerMotion(false);
+}
+
+
+
+void VncWidget::flushPendingPointerMotion(bool force)
+{
+    if (pointerMotionPending)
+    {
+        const Misc::Time now     = Misc::Time::now();
+        const Misc::Time elapsed = now - lastPointerEventTime;
+
+        if ( force                        ||
+             (maxPointerMotionRate <= 0)  ||
+             ((elapsed.tv_sec + elapsed.tv_nsec/1.0e9) * maxPointerMotionRate >= 1.0) )
+        {
+            pointerMotionPending = false;
+            lastPointerEventTime = now;
+            (void)sendPointerEvent(pendingPointerX, pendingPointerY, lastSentButtonMask);
+        }
+    }
+}
+
+
+
 void VncWidget::setEnableClickThrough(bool value)
 {
     enableClickThrough = value;
@@ -170,6 +215,13 @@ void VncWidget::setEnableClickThrough(bool value)
 
 
 
+void VncWidget::setMaxPointerMotionRate(GLfloat value)
+{
+    maxPointerMotionRate = value;
+}
+
+
+
 void VncWidget::setTrackDisplaySize(bool value)
 {
     trackDisplaySize = value;
@@ -224,6 +276,8 @@ bool VncWidget::checkForUpdates()
 
     if (vncManager)
     {
+        flushPendingPointerMotion(false);
+
         const GLsizei oldWidth  = getRemoteDisplayWidth();
         const GLsizei oldHeight = getRemoteDisplayHeight();
 
@@ -247,21 +301,21 @@ bool VncWidget::checkForUpdates()
 
 bool VncWidget::sendKeyEvent(rfbCARD32 key, bool down)
 {
-    return (vncManager != 0) && vncManager->sendKeyEvent(key, down);
+    return (vncManager != 0) && vncManager->enqueueKeyEvent(key, down);
 }
 
 
 
 bool VncWidget::sendPointerEvent(int x, int y, int buttonMask)
 {
-    return (vncManager != 0) && vncManager->sendPointerEvent(x, y, buttonMask);
+    return (vncManager != 0) && vncManager->enqueuePointerEvent(x, y, buttonMask);
 }
 
 
 
 bool VncWidget::sendClientCutText(const char* str, size_t len)
 {
-    return (vncManager != 0) && vncManager->sendClientCutText(str, len);
+    return (vncManager != 0) && vncManager->enqueueClientCutText(str, len);
 }
 
 
@@ -287,5 +341,6 @@ const GLfloat VncWidget::DefaultDisplayHeightMultiplier =   1.0;  // static memb
 const GLfloat VncWidget::DefaultConfiguredInteriorSizeX = 640.0;  // static member
 const GLfloat VncWidget::DefaultConfiguredInteriorSizeY = 480.0;  // static member
 const GLfloat VncWidget::DefaultConfiguredInteriorSizeZ =   0.0;  // static member; z size value is always 0
+const GLfloat VncWidget::DefaultMaxPointerMotionRate    =  60.0;  // static member; events per second
 
 }  // end of namespace Voltaic
@@ -22,6 +22,7 @@
 
 #include <deque>
 #include <string.h>
+#include <Misc/Time.h>
 #include <Vrui/Vrui.h>
 #include <GLMotif/Widget.h>
 #include <GL/GLObject.h>
@@ -86,10 +87,21 @@ namespace Voltaic {
     protected:
         virtual void handlePointerEvent(GLMotif::Event& event, int buttonMask);
 
+        // Pointer events are coalesced: a change of button state is sent
+        // immediately, but motion with an unchanged button state is sent at
+        // most maxPointerMotionRate times per second, and only the latest
+        // position is kept in between.  checkForUpdates() sends any pending
+        // motion once its time has come.
+        virtual void queuePointerEvent(int x, int y, int buttonMask);
+        virtual void flushPendingPointerMotion(bool force);
+
     public:
         bool         getEnableClickThrough() const { return enableClickThrough; }
         virtual void setEnableClickThrough(bool value);  // also calls attemptSizeUpdate()
 
+        GLfloat      getMaxPointerMotionRate() const { return maxPointerMotionRate; }
+        virtual void setMaxPointerMotionRate(GLfloat value);  // in events per second; <= 0 ==> unlimited
+
         bool         getTrackDisplaySize() const { return trackDisplaySize; }
         virtual void setTrackDisplaySize(bool value);  // also calls attemptSizeUpdate()
 
@@ -122,7 +134,8 @@ namespace Voltaic {
         GLsizei getRemoteDisplayWidth()  const { return (vncManager == 0) ? 0 : vncManager->getRemoteDisplayWidth();  }
         GLsizei getRemoteDisplayHeight() const { return (vncManager == 0) ? 0 : vncManager->getRemoteDisplayHeight(); }
 
-        // The send* methods are pass-throughs to the rfbProto object in the vncManager object.
+        // The send* methods queue the message for the vncManager's send thread
+        // (see VncManager::enqueue*()) and never block on the network.
         // They return false (always) if Vrui::isMaster() is false, i.e., they are usable
         // only from the master node.
         virtual bool sendKeyEvent(rfbCARD32 key, bool down);
@@ -143,7 +156,7 @@ namespace Voltaic {
                                              rfbCARD32   enterKeySym       = 0xff0d,
                                              rfbCARD32   leftControlKeySym = 0xffe3 )
         {
-            return (vncManager != 0) && vncManager->sendStringViaKeyEvents(str, len, tabKeySym, enterKeySym, leftControlKeySym);
+            return (vncManager != 0) && vncManager->enqueueStringViaKeyEvents(str, len, tabKeySym, enterKeySym, leftControlKeySym);
         }
 
         virtual bool sendCStringViaKeyEvents( const char* cstr,
@@ -151,7 +164,7 @@ namespace Voltaic {
                                               rfbCARD32   enterKeySym       = 0xff0d,
                                               rfbCARD32   leftControlKeySym = 0xffe3 )
         {
-            return (vncManager != 0) && vncManager->sendCStringViaKeyEvents(cstr, tabKeySym, enterKeySym, leftControlKeySym);
+            return (vncManager != 0) && vncManager->enqueueCStringViaKeyEvents(cstr, tabKeySym, enterKeySym, leftControlKeySym);
         }
 
         bool                      getRfbIsOpen()             const { return !vncManager ? false                        : vncManager->getRfbIsOpen(); }
@@ -177,6 +190,7 @@ namespace Voltaic {
         static const GLfloat DefaultConfiguredInteriorSizeX;  // = 640.0
         static const GLfloat DefaultConfiguredInteriorSizeY;  // = 480.0
         static const GLfloat DefaultConfiguredInteriorSizeZ;  // = 0.0
+        static const GLfloat DefaultMaxPointerMotionRate;     // = 60.0
 
     protected:
         VncManager* const vncManager;
@@ -186,6 +200,12 @@ namespace Voltaic {
         GLfloat           displayHeightMultiplier;  // defaults to DefaultDisplayHeightMultiplier
         GLMotif::Vector   configuredInteriorSize;   // defaults to (DefaultConfiguredInteriorSizeX, DefaultConfiguredInteriorSizeY, DefaultConfiguredInteriorSizeZ)
         GLMotif::Point    lastClickPoint;           // point on widget last clicked through to remote computer
+        GLfloat           maxPointerMotionRate;     // defaults to DefaultMaxPointerMotionRate
+        int               lastSentButtonMask;       // -1 until the first pointer event has been sent
+        Misc::Time        lastPointerEventTime;     // time the last pointer event was sent
+        bool              pointerMotionPending;     // true iff pendingPointerX/Y hold motion not yet sent
+        int               pendingPointerX;
+        int               pendingPointerY;
 
     private:
         // Disable these copiers:
@@ -0,0 +1,232 @@
+/*
+ *  jpegdecompressor.cpp
+ *
+ *  Copyright (C) 2007 Voltaic.  All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include "jpegdecompressor.h"
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+
+using namespace rfb;
+
+
+
+//----------------------------------------------------------------------
+// libjpeg callbacks
+
+struct ErrorManager
+{
+    struct jpeg_error_mgr pub;  // must be first; libjpeg only knows about this part
+    jmp_buf               jumpBuffer;
+    char*                 message;
+};
+
+static void errorExit(j_common_ptr cinfo)
+{
+    ErrorManager* const err = (ErrorManager*)cinfo->err;
+
+    (*cinfo->err->format_message)(cinfo, err->message);
+    longjmp(err->jumpBuffer, 1);
+}
+
+static void outputMessage(j_common_ptr)
+{
+    // warnings are ignored...
+}
+
+
+
+// The whole image is in memory when decompression begins, so there is
+// never more data to fill the input buffer with.  A truncated image is
+// terminated with a fake EOI marker, as libjpeg's own sources do.
+static void initSource(j_decompress_ptr)
+{
+}
+
+static boolean fillInputBuffer(j_decompress_ptr cinfo)
+{
+    static const JOCTET fakeEOI[2] = { 0xff, JPEG_EOI };
+
+    cinfo->src->next_input_byte = fakeEOI;
+    cinfo->src->bytes_in_buffer = 2;
+
+    return TRUE;
+}
+
+static void skipInputData(j_decompress_ptr cinfo, long numBytes)
+{
+    if (numBytes > 0)
+    {
+        if ((size_t)numBytes > cinfo->src->bytes_in_buffer)
+            numBytes = cinfo->src->bytes_in_buffer;
+
+        cinfo->src->next_input_byte += numBytes;
+        cinfo->src->bytes_in_buffer -= numBytes;
+    }
+}
+
+static void termSource(j_decompress_ptr)
+{
+}
+
+
+
+//----------------------------------------------------------------------
+// Nested struct State
+
+struct JpegDecompressor::State
+{
+    struct jpeg_decompress_struct cinfo;
+    ErrorManager                  err;
+    struct jpeg_source_mgr        src;
+    bool                          started;  // between successful begin() and end()
+};
+
+
+
+//----------------------------------------------------------------------
+// Main class JpegDecompressor
+
+JpegDecompressor::JpegDecompressor() :
+    state(0),
+    width(0),
+    height(0)
+{
+    errorMessage[0] = 0;
+}
+
+
+
+JpegDecompressor::~JpegDecompressor()
+{
+    if (state)
+    {
+        jpeg_destroy_decompress(&state->cinfo);
+        delete state;
+        state = 0;
+    }
+}
+
+
+
+bool JpegDecompressor::begin(const unsigned char* data, size_t length)
+{
+    if (!state)
+    {
+        state = new State;
+        memset(state, 0, sizeof(*state));
+
+        state->cinfo.err               = jpeg_std_error(&state->err.pub);
+        state->err.pub.error_exit      = errorExit;
+        state->err.pub.output_message  = outputMessage;
+        state->err.message             = errorMessage;
+
+        state->src.init_source       = initSource;
+        state->src.fill_input_buffer = fillInputBuffer;
+        state->src.skip_input_data   = skipInputData;
+        state->src.resync_to_restart = jpeg_resync_to_restart;
+        state->src.term_source       = termSource;
+
+        if (setjmp(state->err.jumpBuffer))
+        {
+            delete state;
+            state = 0;
+            return false;
+        }
+
+        jpeg_create_decompress(&state->cinfo);
+        state->cinfo.src = &state->src;
+    }
+
+    end();
+
+    width  = 0;
+    height = 0;
+    errorMessage[0] = 0;
+
+    state->src.next_input_byte = data;
+    state->src.bytes_in_buffer = length;
+
+    if (setjmp(state->err.jumpBuffer))
+    {
+        jpeg_abort_decompress(&state->cinfo);
+        return false;
+    }
+
+    (void)jpeg_read_header(&state->cinfo, TRUE);
+    state->cinfo.out_color_space = JCS_RGB;
+    (void)jpeg_start_decompress(&state->cinfo);
+
+    width          = state->cinfo.output_width;
+    height         = state->cinfo.output_height;
+    state->started = true;
+
+    return true;
+}
+
+
+
+bool JpegDecompressor::readRow(unsigned char* rgb)
+{
+    if (!state || !state->started)
+    {
+        strcpy(errorMessage, "no image is being decompressed");
+        return false;
+    }
+    else if (state->cinfo.output_scanline >= state->cinfo.output_height)
+    {
+        strcpy(errorMessage, "no more rows in image");
+        return false;
+    }
+    else
+    {
+        if (setjmp(state->err.jumpBuffer))
+        {
+            jpeg_abort_decompress(&state->cinfo);
+            state->started = false;
+            return false;
+        }
+
+        JSAMPROW row = (JSAMPROW)rgb;
+        return (jpeg_read_scanlines(&state->cinfo, &row, 1) == 1);
+    }
+}
+
+
+
+void JpegDecompressor::end()
+{
+    if (state && state->started)
+    {
+        state->started = false;
+
+        if (setjmp(state->err.jumpBuffer))
+        {
+            jpeg_abort_decompress(&state->cinfo);
+            return;
+        }
+
+        if (state->cinfo.output_scanline < state->cinfo.output_height)
+            jpeg_abort_decompress(&state->cinfo);
+        else
+            (void)jpeg_finish_decompress(&state->cinfo);
+    }
+}
@@ -0,0 +1,77 @@
+/*
+ *  jpegdecompressor.h
+ *
+ *  Copyright (C) 2007 Voltaic.  All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#ifndef __JPEGDECOMPRESSOR_H_INCLUDED__
+#define __JPEGDECOMPRESSOR_H_INCLUDED__
+
+#include <stddef.h>
+
+
+
+namespace rfb
+{
+    //----------------------------------------------------------------------
+    // JpegDecompressor decodes the JPEG images of the Tight encoding (see
+    // tight.cppinc) from memory via libjpeg.  libjpeg's state is kept out of
+    // this header so that jpeglib.h need only be included by
+    // jpegdecompressor.cpp.
+    class JpegDecompressor
+    {
+    public:
+        JpegDecompressor();
+        virtual ~JpegDecompressor();
+
+    public:
+        // begin() reads the header of the JPEG image held in the length
+        // bytes at data and prepares to decompress it to 8-bit RGB.  data
+        // must remain valid until end() is called.
+        virtual bool begin(const unsigned char* data, size_t length);
+
+        size_t getWidth()  const { return width;  }  // valid after begin()
+        size_t getHeight() const { return height; }  // valid after begin()
+
+        // readRow() decompresses the next row of the image into rgb, which
+        // must have room for getWidth()*3 bytes.
+        virtual bool readRow(unsigned char* rgb);
+
+        // end() finishes the image, or abandons it if not all rows were read.
+        virtual void end();
+
+        // getErrorMessage() describes why the last begin() or readRow() failed.
+        const char* getErrorMessage() const { return errorMessage; }
+
+    protected:
+        struct State;  // defined in jpegdecompressor.cpp
+
+        State* state;  // allocated by the first begin()
+        size_t width;
+        size_t height;
+        char   errorMessage[200];
+
+    private:
+        // Disable these copiers:
+        JpegDecompressor& operator=(const JpegDecompressor&) { return *this; }
+        JpegDecompressor(const JpegDecompressor&) {}
+    };
+
+}  // end of namespace rfb
+
+#endif  // #ifndef __JPEGDECOMPRESSOR_H_INCLUDED__
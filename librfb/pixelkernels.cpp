@@ -0,0 +1,583 @@
+/*
+ *  pixelkernels.cpp
+ *
+ *  Copyright (C) 2007 Voltaic.  All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include "pixelkernels.h"
+#include <string.h>
+#include <strings.h>
+
+// As in zrlekernels.cpp, the vector kernels are compiled via function
+// target attributes and only called if the CPU supports them.
+#if defined(__GNUC__) && (__GNUC__ >= 5) && (defined(__x86_64__) || defined(__i386__))
+#define PIXEL_KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+using namespace rfb;
+
+
+
+//----------------------------------------------------------------------
+// Pixel layouts.  The kernels are templates on a layout class, which
+// gives the pixel size and byte order as enum constants and the shifts
+// and maxes through static methods: FixedLayout returns template
+// parameters, which the compiler folds into the inner loops, and
+// VariableLayout returns the fields of the pixel format.
+
+template <int bpp, bool bigEndian, int rShift, int gShift, int bShift, int rMax, int gMax, int bMax>
+struct FixedLayout
+{
+    enum { BPP = bpp, IS_BIG_ENDIAN = bigEndian };
+
+    static int redShift(const rfbPixelFormat&)   { return rShift; }
+    static int greenShift(const rfbPixelFormat&) { return gShift; }
+    static int blueShift(const rfbPixelFormat&)  { return bShift; }
+    static int redMax(const rfbPixelFormat&)     { return rMax;   }
+    static int greenMax(const rfbPixelFormat&)   { return gMax;   }
+    static int blueMax(const rfbPixelFormat&)    { return bMax;   }
+};
+
+template <int bpp, bool bigEndian>
+struct VariableLayout
+{
+    enum { BPP = bpp, IS_BIG_ENDIAN = bigEndian };
+
+    static int redShift(const rfbPixelFormat& format)   { return format.redShift;   }
+    static int greenShift(const rfbPixelFormat& format) { return format.greenShift; }
+    static int blueShift(const rfbPixelFormat& format)  { return format.blueShift;  }
+    static int redMax(const rfbPixelFormat& format)     { return format.redMax;     }
+    static int greenMax(const rfbPixelFormat& format)   { return format.greenMax;   }
+    static int blueMax(const rfbPixelFormat& format)    { return format.blueMax;    }
+};
+
+// The fixed layouts, named by component order from most to least
+// significant bits.  8-bit pixels have no byte order; they use LE.
+typedef FixedLayout<32, true,  16, 8,  0, 255, 255, 255> LayoutRGB888BE;  // VncManager::DefaultRequestedPixelFormat
+typedef FixedLayout<32, false, 16, 8,  0, 255, 255, 255> LayoutRGB888LE;  // B,G,R,X in memory
+typedef FixedLayout<32, false,  0, 8, 16, 255, 255, 255> LayoutBGR888LE;  // R,G,B,X in memory
+typedef FixedLayout<16, true,  11, 5,  0,  31,  63,  31> LayoutRGB565BE;
+typedef FixedLayout<16, false, 11, 5,  0,  31,  63,  31> LayoutRGB565LE;
+typedef FixedLayout<16, false, 10, 5,  0,  31,  31,  31> LayoutRGB555LE;
+typedef FixedLayout< 8, false,  0, 3,  6,   7,   7,   3> LayoutBGR233;
+
+typedef VariableLayout<32, true>  Layout32BE;
+typedef VariableLayout<32, false> Layout32LE;
+typedef VariableLayout<16, true>  Layout16BE;
+typedef VariableLayout<16, false> Layout16LE;
+typedef VariableLayout< 8, false> Layout8;
+
+
+
+// matchesLayout() is true if format is true-color pixels in layout L.
+template <class L>
+static bool matchesLayout(const rfbPixelFormat& format)
+{
+    return ( format.trueColour && (format.bitsPerPixel == L::BPP) &&
+             ((L::BPP == 8) || ((format.bigEndian != 0) == (L::IS_BIG_ENDIAN != 0))) &&
+             (format.redShift == L::redShift(format)) && (format.greenShift == L::greenShift(format)) && (format.blueShift == L::blueShift(format)) &&
+             (format.redMax   == L::redMax(format))   && (format.greenMax   == L::greenMax(format))   && (format.blueMax   == L::blueMax(format))      );
+}
+
+// hasWholeByteComponents() is true if every component of a 32-bit pixel
+// in layout L is one whole byte, so that conversion is a byte shuffle.
+template <class L>
+static inline bool hasWholeByteComponents(const rfbPixelFormat& format)
+{
+    return ( (L::BPP == 32) &&
+             (L::redMax(format)   == 255) && ((L::redShift(format)   % 8) == 0) && (L::redShift(format)   <= 24) &&
+             (L::greenMax(format) == 255) && ((L::greenShift(format) % 8) == 0) && (L::greenShift(format) <= 24) &&
+             (L::blueMax(format)  == 255) && ((L::blueShift(format)  % 8) == 0) && (L::blueShift(format)  <= 24)    );
+}
+
+// shuffleIndex() is the index, within its pixel, of the byte that holds
+// the whole-byte component at shift in a 32-bit pixel in layout L.
+template <class L>
+static inline int shuffleIndex(int shift)
+{
+    return L::IS_BIG_ENDIAN ? (3 - (shift / 8)) : (shift / 8);
+}
+
+// makeShuffle32() fills shuffle with the byte shuffle that converts four
+// 32-bit pixels in layout L with whole-byte components into 12 bytes of
+// RGB triples; the last four bytes are zeroed.
+template <class L>
+static void makeShuffle32(char shuffle[16], const rfbPixelFormat& format)
+{
+    for (int k = 0; k < 4; k++)
+    {
+        shuffle[3*k + 0] = (char)(4*k + shuffleIndex<L>(L::redShift(format)));
+        shuffle[3*k + 1] = (char)(4*k + shuffleIndex<L>(L::greenShift(format)));
+        shuffle[3*k + 2] = (char)(4*k + shuffleIndex<L>(L::blueShift(format)));
+    }
+
+    for (int i = 12; i < 16; i++)
+        shuffle[i] = (char)0x80;
+}
+
+
+
+//----------------------------------------------------------------------
+// Scalar kernels
+
+// readPixel() reads one pixel in layout L from s.
+template <class L>
+static inline rfbCARD32 readPixel(const rfbCARD8* s)
+{
+    if (L::BPP == 8)
+        return s[0];
+    else if (L::BPP == 16)
+        return L::IS_BIG_ENDIAN ? (((rfbCARD32)s[0] << 8) | s[1]) : (((rfbCARD32)s[1] << 8) | s[0]);
+    else if (L::IS_BIG_ENDIAN)
+        return ((rfbCARD32)s[0] << 24) | ((rfbCARD32)s[1] << 16) | ((rfbCARD32)s[2] << 8) | s[3];
+    else
+        return ((rfbCARD32)s[3] << 24) | ((rfbCARD32)s[2] << 16) | ((rfbCARD32)s[1] << 8) | s[0];
+}
+
+template <class L>
+static void convertScalar(rfbCARD8* rgb, const void* src, int count, const rfbPixelFormat& format)
+{
+    const int rShift = L::redShift(format);
+    const int gShift = L::greenShift(format);
+    const int bShift = L::blueShift(format);
+    const int rMax   = L::redMax(format);
+    const int gMax   = L::greenMax(format);
+    const int bMax   = L::blueMax(format);
+
+    const rfbCARD8* s = (const rfbCARD8*)src;
+
+    for (int i = 0; i < count; i++, s += (L::BPP / 8))
+    {
+        const rfbCARD32 pixel = readPixel<L>(s);
+
+        *rgb++ = (rfbCARD8)((pixel >> rShift) & rMax);
+        *rgb++ = (rfbCARD8)((pixel >> gShift) & gMax);
+        *rgb++ = (rfbCARD8)((pixel >> bShift) & bMax);
+    }
+}
+
+
+
+#ifdef PIXEL_KERNELS_X86
+
+//----------------------------------------------------------------------
+// SSE2 kernels.  The components are shifted and masked in 32-bit (or
+// 16-bit) lanes and combined into one R,G,B,0 lane per pixel; without a
+// byte shuffle, the triples are stored from those lanes by overlapping
+// 4-byte stores, so each group needs one more pixel after it.  8-bit
+// pixels use the scalar kernel at every level.
+
+__attribute__((target("sse2")))
+static inline __m128i swapBytes16SSE2(__m128i v)
+{
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i swapBytes32SSE2(__m128i v)
+{
+    v = swapBytes16SSE2(v);
+    return _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xb1), 0xb1);
+}
+
+// rgbLanes32SSE2() converts four 32-bit pixels in host byte order to R,G,B,0 lanes.
+__attribute__((target("sse2")))
+static inline __m128i rgbLanes32SSE2(__m128i v, __m128i rShift, __m128i gShift, __m128i bShift, __m128i rMax, __m128i gMax, __m128i bMax)
+{
+    const __m128i r = _mm_and_si128(_mm_srl_epi32(v, rShift), rMax);
+    const __m128i g = _mm_and_si128(_mm_srl_epi32(v, gShift), gMax);
+    const __m128i b = _mm_and_si128(_mm_srl_epi32(v, bShift), bMax);
+
+    return _mm_or_si128(r, _mm_or_si128(_mm_slli_epi32(g, 8), _mm_slli_epi32(b, 16)));
+}
+
+// rgbLanes16SSE2() converts eight 16-bit pixels in host byte order to
+// R,G,B,0 lanes: pixels 0-3 in lo, pixels 4-7 in hi.
+__attribute__((target("sse2")))
+static inline void rgbLanes16SSE2(__m128i& lo, __m128i& hi, __m128i v, __m128i rShift, __m128i gShift, __m128i bShift, __m128i rMax, __m128i gMax, __m128i bMax)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    const __m128i r = _mm_packus_epi16(_mm_and_si128(_mm_srl_epi16(v, rShift), rMax), zero);
+    const __m128i g = _mm_packus_epi16(_mm_and_si128(_mm_srl_epi16(v, gShift), gMax), zero);
+    const __m128i b = _mm_packus_epi16(_mm_and_si128(_mm_srl_epi16(v, bShift), bMax), zero);
+
+    const __m128i rg = _mm_unpacklo_epi8(r, g);
+    const __m128i b0 = _mm_unpacklo_epi8(b, zero);
+
+    lo = _mm_unpacklo_epi16(rg, b0);
+    hi = _mm_unpackhi_epi16(rg, b0);
+}
+
+// storeTriplesSSE2() stores the four R,G,B,0 lanes of v as 12 bytes of
+// RGB triples, and overwrites the byte after them.
+__attribute__((target("sse2")))
+static inline void storeTriplesSSE2(rfbCARD8* rgb, __m128i v)
+{
+    int lane;
+
+    lane = _mm_cvtsi128_si32(v);                     memcpy(rgb + 0, &lane, sizeof(lane));
+    lane = _mm_cvtsi128_si32(_mm_srli_si128(v, 4));  memcpy(rgb + 3, &lane, sizeof(lane));
+    lane = _mm_cvtsi128_si32(_mm_srli_si128(v, 8));  memcpy(rgb + 6, &lane, sizeof(lane));
+    lane = _mm_cvtsi128_si32(_mm_srli_si128(v, 12)); memcpy(rgb + 9, &lane, sizeof(lane));
+}
+
+template <class L>
+__attribute__((target("sse2")))
+static void convertSSE2(rfbCARD8* rgb, const void* src, int count, const rfbPixelFormat& format)
+{
+    const rfbCARD8* s = (const rfbCARD8*)src;
+
+    const __m128i rShift = _mm_cvtsi32_si128(L::redShift(format));
+    const __m128i gShift = _mm_cvtsi32_si128(L::greenShift(format));
+    const __m128i bShift = _mm_cvtsi32_si128(L::blueShift(format));
+
+    int i = 0;
+
+    if (L::BPP == 16)
+    {
+        const __m128i rMax = _mm_set1_epi16((short)(L::redMax(format)   & 0xff));
+        const __m128i gMax = _mm_set1_epi16((short)(L::greenMax(format) & 0xff));
+        const __m128i bMax = _mm_set1_epi16((short)(L::blueMax(format)  & 0xff));
+
+        for ( ; (i + 8) < count; i += 8)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*)(s + 2*i));
+            if (L::IS_BIG_ENDIAN)
+                v = swapBytes16SSE2(v);
+
+            __m128i lo, hi;
+            rgbLanes16SSE2(lo, hi, v, rShift, gShift, bShift, rMax, gMax, bMax);
+
+            storeTriplesSSE2(rgb + 3*i,      lo);
+            storeTriplesSSE2(rgb + 3*i + 12, hi);
+        }
+    }
+    else if (L::BPP == 32)
+    {
+        const __m128i rMax = _mm_set1_epi32(L::redMax(format)   & 0xff);
+        const __m128i gMax = _mm_set1_epi32(L::greenMax(format) & 0xff);
+        const __m128i bMax = _mm_set1_epi32(L::blueMax(format)  & 0xff);
+
+        for ( ; (i + 4) < count; i += 4)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*)(s + 4*i));
+            if (L::IS_BIG_ENDIAN)
+                v = swapBytes32SSE2(v);
+
+            storeTriplesSSE2(rgb + 3*i, rgbLanes32SSE2(v, rShift, gShift, bShift, rMax, gMax, bMax));
+        }
+    }
+
+    convertScalar<L>(rgb + 3*i, s + (L::BPP / 8)*i, count - i, format);
+}
+
+
+
+//----------------------------------------------------------------------
+// SSSE3 kernels.  A byte shuffle swaps big-endian pixels' bytes and packs
+// the R,G,B,0 lanes into triples, or converts whole-byte 32-bit pixels
+// in one step.  Each 16-byte store holds 12 bytes of triples, so each
+// group needs two more pixels after it.
+
+template <class L>
+__attribute__((target("ssse3")))
+static void convertSSSE3(rfbCARD8* rgb, const void* src, int count, const rfbPixelFormat& format)
+{
+    const rfbCARD8* s = (const rfbCARD8*)src;
+
+    const __m128i compact = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+    int i = 0;
+
+    if (hasWholeByteComponents<L>(format))
+    {
+        char shuffleBytes[16];
+        makeShuffle32<L>(shuffleBytes, format);
+        const __m128i shuffle = _mm_loadu_si128((const __m128i*)shuffleBytes);
+
+        for ( ; (i + 4 + 2) <= count; i += 4)
+            _mm_storeu_si128((__m128i*)(rgb + 3*i), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(s + 4*i)), shuffle));
+    }
+    else if (L::BPP == 16)
+    {
+        const __m128i rShift = _mm_cvtsi32_si128(L::redShift(format));
+        const __m128i gShift = _mm_cvtsi32_si128(L::greenShift(format));
+        const __m128i bShift = _mm_cvtsi32_si128(L::blueShift(format));
+        const __m128i rMax   = _mm_set1_epi16((short)(L::redMax(format)   & 0xff));
+        const __m128i gMax   = _mm_set1_epi16((short)(L::greenMax(format) & 0xff));
+        const __m128i bMax   = _mm_set1_epi16((short)(L::blueMax(format)  & 0xff));
+        const __m128i swap   = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+
+        for ( ; (i + 8 + 2) <= count; i += 8)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*)(s + 2*i));
+            if (L::IS_BIG_ENDIAN)
+                v = _mm_shuffle_epi8(v, swap);
+
+            __m128i lo, hi;
+            rgbLanes16SSE2(lo, hi, v, rShift, gShift, bShift, rMax, gMax, bMax);
+
+            _mm_storeu_si128((__m128i*)(rgb + 3*i),      _mm_shuffle_epi8(lo, compact));
+            _mm_storeu_si128((__m128i*)(rgb + 3*i + 12), _mm_shuffle_epi8(hi, compact));
+        }
+    }
+    else if (L::BPP == 32)
+    {
+        const __m128i rShift = _mm_cvtsi32_si128(L::redShift(format));
+        const __m128i gShift = _mm_cvtsi32_si128(L::greenShift(format));
+        const __m128i bShift = _mm_cvtsi32_si128(L::blueShift(format));
+        const __m128i rMax   = _mm_set1_epi32(L::redMax(format)   & 0xff);
+        const __m128i gMax   = _mm_set1_epi32(L::greenMax(format) & 0xff);
+        const __m128i bMax   = _mm_set1_epi32(L::blueMax(format)  & 0xff);
+        const __m128i swap   = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+
+        for ( ; (i + 4 + 2) <= count; i += 4)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*)(s + 4*i));
+            if (L::IS_BIG_ENDIAN)
+                v = _mm_shuffle_epi8(v, swap);
+
+            _mm_storeu_si128((__m128i*)(rgb + 3*i), _mm_shuffle_epi8(rgbLanes32SSE2(v, rShift, gShift, bShift, rMax, gMax, bMax), compact));
+        }
+    }
+
+    convertScalar<L>(rgb + 3*i, s + (L::BPP / 8)*i, count - i, format);
+}
+
+
+
+//----------------------------------------------------------------------
+// AVX2 kernels: the SSSE3 kernels on twice as many pixels at a time.
+// Byte shuffles work within 128-bit lanes, so the triples of each lane
+// are stored separately, in order, each store overwriting the previous
+// one's four spare bytes.
+
+__attribute__((target("avx2")))
+static inline void storeTriplesAVX2(rfbCARD8* rgb, __m256i v)
+{
+    _mm_storeu_si128((__m128i*)rgb,        _mm256_castsi256_si128(v));
+    _mm_storeu_si128((__m128i*)(rgb + 12), _mm256_extracti128_si256(v, 1));
+}
+
+template <class L>
+__attribute__((target("avx2")))
+static void convertAVX2(rfbCARD8* rgb, const void* src, int count, const rfbPixelFormat& format)
+{
+    const rfbCARD8* s = (const rfbCARD8*)src;
+
+    const __m256i compact = _mm256_broadcastsi128_si256(_mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1));
+
+    int i = 0;
+
+    if (hasWholeByteComponents<L>(format))
+    {
+        char shuffleBytes[16];
+        makeShuffle32<L>(shuffleBytes, format);
+        const __m256i shuffle = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)shuffleBytes));
+
+        for ( ; (i + 8 + 2) <= count; i += 8)
+            storeTriplesAVX2(rgb + 3*i, _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(s + 4*i)), shuffle));
+    }
+    else if (L::BPP == 16)
+    {
+        const __m128i rShift = _mm_cvtsi32_si128(L::redShift(format));
+        const __m128i gShift = _mm_cvtsi32_si128(L::greenShift(format));
+        const __m128i bShift = _mm_cvtsi32_si128(L::blueShift(format));
+        const __m256i rMax   = _mm256_set1_epi16((short)(L::redMax(format)   & 0xff));
+        const __m256i gMax   = _mm256_set1_epi16((short)(L::greenMax(format) & 0xff));
+        const __m256i bMax   = _mm256_set1_epi16((short)(L::blueMax(format)  & 0xff));
+        const __m256i zero   = _mm256_setzero_si256();
+        const __m256i swap   = _mm256_broadcastsi128_si256(_mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14));
+
+        for ( ; (i + 16 + 2) <= count; i += 16)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(s + 2*i));
+            if (L::IS_BIG_ENDIAN)
+                v = _mm256_shuffle_epi8(v, swap);
+
+            const __m256i r = _mm256_packus_epi16(_mm256_and_si256(_mm256_srl_epi16(v, rShift), rMax), zero);
+            const __m256i g = _mm256_packus_epi16(_mm256_and_si256(_mm256_srl_epi16(v, gShift), gMax), zero);
+            const __m256i b = _mm256_packus_epi16(_mm256_and_si256(_mm256_srl_epi16(v, bShift), bMax), zero);
+
+            const __m256i rg = _mm256_unpacklo_epi8(r, g);
+            const __m256i b0 = _mm256_unpacklo_epi8(b, zero);
+
+            // Low lanes hold pixels 0-7, high lanes pixels 8-15:
+            const __m256i lo = _mm256_shuffle_epi8(_mm256_unpacklo_epi16(rg, b0), compact);  // pixels 0-3 and 8-11
+            const __m256i hi = _mm256_shuffle_epi8(_mm256_unpackhi_epi16(rg, b0), compact);  // pixels 4-7 and 12-15
+
+            rfbCARD8* const d = rgb + 3*i;
+            _mm_storeu_si128((__m128i*)(d),      _mm256_castsi256_si128(lo));
+            _mm_storeu_si128((__m128i*)(d + 12), _mm256_castsi256_si128(hi));
+            _mm_storeu_si128((__m128i*)(d + 24), _mm256_extracti128_si256(lo, 1));
+            _mm_storeu_si128((__m128i*)(d + 36), _mm256_extracti128_si256(hi, 1));
+        }
+    }
+    else if (L::BPP == 32)
+    {
+        const __m128i rShift = _mm_cvtsi32_si128(L::redShift(format));
+        const __m128i gShift = _mm_cvtsi32_si128(L::greenShift(format));
+        const __m128i bShift = _mm_cvtsi32_si128(L::blueShift(format));
+        const __m256i rMax   = _mm256_set1_epi32(L::redMax(format)   & 0xff);
+        const __m256i gMax   = _mm256_set1_epi32(L::greenMax(format) & 0xff);
+        const __m256i bMax   = _mm256_set1_epi32(L::blueMax(format)  & 0xff);
+        const __m256i swap   = _mm256_broadcastsi128_si256(_mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12));
+
+        for ( ; (i + 8 + 2) <= count; i += 8)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(s + 4*i));
+            if (L::IS_BIG_ENDIAN)
+                v = _mm256_shuffle_epi8(v, swap);
+
+            const __m256i r = _mm256_and_si256(_mm256_srl_epi32(v, rShift), rMax);
+            const __m256i g = _mm256_and_si256(_mm256_srl_epi32(v, gShift), gMax);
+            const __m256i b = _mm256_and_si256(_mm256_srl_epi32(v, bShift), bMax);
+
+            const __m256i lanes = _mm256_or_si256(r, _mm256_or_si256(_mm256_slli_epi32(g, 8), _mm256_slli_epi32(b, 16)));
+
+            storeTriplesAVX2(rgb + 3*i, _mm256_shuffle_epi8(lanes, compact));
+        }
+    }
+
+    convertScalar<L>(rgb + 3*i, s + (L::BPP / 8)*i, count - i, format);
+}
+
+#endif  // #ifdef PIXEL_KERNELS_X86
+
+
+
+// selectConverter() returns the kernel for layout L at level l, or 0 if
+// l was not compiled in.
+template <class L>
+static PixelKernels::Converter selectConverter(PixelKernels::Level l)
+{
+    switch (l)
+    {
+        case PixelKernels::LEVEL_SCALAR: return convertScalar<L>;
+#ifdef PIXEL_KERNELS_X86
+        case PixelKernels::LEVEL_SSE2:   return convertSSE2<L>;
+        case PixelKernels::LEVEL_SSSE3:  return convertSSSE3<L>;
+        case PixelKernels::LEVEL_AVX2:   return convertAVX2<L>;
+#endif
+        default:                         return 0;
+    }
+}
+
+// The layouts getConverter() knows, fixed layouts first:
+struct LayoutEntry
+{
+    bool                    (*matches)(const rfbPixelFormat& format);
+    PixelKernels::Converter (*select)(PixelKernels::Level l);
+};
+
+static const LayoutEntry Layouts[] =
+{
+    { matchesLayout<LayoutRGB888BE>, selectConverter<LayoutRGB888BE> },
+    { matchesLayout<LayoutRGB888LE>, selectConverter<LayoutRGB888LE> },
+    { matchesLayout<LayoutBGR888LE>, selectConverter<LayoutBGR888LE> },
+    { matchesLayout<LayoutRGB565BE>, selectConverter<LayoutRGB565BE> },
+    { matchesLayout<LayoutRGB565LE>, selectConverter<LayoutRGB565LE> },
+    { matchesLayout<LayoutRGB555LE>, selectConverter<LayoutRGB555LE> },
+    { matchesLayout<LayoutBGR233>,   selectConverter<LayoutBGR233>   },
+    { matchesLayout<Layout32BE>,     selectConverter<Layout32BE>     },
+    { matchesLayout<Layout32LE>,     selectConverter<Layout32LE>     },
+    { matchesLayout<Layout16BE>,     selectConverter<Layout16BE>     },
+    { matchesLayout<Layout16LE>,     selectConverter<Layout16LE>     },
+    { matchesLayout<Layout8>,        selectConverter<Layout8>        }
+};
+
+
+
+//----------------------------------------------------------------------
+// PixelKernels methods
+
+PixelKernels::Level PixelKernels::getBestSupportedLevel()  // static method
+{
+#ifdef PIXEL_KERNELS_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+        return LEVEL_AVX2;
+    else if (__builtin_cpu_supports("ssse3"))
+        return LEVEL_SSSE3;
+    else if (__builtin_cpu_supports("sse2"))
+        return LEVEL_SSE2;
+#endif
+
+    return LEVEL_SCALAR;
+}
+
+
+
+bool PixelKernels::setLevel(Level newLevel)  // static method
+{
+    if ((newLevel > getBestSupportedLevel()) || !selectConverter<Layout32BE>(newLevel))
+        return false;
+    else
+    {
+        level = newLevel;
+        return true;
+    }
+}
+
+
+
+const char* PixelKernels::getLevelName(Level l)  // static method
+{
+    switch (l)
+    {
+        case LEVEL_SCALAR: return "scalar";
+        case LEVEL_SSE2:   return "sse2";
+        case LEVEL_SSSE3:  return "ssse3";
+        case LEVEL_AVX2:   return "avx2";
+        default:           return "unknown";
+    }
+}
+
+
+
+bool PixelKernels::findLevel(const char* name, Level& l)  // static method
+{
+    static const Level levels[] = { LEVEL_SCALAR, LEVEL_SSE2, LEVEL_SSSE3, LEVEL_AVX2 };
+
+    for (size_t i = 0; i < (sizeof(levels)/sizeof(levels[0])); i++)
+        if (name && (strcasecmp(name, getLevelName(levels[i])) == 0))
+        {
+            l = levels[i];
+            return true;
+        }
+
+    return false;
+}
+
+
+
+PixelKernels::Converter PixelKernels::getConverter(const rfbPixelFormat& format)  // static method
+{
+    for (size_t i = 0; i < (sizeof(Layouts)/sizeof(Layouts[0])); i++)
+        if (Layouts[i].matches(format))
+            return Layouts[i].select(level);
+
+    return 0;
+}
+
+
+
+PixelKernels::Level PixelKernels::level = PixelKernels::getBestSupportedLevel();  // static member
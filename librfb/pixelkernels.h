@@ -0,0 +1,77 @@
+/*
+ *  pixelkernels.h
+ *
+ *  Copyright (C) 2007 Voltaic.  All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#ifndef __PIXELKERNELS_H_INCLUDED__
+#define __PIXELKERNELS_H_INCLUDED__
+
+#include "rfbproto.h"
+
+
+
+namespace rfb
+{
+    //----------------------------------------------------------------------
+    // PixelKernels converts rows of true-color pixels to 8-bit RGB triples.
+    // Each component is (pixel >> xxxShift) & xxxMax, truncated to 8 bits,
+    // with multi-byte pixels in the byte order given by the pixel format.
+    // Like ZrleKernels, the kernels have a portable implementation and, on
+    // x86 compilers that support it, SSE2, SSSE3 and AVX2 implementations;
+    // the best level supported by the CPU is selected when the program
+    // starts.  The kernels are templates, instantiated for common pixel
+    // layouts with the layout as compile-time constants, and for any other
+    // layout of 8, 16 or 32 bits per pixel with the layout read from the
+    // pixel format.  32-bit pixels whose components are whole bytes are
+    // converted by byte shuffles alone at the SSSE3 and AVX2 levels.
+    class PixelKernels
+    {
+    public:
+        enum Level
+        {
+            LEVEL_SCALAR = 0,
+            LEVEL_SSE2,
+            LEVEL_SSSE3,
+            LEVEL_AVX2
+        };
+
+        static Level       getBestSupportedLevel();
+        static Level       getLevel()                 { return level; }
+        static bool        setLevel(Level newLevel);  // fails if newLevel is not supported by the CPU or the compiler; affects later getConverter() calls only
+        static const char* getLevelName(Level l);
+        static bool        findLevel(const char* name, Level& l);  // l is the Level named by name; false if there is none
+
+    public:
+        // A Converter converts count pixels at src into count RGB triples at
+        // rgb.  format must be the pixel format the Converter was returned
+        // for; Converters specialized for a layout ignore it.
+        typedef void (*Converter)(rfbCARD8* rgb, const void* src, int count, const rfbPixelFormat& format);
+
+        // getConverter() returns the Converter for format at the current
+        // level, or 0 if format is not true-color with 8, 16 or 32 bits per
+        // pixel.  Call it once the pixel format is settled, not per pixel.
+        static Converter getConverter(const rfbPixelFormat& format);
+
+    protected:
+        static Level level;
+    };
+
+}  // end of namespace rfb
+
+#endif  // #ifndef __PIXELKERNELS_H_INCLUDED__
@@ -23,7 +23,15 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include "d3des.h"
+#include "zrlekernels.h"
 
 using namespace rfb;
 
@@ -31,6 +39,61 @@ using namespace rfb;
 
 //----------------------------------------------------------------------
 
+static long long MonotonicTimeUsec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((long long)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+
+
+static long long ThreadCpuTimeUsec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ((long long)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+
+
+// SwapPixel*() reverse the byte order of a pixel.
+static inline rfbCARD8  SwapPixel8(rfbCARD8 p)   { return p; }
+static inline rfbCARD16 SwapPixel16(rfbCARD16 p) { return (rfbCARD16)((p << 8) | (p >> 8)); }
+static inline rfbCARD32 SwapPixel32(rfbCARD32 p) { return ((p & 0xff000000) >> 24) | ((p & 0x00ff0000) >> 8) | ((p & 0x0000ff00) << 8) | ((p & 0x000000ff) << 24); }
+
+
+
+// ConnectToServer() and ConnectToLocalServer() run on threads that may be
+// cancelled while they wait (e.g., by VncManager::ConnectionPool::stop()),
+// so the sockets they own are registered with pthread_cleanup_push() for
+// ClosePendingSockets() to close; entries that are -1 are skipped.
+struct PendingSockets
+{
+    int*   socks;
+    size_t count;
+};
+
+static void ClosePendingSockets(void* arg)
+{
+    const PendingSockets* const pending = (const PendingSockets*)arg;
+
+    for (size_t i = 0; i < pending->count; i++)
+        if (pending->socks[i] >= 0)
+            ::close(pending->socks[i]);
+}
+
+
+
+// Likewise, the address list ConnectToServer() resolves is registered for
+// FreeAddrInfo() to free:
+static void FreeAddrInfo(void* arg)
+{
+    freeaddrinfo((struct addrinfo*)arg);
+}
+
+
+
 static bool TestIsLocalMachine(uint32_t hostAddrInNetworkByteOrder)
 {
     // NOTE: This should be more sophisticated...
@@ -55,6 +118,48 @@ static bool TestIsLocalMachine(uint32_t hostAddrInNetworkByteOrder)
 
 
 
+//----------------------------------------------------------------------
+// Nested struct SocketOptions
+
+RFBProtocol::SocketOptions::SocketOptions() :
+    receiveBufferSize(0),
+    sendBufferSize(0),
+    noDelay(true),
+    quickAck(false),
+    busyPollUsec(0)
+{
+}
+
+
+
+//----------------------------------------------------------------------
+// Nested struct ReceiveStats
+
+RFBProtocol::ReceiveStats::ReceiveStats() :
+    bytes(0),
+    rectangles(0),
+    updates(0),
+    pixels(0),
+    elapsedUsec(0)
+{
+}
+
+
+
+//----------------------------------------------------------------------
+// Nested struct EncodingPolicyStats
+
+RFBProtocol::EncodingPolicyStats::EncodingPolicyStats() :
+    policy(POLICY_BALANCED),
+    linkThroughput(0),
+    decodeNsecPerPixel(0),
+    bytesPerPixel(0),
+    changes(0)
+{
+}
+
+
+
 //----------------------------------------------------------------------
 // Nested class ZlibDecompressor
 
@@ -187,6 +292,34 @@ int RFBProtocol::ZlibDecompressor::overrun(size_t itemSize, unsigned nItems)
 
 
 
+size_t RFBProtocol::ZlibDecompressor::refill(size_t n)
+{
+    if (n > BUFFER_SIZE)
+        return 0;
+    else
+    {
+        if ((end - ptr) != 0)
+            memmove(start, ptr, end-ptr);
+
+        const int diff = ptr - start;
+        offset += diff;
+        end    -= diff;
+
+        ptr = start;
+
+        while (size_t(end - ptr) < n)
+        {
+            const rfbCARD8* const oldEnd = end;
+            if (!decompress() || ((bytesIn == 0) && (end == oldEnd)))
+                break;  // error, or the compressed data has ended
+        }
+
+        return size_t(end - ptr);
+    }
+}
+
+
+
 bool RFBProtocol::ZlibDecompressor::readBytes(void* data, int length)
 {
     rfbCARD8*             dataPtr = (rfbCARD8*)data;
@@ -216,22 +349,34 @@ bool RFBProtocol::ZlibDecompressor::decompress()
     zs.next_out  = (rfbCARD8*)end;
     zs.avail_out = start + BUFFER_SIZE - end;
 
-    size_t avail = outer->commBufferFill - outer->commBufferPos;
-    if (avail < 1)
+    // Once bytesIn is exhausted, only output still pending inside zlib is
+    // produced; whatever the server sends next is not ours to wait for.
+    if ((bytesIn > 0) && (outer->commBufferAvail < 1))
         if (!outer->checkAvailableFromRFBServer(1))
             return false;
 
-    zs.next_in  = (rfbCARD8*)(outer->commBuffer + outer->commBufferPos);
+    // Inflate directly from the ring buffer.  Only the contiguous part
+    // up to the wrap point is offered; the remainder is picked up by the
+    // next call.
+    size_t avail = outer->commBufferSize - outer->commBufferPos;
+    if (avail > outer->commBufferAvail)
+        avail = outer->commBufferAvail;
+    if (avail > bytesIn)
+        avail = bytesIn;
+
+    const char* const in = outer->commBuffer + outer->commBufferPos;
+
+    zs.next_in  = (rfbCARD8*)in;
     zs.avail_in = avail;
-    if (zs.avail_in > bytesIn)
-        zs.avail_in = bytesIn;
 
     if (inflate(&zs, Z_SYNC_FLUSH) != Z_OK)
         return false;
 
-    bytesIn -= ((const char*)zs.next_in - (const char*)(outer->commBuffer + outer->commBufferPos));
+    const size_t consumed = ((const char*)zs.next_in - in);
+
+    bytesIn -= consumed;
     end = zs.next_out;
-    outer->commBufferPos = ((const char*)zs.next_in - (const char*)outer->commBuffer);
+    outer->consumeCommBuffer(consumed);
 
     return true;
 }
@@ -243,6 +388,8 @@ bool RFBProtocol::ZlibDecompressor::decompress()
 
 const rfbCARD16 RFBProtocol::EndianTest = 1;
 
+const char RFBProtocol::RECORD_FILE_HEADER[] = "FBS 001.000\n";
+
 
 
 RFBProtocol::RFBProtocol() :
@@ -266,16 +413,75 @@ RFBProtocol::RFBProtocol() :
     updateNeeded(false),
     updateDefinitelyExpected(false),
     zlibDecompressor(),
+    rawRectBuffer(0),
+    rawRectBufferSize(0),
+    preconnectedSock(-1),
+    sockIsLocal(false),
+    localSocketPath(0),
+    recordFileName(0),
+    recordFile(0),
+    recordStartTime(0),
+    connectTimeoutMsec(DEFAULT_CONNECT_TIMEOUT_MSEC),
+    socketOptions(),
+    connectDurationUsec(0),
+    receiveStats(),
+    receiveStartTime(0),
+    receiveStopTime(0),
+    replayFile(0),
+    replayRealTime(false),
+    replayEnded(false),
+    replayStartTime(0),
+    replayBlock(0),
+    replayBlockSize(0),
+    replayBlockLength(0),
+    replayBlockPos(0),
+    replayBlockTimestamp(0),
+    adaptiveEncodings(false),
+    encodingPolicy(POLICY_BALANCED),
+    policyChanges(0),
+    linkThroughput(0),
+    adaptWindowStart(0),
+    adaptWallUsec(0),
+    adaptCpuUsec(0),
+    adaptBytes(0),
+    adaptPixels(0),
+    adaptDirection(0),
+    adaptStableCount(0),
+    commBuffer(0),
+    commBufferSize(DEFAULT_COMM_BUFFER_SIZE),
     commBufferPos(0),
-    commBufferFill(0)
+    commBufferAvail(0),
+    outputBatchKeyValid(false),
+    jpegDecompressor(),
+    tightDataBuffer(0),
+    tightDataBufferSize(0)
 {
     zlibDecompressor.outer = this;
+    for (int i = 0; i < NUM_TIGHT_ZLIB_STREAMS; i++)
+        tightZlibDecompressors[i].outer = this;
+
+    pthread_mutex_init(&sockWriteMutex, 0);
+    outputBatchKeyValid = (pthread_key_create(&outputBatchKey, FreeOutputBatch) == 0);
+
+    // The wakeup pipe lets close() interrupt a reader blocked in
+    // checkAvailableFromRFBServer().  If it cannot be created, the
+    // reader still wakes up via the shutdown() performed by close().
+    if (pipe(wakeupPipe) < 0)
+        wakeupPipe[0] = wakeupPipe[1] = -1;
+    else
+    {
+        fcntl(wakeupPipe[0], F_SETFL, fcntl(wakeupPipe[0], F_GETFL) | O_NONBLOCK);
+        fcntl(wakeupPipe[1], F_SETFL, fcntl(wakeupPipe[1], F_GETFL) | O_NONBLOCK);
+    }
 
     memset(&desktopIPAddress, 0, sizeof(desktopIPAddress));
     memset(&pixelFormat,      0, sizeof(pixelFormat));
     memset(&si,               0, sizeof(si));
-    memset(commBuffer,        0, COMM_BUFFER_SIZE);
     memset(decodeBuffer,      0, DECODE_BUFFER_SIZE);
+    memset(rgbToPixel,        0, sizeof(rgbToPixel));
+
+    memset(policyDecodeNsecPerPixel, 0, sizeof(policyDecodeNsecPerPixel));
+    memset(policyBytesPerPixel,      0, sizeof(policyBytesPerPixel));
 }
 
 
@@ -283,6 +489,24 @@ RFBProtocol::RFBProtocol() :
 RFBProtocol::~RFBProtocol()
 {
     this->close();
+    this->releaseReceiveResources();
+
+    if (wakeupPipe[0] >= 0) ::close(wakeupPipe[0]);
+    if (wakeupPipe[1] >= 0) ::close(wakeupPipe[1]);
+
+    pthread_mutex_destroy(&sockWriteMutex);
+
+    // Only the calling thread's batch can be reached here; the reader and
+    // sender threads have freed theirs when they exited.
+    if (outputBatchKeyValid)
+    {
+        FreeOutputBatch(pthread_getspecific(outputBatchKey));
+        pthread_key_delete(outputBatchKey);
+        outputBatchKeyValid = false;
+    }
+
+    if (localSocketPath) { free((void*)localSocketPath); localSocketPath = 0; }
+    if (recordFileName)  { free((void*)recordFileName);  recordFileName  = 0; }
 }
 
 
@@ -306,6 +530,9 @@ bool RFBProtocol::initViaConnect(const char*           theDesktopHost,
     {
         isOpen = true;  // set this regardless so that close() will clean up if we fail, also so that readFromRFBServer() and writeToRFBServer() don't fail...
 
+        this->drainWakeupPipe();  // discard any wakeup left over from a previous close()
+        this->releaseReceiveResources();  // left over from a previous connection
+
         pixelFormat = theRequestedPixelFormat;
 
         if (theRequestedEncodings)
@@ -329,52 +556,70 @@ bool RFBProtocol::initViaConnect(const char*           theDesktopHost,
             }
             else
             {
-                // Get the IP address for desktopHost
-                uint32_t hostAddr = 0;  // local
+                rfbPort    = theRfbPort;
+                portOffset = CONNECT_PORT_OFFSET;
+
+                const char* failure = 0;
+
+                connectDurationUsec = 0;
 
-                if (!*desktopHost)  // 0 or empty ==> local
-                    isSameMachine = true;
+                if (preconnectedSock >= 0)
+                {
+                    struct sockaddr_storage peerAddress;
+                    socklen_t               peerAddressLength = sizeof(peerAddress);
+
+                    sock             = preconnectedSock;
+                    preconnectedSock = -1;
+
+                    memset(&peerAddress, 0, sizeof(peerAddress));
+                    if (getpeername(sock, (struct sockaddr*)&peerAddress, &peerAddressLength) < 0)
+                        failure = "preconnected socket is not connected";
+                    else if (peerAddress.ss_family == AF_UNIX)
+                        sockIsLocal = true;
+                    else
+                        memcpy(&desktopIPAddress, &peerAddress, sizeof(desktopIPAddress));
+                }
                 else
                 {
+                    const long long connectStart = MonotonicTimeUsec();
 
-                    hostAddr = inet_addr(desktopHost);
-                    if (hostAddr == (uint32_t)-1)
+                    // Prefer the Unix-domain socket of a local server, if configured:
+                    if (localSocketPath)
                     {
-                        const struct hostent* const hp = gethostbyname(desktopHost);
-
-                        if (hp && (hp->h_addrtype == AF_INET))
-                            hostAddr = *(uint32_t*)hp->h_addr;
+                        const char* localFailure = 0;  // falls back to TCP, so this is not reported
+                        if ((sock = ConnectToLocalServer(localSocketPath, localFailure)) >= 0)
+                            sockIsLocal = true;
                     }
+
+                    // close() wakes us up through the wakeupPipe if the connect is slow
+                    if (!sockIsLocal)
+                        sock = ConnectToServer(desktopHost, rfbPort, connectTimeoutMsec, desktopIPAddress, failure, wakeupPipe[0], &socketOptions);
+
+                    if (sock >= 0)
+                        connectDurationUsec = MonotonicTimeUsec() - connectStart;
+                }
+
+                if (sockIsLocal)
+                {
+                    // Report the equivalent loopback address:
+                    memset(&desktopIPAddress, 0, sizeof(desktopIPAddress));
+                    desktopIPAddress.sin_family      = AF_INET;
+                    desktopIPAddress.sin_port        = htons(this->getTcpPort());
+                    desktopIPAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
                 }
 
-                if (hostAddr == (uint32_t)-1)
+                if (failure)
                 {
-                    if (isOpen) this->errorMessage("RFBProtocol::initViaConnect", "hostname resolution failed");
+                    if (isOpen) this->errorMessage("RFBProtocol::initViaConnect", failure);
                     result = false;
                 }
                 else
                 {
-                    if (!isSameMachine)
-                        isSameMachine = TestIsLocalMachine(hostAddr);
-
-                    rfbPort    = theRfbPort;
-                    portOffset = CONNECT_PORT_OFFSET;
-
-                    memset(&desktopIPAddress, 0, sizeof(desktopIPAddress));
-                    desktopIPAddress.sin_family      = AF_INET;
-                    desktopIPAddress.sin_port        = htons(this->getTcpPort());
-                    desktopIPAddress.sin_addr.s_addr = hostAddr;
+                    isSameMachine = (sockIsLocal || !*desktopHost || TestIsLocalMachine(desktopIPAddress.sin_addr.s_addr));
 
-                    sock = socket(AF_INET, SOCK_STREAM, 0);
-                    if (sock < 0)
-                    {
-                        if (isOpen) this->errorMessage("RFBProtocol::initViaConnect", "socket allocation failed");
-                        sock = -1;  // keep "closed" value standard
-                        result = false;
-                    }
-                    else if (connect(sock, (struct sockaddr*)&desktopIPAddress, sizeof(desktopIPAddress)) < 0)
+                    if (!this->configureSocket())
                     {
-                        if (isOpen) this->errorMessage("RFBProtocol::initViaConnect", "socket connect failed");
+                        if (isOpen) this->errorMessage("RFBProtocol::initViaConnect", "socket configuration failed");
                         result = false;
                     }
                     else
@@ -416,6 +661,9 @@ bool RFBProtocol::initViaListen(unsigned              theRfbPort,
     {
         isOpen = true;  // set this regardless so that close() will clean up if we fail, also so that readFromRFBServer() and writeToRFBServer() don't fail...
 
+        this->drainWakeupPipe();  // discard any wakeup left over from a previous close()
+        this->releaseReceiveResources();  // left over from a previous connection
+
         pixelFormat = theRequestedPixelFormat;
 
         if (theRequestedEncodings)
@@ -441,6 +689,8 @@ bool RFBProtocol::initViaListen(unsigned              theRfbPort,
             }
             else
             {
+                (void)ApplySocketBufferSizes(acceptSock, socketOptions);  // inherited by the accepted socket
+
                 struct sockaddr_in acceptIPAddress;
                 memset(&acceptIPAddress, 0, sizeof(acceptIPAddress));
                 acceptIPAddress.sin_family      = AF_INET;
@@ -477,7 +727,13 @@ bool RFBProtocol::initViaListen(unsigned              theRfbPort,
 
                             sockConnected = true;
 
-                            result = this->finishInit(theSharedDesktopFlag);
+                            if (!this->configureSocket())
+                            {
+                                if (isOpen) this->errorMessage("RFBProtocol::initViaListen", "socket configuration failed");
+                                result = false;
+                            }
+                            else
+                                result = this->finishInit(theSharedDesktopFlag);
                         }
                     }
                 }
@@ -497,6 +753,77 @@ bool RFBProtocol::initViaListen(unsigned              theRfbPort,
 
 
 
+bool RFBProtocol::initViaReplay(const char*           theReplayFileName,
+                                const rfbPixelFormat& theRequestedPixelFormat,
+                                const char*           theRequestedEncodings,
+                                bool                  theRealTimeFlag)
+{
+    bool result = true;  // for now...
+
+    this->infoServerInitStarted();
+
+    if (isOpen)
+    {
+        this->errorMessage("RFBProtocol::initViaReplay", "attempt to initialize when already open");
+        result = false;
+    }
+    else
+    {
+        isOpen = true;  // set this regardless so that close() will clean up if we fail, also so that readFromRFBServer() and writeToRFBServer() don't fail...
+
+        this->drainWakeupPipe();  // discard any wakeup left over from a previous close()
+        this->releaseReceiveResources();  // left over from a previous connection
+
+        pixelFormat = theRequestedPixelFormat;
+
+        if (theRequestedEncodings)
+            requestedEncodings = strdup(theRequestedEncodings);
+
+        if (theRequestedEncodings && !requestedEncodings)
+        {
+            if (isOpen) this->errorMessage("RFBProtocol::initViaReplay", "memory allocation failed");
+            result = false;
+        }
+        else if (!theReplayFileName || !(replayFile = fopen(theReplayFileName, "rb")))
+        {
+            if (isOpen) this->errorMessage("RFBProtocol::initViaReplay", "could not open replay file");
+            result = false;
+        }
+        else
+        {
+            const size_t headerLength = strlen(RECORD_FILE_HEADER);
+            char         header[sizeof(RECORD_FILE_HEADER)];
+
+            if ( (fread(header, 1, headerLength, replayFile) != headerLength) ||
+                 (memcmp(header, RECORD_FILE_HEADER, headerLength) != 0)        )
+            {
+                if (isOpen) this->errorMessage("RFBProtocol::initViaReplay", "replay file is not in FBS 001.000 format");
+                result = false;
+            }
+            else
+            {
+                memset(&desktopIPAddress, 0, sizeof(desktopIPAddress));
+                isSameMachine = true;
+
+                replayRealTime  = theRealTimeFlag;
+                replayEnded     = false;
+                replayStartTime = MonotonicTimeUsec();
+
+                result = this->finishInit(false);
+            }
+        }
+    }
+
+    this->infoServerInitCompleted(result);
+
+    if (!result)
+        this->close();  // Note: after closing, this object may have been deleted (in response to the infoCloseCompleted() notification)
+
+    return result;
+}
+
+
+
 void RFBProtocol::close()
 {
     if (isOpen)
@@ -505,6 +832,13 @@ void RFBProtocol::close()
 
         this->infoCloseStarted();
 
+        // Wake up the reader if it is blocked in checkAvailableFromRFBServer():
+        if (wakeupPipe[1] >= 0)
+        {
+            const char wakeup = 0;
+            (void)::write(wakeupPipe[1], &wakeup, 1);
+        }
+
         if (sock >= 0)
         {
             if (sockConnected)
@@ -516,6 +850,7 @@ void RFBProtocol::close()
             ::close(sock);
             sock = -1;
         }
+        sockIsLocal = false;
 
         isSameMachine = false;
         if (desktopHost) { free((void*)desktopHost); desktopHost = 0; }
@@ -523,7 +858,6 @@ void RFBProtocol::close()
         rfbPort    = 0;
         portOffset = 0;
         memset(&pixelFormat, 0, sizeof(pixelFormat));
-        if (requestedEncodings) { free((void*)requestedEncodings); requestedEncodings = 0; }
         if (desktopName) { free((void*)desktopName); desktopName = 0; }
         memset(&si, 0, sizeof(si));
         currentEncoding = 0;
@@ -536,83 +870,510 @@ void RFBProtocol::close()
         updateNeededY2 = 0;
         updateNeeded = false;
         updateDefinitelyExpected = false;
-        zlibDecompressor.close();
-        commBufferPos  = 0;
-        commBufferFill = 0;
-        memset(commBuffer,   0, COMM_BUFFER_SIZE);
-        memset(decodeBuffer, 0, DECODE_BUFFER_SIZE);
+        receiveStopTime = MonotonicTimeUsec();
+
+        // The buffers, decompressors, record/replay files and
+        // requestedEncodings are left to releaseReceiveResources(): close()
+        // may be called on another thread while the reader is still
+        // decoding from them or sending SetEncodings for the adaptive
+        // encoding policy.
 
         this->infoCloseCompleted();
     }
+
+    if (preconnectedSock >= 0)
+    {
+        ::close(preconnectedSock);
+        preconnectedSock = -1;
+    }
 }
 
 
 
-bool RFBProtocol::finishInit(bool theSharedDesktopFlag)
+RFBProtocol::ReceiveStats RFBProtocol::getReceiveStats() const
 {
-    bool result = true;  // for now...
+    ReceiveStats result = receiveStats;
 
-    if (!zlibDecompressor.init())
+    if (receiveStartTime > 0)
+        result.elapsedUsec = (isOpen ? MonotonicTimeUsec() : receiveStopTime) - receiveStartTime;
+
+    return result;
+}
+
+
+
+bool RFBProtocol::setAdaptiveEncodings(bool newAdaptiveEncodings)
+{
+    if (isOpen)
     {
-        if (isOpen) this->errorMessage("RFBProtocol::finishInit", "ZRLE decompressor initialization failed");
-        result = false;
+        this->errorMessage("RFBProtocol::setAdaptiveEncodings", "attempt to change adaptive encodings when already open");
+        return false;
     }
     else
     {
-        rfbProtocolVersionMsg pv;
+        adaptiveEncodings = newAdaptiveEncodings;
+        return true;
+    }
+}
 
-        if (!this->readFromRFBServer(pv, sz_rfbProtocolVersionMsg))
+
+
+RFBProtocol::EncodingPolicyStats RFBProtocol::getEncodingPolicyStats() const
+{
+    EncodingPolicyStats result;
+
+    result.policy             = encodingPolicy;
+    result.linkThroughput     = linkThroughput;
+    result.decodeNsecPerPixel = policyDecodeNsecPerPixel[encodingPolicy];
+    result.bytesPerPixel      = policyBytesPerPixel[encodingPolicy];
+    result.changes            = policyChanges;
+
+    return result;
+}
+
+
+
+bool RFBProtocol::setCommBufferSize(size_t newCommBufferSize)
+{
+    if (isOpen)
+    {
+        this->errorMessage("RFBProtocol::setCommBufferSize", "attempt to change receive buffer size when already open");
+        return false;
+    }
+    else
+    {
+        if (newCommBufferSize == 0)
+            newCommBufferSize = DEFAULT_COMM_BUFFER_SIZE;
+        else if (newCommBufferSize < MIN_COMM_BUFFER_SIZE)
+            newCommBufferSize = MIN_COMM_BUFFER_SIZE;
+
+        if (commBuffer && (newCommBufferSize != commBufferSize))
         {
-            if (isOpen) this->errorMessage("RFBProtocol:finishInit", "socket read error");
-            result = false;
+            free(commBuffer);  // left over from a previous connection
+            commBuffer      = 0;
+            commBufferPos   = 0;
+            commBufferAvail = 0;
         }
-        else
-        {
-            pv[sz_rfbProtocolVersionMsg] = 0;
 
-            int major, minor;
-            if (sscanf(pv, rfbProtocolVersionFormat, &major, &minor) != 2)
-            {
-                if (isOpen) this->errorMessage("RFBProtocol:finishInit", "unexpected protocol version format");
-                result = false;
-            }
-            else
-            {
-                this->infoProtocolVersion(major, minor, rfbProtocolMajorVersion, rfbProtocolMinorVersion);
+        commBufferSize = newCommBufferSize;
 
-                sprintf(pv, rfbProtocolVersionFormat, rfbProtocolMajorVersion, rfbProtocolMinorVersion);
+        return true;
+    }
+}
 
-                if (!this->writeToRFBServer(pv, sz_rfbProtocolVersionMsg))
-                {
-                    if (isOpen) this->errorMessage("RFBProtocol:finishInit", "socket write error");
-                    result = false;
-                }
-                else
-                {
-                    rfbCARD32 authScheme;
-                    if (!this->readFromRFBServer(&authScheme, sizeof(authScheme)))
-                    {
-                        if (isOpen) this->errorMessage("RFBProtocol:finishInit", "socket read error");
-                        result = false;
-                    }
-                    else
-                    {
-                        authScheme = Swap32IfLE(authScheme);
 
-                        rfbCARD32 authResult = (rfbCARD32)-1;
 
-                        switch (authScheme)
-                        {
-                            case rfbConnFailed:
-                            {
-                                rfbCARD32 reasonLen;
-                                if (!this->readFromRFBServer(&reasonLen, sizeof(reasonLen)))
-                                {
-                                    if (isOpen) this->errorMessage("RFBProtocol:finishInit", "socket read error");
-                                    result = false;
-                                }
-                                else
-                                {
+bool RFBProtocol::setPreconnectedSocket(int theSock)
+{
+    if (isOpen)
+    {
+        this->errorMessage("RFBProtocol::setPreconnectedSocket", "attempt to set preconnected socket when already open");
+        if (theSock >= 0)
+            ::close(theSock);
+        return false;
+    }
+    else
+    {
+        if (preconnectedSock >= 0)
+            ::close(preconnectedSock);
+
+        preconnectedSock = (theSock < 0) ? -1 : theSock;
+
+        return true;
+    }
+}
+
+
+
+bool RFBProtocol::setRecordFileName(const char* newRecordFileName)
+{
+    if (isOpen)
+    {
+        this->errorMessage("RFBProtocol::setRecordFileName", "attempt to change record file name when already open");
+        return false;
+    }
+    else
+    {
+        char* const newName = (newRecordFileName && *newRecordFileName) ? strdup(newRecordFileName) : 0;
+        if (newRecordFileName && *newRecordFileName && !newName)
+        {
+            this->errorMessage("RFBProtocol::setRecordFileName", "memory allocation failed");
+            return false;
+        }
+
+        if (recordFileName)
+            free((void*)recordFileName);
+        recordFileName = newName;
+
+        return true;
+    }
+}
+
+
+
+bool RFBProtocol::setLocalSocketPath(const char* newLocalSocketPath)
+{
+    if (isOpen)
+    {
+        this->errorMessage("RFBProtocol::setLocalSocketPath", "attempt to change local socket path when already open");
+        return false;
+    }
+    else
+    {
+        char* const newPath = (newLocalSocketPath && *newLocalSocketPath) ? strdup(newLocalSocketPath) : 0;
+        if (newLocalSocketPath && *newLocalSocketPath && !newPath)
+        {
+            this->errorMessage("RFBProtocol::setLocalSocketPath", "memory allocation failed");
+            return false;
+        }
+
+        if (localSocketPath)
+            free((void*)localSocketPath);
+        localSocketPath = newPath;
+
+        return true;
+    }
+}
+
+
+
+int RFBProtocol::ConnectToLocalServer(const char* path, const char*& failure)  // static method
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+
+    if (!path || !*path || (strlen(path) >= sizeof(address.sun_path)))
+    {
+        failure = "bad local socket path";
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    int theSock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (theSock < 0)
+    {
+        failure = "socket allocation failed";
+        return -1;
+    }
+
+    PendingSockets pending = { &theSock, 1 };
+    pthread_cleanup_push(ClosePendingSockets, &pending);
+    if (connect(theSock, (struct sockaddr*)&address, sizeof(address)) < 0)
+    {
+        const int s = theSock;
+        theSock = -1;
+        ::close(s);
+    }
+    pthread_cleanup_pop(0);
+
+    failure = (theSock < 0) ? "socket connect failed" : 0;
+    return theSock;
+}
+
+
+
+bool RFBProtocol::setSocketOptions(const SocketOptions& newSocketOptions)
+{
+    if (isOpen)
+    {
+        this->errorMessage("RFBProtocol::setSocketOptions", "attempt to change socket options when already open");
+        return false;
+    }
+    else
+    {
+        socketOptions = newSocketOptions;
+
+        return true;
+    }
+}
+
+
+
+bool RFBProtocol::ApplySocketBufferSizes(int theSock, const SocketOptions& options)  // static method
+{
+    bool result = true;
+
+    if ((options.receiveBufferSize > 0) && (setsockopt(theSock, SOL_SOCKET, SO_RCVBUF, &options.receiveBufferSize, sizeof(options.receiveBufferSize)) < 0))
+        result = false;
+
+    if ((options.sendBufferSize > 0) && (setsockopt(theSock, SOL_SOCKET, SO_SNDBUF, &options.sendBufferSize, sizeof(options.sendBufferSize)) < 0))
+        result = false;
+
+    return result;
+}
+
+
+
+bool RFBProtocol::setConnectTimeout(unsigned newConnectTimeoutMsec)
+{
+    if (isOpen)
+    {
+        this->errorMessage("RFBProtocol::setConnectTimeout", "attempt to change connect timeout when already open");
+        return false;
+    }
+    else
+    {
+        connectTimeoutMsec = (newConnectTimeoutMsec == 0) ? (unsigned)DEFAULT_CONNECT_TIMEOUT_MSEC : newConnectTimeoutMsec;
+
+        return true;
+    }
+}
+
+
+
+int RFBProtocol::ConnectToServer( const char*          theDesktopHost,
+                                  unsigned             theRfbPort,
+                                  unsigned             timeoutMsec,
+                                  struct sockaddr_in&  address,
+                                  const char*&         failure,
+                                  int                  abortFd,
+                                  const SocketOptions* options )  // static method
+{
+    if (timeoutMsec == 0)
+        timeoutMsec = DEFAULT_CONNECT_TIMEOUT_MSEC;
+
+    const long long deadline = MonotonicTimeUsec() + (long long)timeoutMsec*1000;
+
+    // Resolve theDesktopHost; 0 or empty ==> local (loopback)
+    char portString[16];
+    snprintf(portString, sizeof(portString), "%u", theRfbPort + CONNECT_PORT_OFFSET);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_INET;  // desktopIPAddress is a sockaddr_in
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+
+    struct addrinfo* addrList = 0;
+    if ((getaddrinfo(((theDesktopHost && *theDesktopHost) ? theDesktopHost : 0), portString, &hints, &addrList) != 0) || !addrList)
+    {
+        failure = "hostname resolution failed";
+        return -1;
+    }
+
+    int result = -1;
+
+    pthread_cleanup_push(FreeAddrInfo, addrList);
+
+    // Start a non-blocking connect to each address:
+    struct pollfd          pfds[MAX_PARALLEL_CONNECTS + 1];  // the extra entry is for abortFd
+    const struct addrinfo* pfdAddrs[MAX_PARALLEL_CONNECTS];
+    int                    socks[MAX_PARALLEL_CONNECTS];     // the open sockets, including the winner, for ClosePendingSockets()
+    size_t                 count   = 0;
+    size_t                 pending = 0;
+
+    for (size_t i = 0; i < MAX_PARALLEL_CONNECTS; i++)
+        socks[i] = -1;
+
+    PendingSockets pendingSocks = { socks, MAX_PARALLEL_CONNECTS };
+    pthread_cleanup_push(ClosePendingSockets, &pendingSocks);
+
+    failure = "socket allocation failed";  // for now...
+
+    for (const struct addrinfo* ai = addrList; ai && (count < MAX_PARALLEL_CONNECTS); ai = ai->ai_next)
+    {
+        if ((ai->ai_family != AF_INET) || (ai->ai_addrlen > sizeof(address)))
+            continue;
+
+        const int s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (s < 0)
+            continue;
+
+        socks[count] = s;
+        failure = "socket connect failed";  // for now...
+
+        if (options)
+            (void)ApplySocketBufferSizes(s, *options);
+
+        fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+        if ((connect(s, ai->ai_addr, ai->ai_addrlen) < 0) && (errno != EINPROGRESS))
+        {
+            socks[count] = -1;
+            ::close(s);
+            continue;
+        }
+
+        pfds[count].fd      = s;
+        pfds[count].events  = POLLOUT;
+        pfds[count].revents = 0;
+        pfdAddrs[count]     = ai;
+        count++;
+        pending++;
+    }
+
+    // Wait for the first one to succeed:
+    while ((result < 0) && (pending > 0))
+    {
+        const long long remaining = deadline - MonotonicTimeUsec();
+        if (remaining <= 0)
+        {
+            failure = "socket connect timed out";
+            break;
+        }
+
+        nfds_t nfds = count;
+        if (abortFd >= 0)
+        {
+            pfds[nfds].fd      = abortFd;
+            pfds[nfds].events  = POLLIN;
+            pfds[nfds].revents = 0;
+            nfds++;
+        }
+
+        const int pollResult = poll(pfds, nfds, (int)((remaining + 999) / 1000));
+        if (pollResult < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            failure = "socket connect failed";
+            break;
+        }
+
+        if ((abortFd >= 0) && pfds[count].revents)
+        {
+            failure = "socket connect aborted";
+            break;
+        }
+
+        for (size_t i = 0; i < count; i++)
+            if ((pfds[i].fd >= 0) && pfds[i].revents)
+            {
+                int       err    = 0;
+                socklen_t errLen = sizeof(err);
+
+                if ((getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &err, &errLen) == 0) && (err == 0) && (result < 0))
+                {
+                    result = pfds[i].fd;
+                    memset(&address, 0, sizeof(address));
+                    memcpy(&address, pfdAddrs[i]->ai_addr, pfdAddrs[i]->ai_addrlen);
+                }
+                else
+                {
+                    socks[i] = -1;
+                    ::close(pfds[i].fd);
+                }
+
+                pfds[i].fd = -1;  // poll() ignores negative fds
+                pending--;
+            }
+    }
+
+    // Abandon the attempts that lost (or did not finish):
+    for (size_t i = 0; i < count; i++)
+        if (pfds[i].fd >= 0)
+        {
+            socks[i] = -1;
+            ::close(pfds[i].fd);
+        }
+
+    pthread_cleanup_pop(0);  // result, if any, now belongs to the caller
+    pthread_cleanup_pop(1);  // frees addrList
+
+    if (result >= 0)
+    {
+        fcntl(result, F_SETFL, fcntl(result, F_GETFL) & ~O_NONBLOCK);
+        failure = 0;
+    }
+
+    return result;
+}
+
+
+
+bool RFBProtocol::finishInit(bool theSharedDesktopFlag)
+{
+    bool result = true;  // for now...
+
+    if (!zlibDecompressor.init())
+    {
+        if (isOpen) this->errorMessage("RFBProtocol::finishInit", "ZRLE decompressor initialization failed");
+        result = false;
+    }
+    else if (!this->resetTightZlibStreams((1 << NUM_TIGHT_ZLIB_STREAMS) - 1))
+    {
+        if (isOpen) this->errorMessage("RFBProtocol::finishInit", "Tight decompressor initialization failed");
+        result = false;
+    }
+    else if (!commBuffer && !(commBuffer = (char*)malloc(commBufferSize)))
+    {
+        if (isOpen) this->errorMessage("RFBProtocol::finishInit", "memory allocation failed for receive buffer");
+        result = false;
+    }
+    else
+    {
+        receiveStats     = ReceiveStats();
+        receiveStartTime = MonotonicTimeUsec();
+
+        encodingPolicy   = (isSameMachine || sockIsLocal) ? POLICY_LAN : POLICY_BALANCED;
+        policyChanges    = 0;
+        linkThroughput   = 0;
+        memset(policyDecodeNsecPerPixel, 0, sizeof(policyDecodeNsecPerPixel));
+        memset(policyBytesPerPixel,      0, sizeof(policyBytesPerPixel));
+        adaptWindowStart = 0;
+        adaptDirection   = 0;
+        adaptStableCount = 0;
+
+        this->initRGBToPixel();
+
+        // A recording that cannot be opened is reported but does not stop the connection:
+        if (recordFileName && !this->openRecordFile())
+            if (isOpen) this->errorMessage("RFBProtocol::finishInit", "could not open record file");
+
+        rfbProtocolVersionMsg pv;
+
+        if (!this->readFromRFBServer(pv, sz_rfbProtocolVersionMsg))
+        {
+            if (isOpen) this->errorMessage("RFBProtocol:finishInit", "socket read error");
+            result = false;
+        }
+        else
+        {
+            pv[sz_rfbProtocolVersionMsg] = 0;
+
+            int major, minor;
+            if (sscanf(pv, rfbProtocolVersionFormat, &major, &minor) != 2)
+            {
+                if (isOpen) this->errorMessage("RFBProtocol:finishInit", "unexpected protocol version format");
+                result = false;
+            }
+            else
+            {
+                this->infoProtocolVersion(major, minor, rfbProtocolMajorVersion, rfbProtocolMinorVersion);
+
+                sprintf(pv, rfbProtocolVersionFormat, rfbProtocolMajorVersion, rfbProtocolMinorVersion);
+
+                if (!this->writeToRFBServer(pv, sz_rfbProtocolVersionMsg))
+                {
+                    if (isOpen) this->errorMessage("RFBProtocol:finishInit", "socket write error");
+                    result = false;
+                }
+                else
+                {
+                    rfbCARD32 authScheme;
+                    if (!this->readFromRFBServer(&authScheme, sizeof(authScheme)))
+                    {
+                        if (isOpen) this->errorMessage("RFBProtocol:finishInit", "socket read error");
+                        result = false;
+                    }
+                    else
+                    {
+                        authScheme = Swap32IfLE(authScheme);
+
+                        rfbCARD32 authResult = (rfbCARD32)-1;
+
+                        switch (authScheme)
+                        {
+                            case rfbConnFailed:
+                            {
+                                rfbCARD32 reasonLen;
+                                if (!this->readFromRFBServer(&reasonLen, sizeof(reasonLen)))
+                                {
+                                    if (isOpen) this->errorMessage("RFBProtocol:finishInit", "socket read error");
+                                    result = false;
+                                }
+                                else
+                                {
                                     reasonLen = Swap32IfLE(reasonLen);
 
                                     char* const reason = (char*)malloc(reasonLen + 1);
@@ -656,7 +1417,8 @@ bool RFBProtocol::finishInit(bool theSharedDesktopFlag)
                                 }
                                 else
                                 {
-                                    char* const passwd = this->returnPassword();
+                                    // The response is discarded when replaying, so don't ask for a password:
+                                    char* const passwd = replayFile ? strdup("replay") : this->returnPassword();
 
                                     if (!passwd || !isOpen)
                                     {
@@ -679,7 +1441,8 @@ bool RFBProtocol::finishInit(bool theSharedDesktopFlag)
 
                                             const size_t RESPONSESIZE = CHALLENGESIZE;
                                             rfbCARD8 response[RESPONSESIZE];
-                                            const bool encryptChallengeFailed = !this->encryptChallenge(challenge, CHALLENGESIZE, (const unsigned char*)passwd, response, RESPONSESIZE);
+                                            memset(response, 0, RESPONSESIZE);
+                                            const bool encryptChallengeFailed = !replayFile && !this->encryptChallenge(challenge, CHALLENGESIZE, (const unsigned char*)passwd, response, RESPONSESIZE);
 
                                             // Erase the password from memory:
                                             memset(passwd, 0, passwdLen);
@@ -835,23 +1598,61 @@ static const struct { const char* name; rfbCARD32 value; } SupportedEncodings[]
     { "corre",       rfbEncodingCoRRE       },
     { "rre",         rfbEncodingRRE         },
     { "raw",         rfbEncodingRaw         },
+    { "tight",       rfbEncodingTight       },  // last, so that only the adaptive policy or requestedEncodings prefers it
     { "desktopsize", rfbEncodingDesktopSize }
 };
 
 #define NUM_SUPPORTED_ENCODINGS  (sizeof(SupportedEncodings)/sizeof(*SupportedEncodings))
 
+// Specifiers for the Tight CompressLevel and QualityLevel pseudo encodings
+// are these prefixes followed by a single digit, e.g., "quality8".
+static const struct { const char* prefix; rfbCARD32 level0; } SupportedLevelEncodings[] =
+{
+    { "compress", (rfbCARD32)rfbEncodingCompressLevel0 },
+    { "quality",  (rfbCARD32)rfbEncodingQualityLevel0  }
+};
 
+#define NUM_SUPPORTED_LEVEL_ENCODINGS  (sizeof(SupportedLevelEncodings)/sizeof(*SupportedLevelEncodings))
 
-size_t RFBProtocol::scanEncodingsString(rfbCARD32* pDest = 0) const
+// The encoding policies of adaptive encodings (see setAdaptiveEncodings()),
+// from the cheapest to decode to the most compact.  relativeBytesPerPixel
+// and relativeDecodeCost are rough expectations, relative to each other,
+// used to predict the performance of a policy until it has been measured.
+static const struct
 {
-    size_t n = 0;
+    const char* name;
+    rfbCARD32   order[6];               // preferred encodings, most preferred first, after rfbEncodingCopyRect
+    int         compressLevel;          // Tight CompressLevel sent if Tight is used
+    int         maxQualityLevel;        // cap on the Tight QualityLevel, if one was requested
+    double      relativeBytesPerPixel;
+    double      relativeDecodeCost;
+} EncodingPolicies[RFBProtocol::NUM_ENCODING_POLICIES] =
+{
+    { "lan",       { rfbEncodingRaw,     rfbEncodingHextile, rfbEncodingZRLE,    rfbEncodingTight,   rfbEncodingCoRRE, rfbEncodingRRE }, 1, 9, 0.60,  3.0 },
+    { "balanced",  { rfbEncodingHextile, rfbEncodingZRLE,    rfbEncodingTight,   rfbEncodingRaw,     rfbEncodingCoRRE, rfbEncodingRRE }, 3, 9, 0.25,  6.0 },
+    { "wan",       { rfbEncodingZRLE,    rfbEncodingTight,   rfbEncodingHextile, rfbEncodingCoRRE,   rfbEncodingRRE,   rfbEncodingRaw }, 6, 8, 0.10, 10.0 },
+    { "congested", { rfbEncodingTight,   rfbEncodingZRLE,    rfbEncodingHextile, rfbEncodingCoRRE,   rfbEncodingRRE,   rfbEncodingRaw }, 9, 5, 0.07, 14.0 }
+};
 
-    const char* encStr = requestedEncodings;
-    if (encStr)
-    {
-        do
-        {
-            const char* nextEncStr = strchr(encStr, ' ');
+
+
+const char* RFBProtocol::GetEncodingPolicyName(EncodingPolicy policy)  // static method
+{
+    return ((policy >= 0) && (policy < NUM_ENCODING_POLICIES)) ? EncodingPolicies[policy].name : "unknown";
+}
+
+
+
+size_t RFBProtocol::scanEncodingsString(rfbCARD32* pDest = 0) const
+{
+    size_t n = 0;
+
+    const char* encStr = requestedEncodings;
+    if (encStr)
+    {
+        do
+        {
+            const char* nextEncStr = strchr(encStr, ' ');
 
             const int encStrLen = nextEncStr ? (int)(nextEncStr++ - encStr) : strlen(encStr);
             if (encStrLen > 0)
@@ -870,6 +1671,21 @@ size_t RFBProtocol::scanEncodingsString(rfbCARD32* pDest = 0) const
                     }
                 }
 
+                for (size_t i = 0; !found && (i < NUM_SUPPORTED_LEVEL_ENCODINGS); i++)
+                {
+                    const int prefixLen = strlen(SupportedLevelEncodings[i].prefix);
+
+                    if ( (encStrLen == prefixLen+1)                                           &&
+                         (strncasecmp(encStr, SupportedLevelEncodings[i].prefix, prefixLen) == 0) &&
+                         (encStr[prefixLen] >= '0') && (encStr[prefixLen] <= '9')                )
+                    {
+                        found = true;
+
+                        if (pDest)
+                            *pDest++ = Swap32IfLE(SupportedLevelEncodings[i].level0 + (encStr[prefixLen] - '0'));
+                    }
+                }
+
                 if (found)
                     n++;
                 else if (!pDest)  // only emit error messages on first call to this method (the counting pass with pDest == 0)
@@ -897,7 +1713,7 @@ bool RFBProtocol::sendSetEncodings()
             ? scanEncodingsString()           // count encodings in requestedEncodings if specified
             : (NUM_SUPPORTED_ENCODINGS + 1);  // one extra just in case currentEncoding is not in the list
 
-    const size_t bufSize = sz_rfbSetEncodingsMsg + n*sizeof(rfbCARD32);
+    const size_t bufSize = sz_rfbSetEncodingsMsg + (n + 1)*sizeof(rfbCARD32);  // one extra for the CompressLevel added by applyEncodingPolicy()
     char* const  buf     = (char*)malloc(bufSize);
     if (!buf)
     {
@@ -932,6 +1748,9 @@ bool RFBProtocol::sendSetEncodings()
                     encs[se->nEncodings++] = Swap32IfLE(currentEncoding);  // insert currentEncoding as second entry, after rfbEncodingCopyRect (which is always SupportedEncodings[0])
             }
         }
+
+        if (adaptiveEncodings)
+            se->nEncodings = this->applyEncodingPolicy(encs, se->nEncodings);
 //{ fprintf(stderr, "%ld encodings:\n", (long)se->nEncodings); for (int i = 0; i < se->nEncodings; i++) fprintf(stderr, "    - 0x%08lx\n", (long)Swap32IfLE(encs[i])); }//!!!
 
         const size_t len = sz_rfbSetEncodingsMsg + se->nEncodings*sizeof(rfbCARD32);
@@ -952,6 +1771,189 @@ bool RFBProtocol::sendSetEncodings()
 
 
 
+size_t RFBProtocol::applyEncodingPolicy(rfbCARD32* encs, size_t n) const
+{
+    rfbCARD32* const given = (rfbCARD32*)malloc(n*sizeof(rfbCARD32));
+    if (!given)
+        return n;  // leave encs as it is...
+
+    for (size_t i = 0; i < n; i++)
+        given[i] = Swap32IfLE(encs[i]);
+
+    // Collect the encodings in order: rfbEncodingCopyRect, the policy's
+    // preferred encodings, then everything else that was given except
+    // CompressLevels and QualityLevels, which are replaced at the end.
+    const EncodingPolicy policy   = encodingPolicy;
+    const int            numOrder = sizeof(EncodingPolicies[policy].order)/sizeof(*EncodingPolicies[policy].order);
+
+    size_t m = 0;
+    bool   useTight = false;
+
+    for (int c = -1; c < numOrder; c++)
+    {
+        const rfbCARD32 preferred = (c < 0) ? rfbEncodingCopyRect : EncodingPolicies[policy].order[c];
+
+        for (size_t i = 0; i < n; i++)
+            if (given[i] == preferred)
+            {
+                encs[m++] = Swap32IfLE(preferred);
+                useTight  = useTight || (preferred == rfbEncodingTight);
+                break;
+            }
+    }
+
+    int qualityLevel = -1;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        const rfbCARD32 e = given[i];
+
+        if ((e >= (rfbCARD32)rfbEncodingCompressLevel0) && (e <= (rfbCARD32)rfbEncodingCompressLevel9))
+            continue;
+        else if ((e >= (rfbCARD32)rfbEncodingQualityLevel0) && (e <= (rfbCARD32)rfbEncodingQualityLevel9))
+        {
+            if (qualityLevel < 0)
+                qualityLevel = (int)(e - (rfbCARD32)rfbEncodingQualityLevel0);
+        }
+        else
+        {
+            bool alreadyPresent = false;
+            for (size_t j = 0; !alreadyPresent && (j < m); j++)
+                alreadyPresent = (Swap32IfLE(encs[j]) == e);
+
+            if (!alreadyPresent)
+                encs[m++] = Swap32IfLE(e);
+        }
+    }
+
+    if (useTight)
+        encs[m++] = Swap32IfLE(rfbEncodingCompressLevel0 + EncodingPolicies[policy].compressLevel);
+
+    if (qualityLevel >= 0)
+    {
+        if (qualityLevel > EncodingPolicies[policy].maxQualityLevel)
+            qualityLevel = EncodingPolicies[policy].maxQualityLevel;
+
+        encs[m++] = Swap32IfLE(rfbEncodingQualityLevel0 + qualityLevel);
+    }
+
+    free(given);
+
+    return m;
+}
+
+
+
+// measuredUpdate() is called with the totals of each FramebufferUpdate
+// received with adaptive encodings, and evaluates encodingPolicy once
+// enough of them have been received (see setAdaptiveEncodings()).
+bool RFBProtocol::measuredUpdate(long long wallUsec, long long cpuUsec, long long bytes, long long pixels)
+{
+    if (adaptWindowStart <= 0)
+    {
+        adaptWindowStart = MonotonicTimeUsec() - wallUsec;
+        adaptWallUsec    = 0;
+        adaptCpuUsec     = 0;
+        adaptBytes       = 0;
+        adaptPixels      = 0;
+    }
+
+    adaptWallUsec += wallUsec;
+    adaptCpuUsec  += (cpuUsec < wallUsec) ? cpuUsec : wallUsec;
+    adaptBytes    += bytes;
+    adaptPixels   += pixels;
+
+    if ((MonotonicTimeUsec() - adaptWindowStart < ADAPT_INTERVAL_USEC) || (adaptPixels < ADAPT_MIN_PIXELS))
+        return false;
+
+    adaptWindowStart = 0;
+
+    // The time not spent decoding was spent waiting for the server's data.
+    // If hardly any was, the data was already there and the link is faster
+    // than it appears; its estimate is then limited to ten times the rate
+    // at which the data was consumed.
+    long long waitUsec = adaptWallUsec - adaptCpuUsec;
+    if (waitUsec < adaptWallUsec/10)
+        waitUsec = adaptWallUsec/10;
+    if (waitUsec < 1)
+        waitUsec = 1;
+
+    const double throughput         = (double)adaptBytes * 1e6 / (double)waitUsec;
+    const double decodeNsecPerPixel = (double)adaptCpuUsec * 1e3 / (double)adaptPixels;
+    const double bytesPerPixel      = (double)adaptBytes / (double)adaptPixels;
+
+    const int current = encodingPolicy;
+
+    linkThroughput = (linkThroughput > 0) ? ((linkThroughput + throughput) / 2) : throughput;
+
+    double& currentDecodeCost    = policyDecodeNsecPerPixel[current];
+    double& currentBytesPerPixel = policyBytesPerPixel[current];
+
+    currentDecodeCost    = (currentDecodeCost    > 0) ? ((currentDecodeCost    + decodeNsecPerPixel) / 2) : decodeNsecPerPixel;
+    currentBytesPerPixel = (currentBytesPerPixel > 0) ? ((currentBytesPerPixel + bytesPerPixel)      / 2) : bytesPerPixel;
+    if (currentDecodeCost    <= 0) currentDecodeCost    = 1e-3;  // 0 means "not measured"
+    if (currentBytesPerPixel <= 0) currentBytesPerPixel = 1e-3;
+
+    // Predict the nanoseconds per pixel of each policy from its own
+    // measurements, or, if it has not been used yet, from the current
+    // policy's scaled by the relative expectations in EncodingPolicies.
+    int    best        = current;
+    double bestTime    = 0;
+    double currentTime = 0;
+
+    for (int p = 0; p < NUM_ENCODING_POLICIES; p++)
+    {
+        const double decodeCost =
+            (policyDecodeNsecPerPixel[p] > 0)
+                ? policyDecodeNsecPerPixel[p]
+                : (currentDecodeCost * EncodingPolicies[p].relativeDecodeCost / EncodingPolicies[current].relativeDecodeCost);
+
+        const double bytesCost =
+            (policyBytesPerPixel[p] > 0)
+                ? policyBytesPerPixel[p]
+                : (currentBytesPerPixel * EncodingPolicies[p].relativeBytesPerPixel / EncodingPolicies[current].relativeBytesPerPixel);
+
+        const double time = decodeCost + (bytesCost * 1e9 / linkThroughput);
+
+        if (p == current)
+            currentTime = time;
+
+        if ((p == 0) || (time < bestTime))
+        {
+            best     = p;
+            bestTime = time;
+        }
+    }
+
+    const int direction =
+        (bestTime < currentTime * (100 - ADAPT_MIN_GAIN_PERCENT) / 100)
+            ? ((best < current) ? -1 : +1)
+            : 0;
+
+    if ((direction == 0) || (direction != adaptDirection))
+    {
+        adaptDirection   = direction;
+        adaptStableCount = (direction != 0) ? 1 : 0;
+    }
+    else
+        adaptStableCount++;
+
+    if ((adaptDirection == 0) || (adaptStableCount < ADAPT_STABLE_INTERVALS))
+        return false;
+    else
+    {
+        encodingPolicy = (EncodingPolicy)(current + adaptDirection);
+        policyChanges++;
+
+        adaptDirection   = 0;
+        adaptStableCount = 0;
+
+        return true;
+    }
+}
+
+
+
 bool RFBProtocol::sendFramebufferUpdateRequest(int x, int y, size_t w, size_t h, bool incremental)
 {
     rfbFramebufferUpdateRequestMsg fur;
@@ -1034,14 +2036,28 @@ bool RFBProtocol::sendClientCutText(const char* str, size_t len)
     }
     else
     {
-        rfbClientCutTextMsg cct;
-        memset(&cct, 0, sizeof(cct));
+        // The header and the text are written in one piece so that no
+        // message from another thread can get in between:
+        char* const buf = (char*)malloc(sz_rfbClientCutTextMsg + len);
+        if (!buf)
+        {
+            if (isOpen) this->errorMessageForSend("RFBProtocol::sendClientCutText", "memory allocation failed");
+            return false;
+        }
+
+        rfbClientCutTextMsg* const cct = (rfbClientCutTextMsg*)buf;
+        memset(cct, 0, sz_rfbClientCutTextMsg);
+
+        cct->type   = rfbClientCutText;
+        cct->length = Swap32IfLE(len);
 
-        cct.type   = rfbClientCutText;
-        cct.length = Swap32IfLE(len);
+        memcpy(&buf[sz_rfbClientCutTextMsg], str, len);
 
-        if ( !this->writeToRFBServer(&cct, sz_rfbClientCutTextMsg) ||
-             ((len > 0) && !this->writeToRFBServer(str, len)) )
+        const bool wroteText = this->writeToRFBServer(buf, sz_rfbClientCutTextMsg + len);
+
+        free(buf);
+
+        if (!wroteText)
         {
             if (isOpen) this->errorMessageForSend("RFBProtocol::sendClientCutText", "socket write error");
             return false;
@@ -1063,7 +2079,11 @@ bool RFBProtocol::sendStringViaKeyEvents( const char* str,
         return false;
     else
     {
-        while (len > 0)
+        bool result = true;
+
+        this->beginOutputBatch();  // coalesce the key events into a few large writes
+
+        while (result && (len > 0))
         {
             const char ch = *str;
 
@@ -1072,7 +2092,7 @@ bool RFBProtocol::sendStringViaKeyEvents( const char* str,
                 if ( !sendKeyEvent((rfbCARD32)tabKeySym, true)  ||
                      !sendKeyEvent((rfbCARD32)tabKeySym, false)    )
                 {
-                    return false;
+                    result = false;
                 }
             }
             else if ((enterKeySym != 0) && (ch == '\n'))
@@ -1080,7 +2100,7 @@ bool RFBProtocol::sendStringViaKeyEvents( const char* str,
                 if ( !sendKeyEvent((rfbCARD32)enterKeySym, true)  ||
                      !sendKeyEvent((rfbCARD32)enterKeySym, false)    )
                 {
-                    return false;
+                    result = false;
                 }
             }
             else if ((leftControlKeySym != 0) && (ch < 32))
@@ -1090,7 +2110,7 @@ bool RFBProtocol::sendStringViaKeyEvents( const char* str,
                      !sendKeyEvent((rfbCARD32)(ch+64), false) ||
                      !sendKeyEvent(leftControlKeySym,  false)    )
                 {
-                    return false;
+                    result = false;
                 }
             }
             else
@@ -1098,7 +2118,7 @@ bool RFBProtocol::sendStringViaKeyEvents( const char* str,
                 if ( !sendKeyEvent((rfbCARD32)ch, true)  ||
                      !sendKeyEvent((rfbCARD32)ch, false)    )
                 {
-                    return false;
+                    result = false;
                 }
             }
 
@@ -1106,7 +2126,10 @@ bool RFBProtocol::sendStringViaKeyEvents( const char* str,
             str++;
         }
 
-        return true;
+        if (!this->endOutputBatch())
+            result = false;
+
+        return result;
     }
 }
 
@@ -1119,7 +2142,7 @@ bool RFBProtocol::handleRFBServerMessage()
 
     if (!this->readFromRFBServer(&msg, 1))
     {
-        if (isOpen) this->errorMessage("RFBProtocol::handleRFBServerMessage", "socket read error for message type");
+        if (isOpen && !replayEnded) this->errorMessage("RFBProtocol::handleRFBServerMessage", "socket read error for message type");
         return false;
     }
     else
@@ -1128,6 +2151,8 @@ bool RFBProtocol::handleRFBServerMessage()
             return false;  // in case this object was closed while we were waiting for input
         else
         {
+            this->rearmQuickAck();  // once per message rather than once per read
+
             switch (msg.type)
             {
                 case rfbFramebufferUpdate:
@@ -1141,7 +2166,31 @@ bool RFBProtocol::handleRFBServerMessage()
                     {
                         msg.fu.nRects = Swap16IfLE(msg.fu.nRects);
 
-                        return this->receivedFramebufferUpdate(msg.fu);
+                        receiveStats.updates++;
+
+                        if (!adaptiveEncodings || replayFile)
+                            return this->receivedFramebufferUpdate(msg.fu);
+                        else
+                        {
+                            // Bytes still in commBuffer belong to later messages:
+                            const long long startTime   = MonotonicTimeUsec();
+                            const long long startCpu    = ThreadCpuTimeUsec();
+                            const long long startBytes  = receiveStats.bytes - commBufferAvail;
+                            const long long startPixels = receiveStats.pixels;
+
+                            if (!this->receivedFramebufferUpdate(msg.fu))
+                                return false;
+                            else if ( this->measuredUpdate( MonotonicTimeUsec() - startTime,
+                                                            ThreadCpuTimeUsec() - startCpu,
+                                                            (receiveStats.bytes - commBufferAvail) - startBytes,
+                                                            receiveStats.pixels - startPixels ) )
+                            {
+                                this->infoEncodingPolicyChanged(this->getEncodingPolicyStats());
+                                return this->sendSetEncodings();
+                            }
+                            else
+                                return true;
+                        }
                     }
                 }
                 break;
@@ -1247,6 +2296,10 @@ bool RFBProtocol::receivedFramebufferUpdate(const rfbFramebufferUpdateMsg& msg)
 
             rect.encoding = Swap32IfLE(rect.encoding);
 
+            receiveStats.rectangles++;
+            if ((rect.encoding != rfbEncodingCopyRect) && (rect.encoding != (rfbCARD32)rfbEncodingDesktopSize))
+                receiveStats.pixels += (long long)rect.r.w * rect.r.h;
+
             if ( ( (rect.r.x + rect.r.w > framebufferWidth) ||
                    (rect.r.y + rect.r.h > framebufferHeight)   ) &&
                  (rect.encoding != rfbEncodingDesktopSize) )
@@ -1270,6 +2323,24 @@ bool RFBProtocol::receivedFramebufferUpdate(const rfbFramebufferUpdateMsg& msg)
                         {
                             const size_t bytesPerLine = rect.r.w * pixelFormat.bitsPerPixel / 8;
 
+                            // Receive the whole rectangle in one piece if possible.  Large
+                            // reads bypass the ring buffer and go straight from the socket
+                            // into rawRectData (see readFromRFBServer()).
+                            void* const rawRectData = this->getRawRectBuffer(bytesPerLine*rect.r.h);
+                            if (rawRectData)
+                            {
+                                if (!this->readFromRFBServer(rawRectData, bytesPerLine*rect.r.h))
+                                {
+                                    if (isOpen) this->errorMessage("RFBProtocol::receivedFramebufferUpdate", "socket read error");
+                                    return false;
+                                }
+                                else
+                                {
+                                    this->copyRectData(rawRectData, rect.r.x, rect.r.y, rect.r.w, rect.r.h);
+                                    break;
+                                }
+                            }
+
                             size_t linesToRead = DECODE_BUFFER_SIZE / bytesPerLine;
                             while (rect.r.h > 0)
                             {
@@ -1432,6 +2503,29 @@ bool RFBProtocol::receivedFramebufferUpdate(const rfbFramebufferUpdateMsg& msg)
                         }
                         break;
 
+                        case rfbEncodingTight:
+                        {
+                            switch (pixelFormat.bitsPerPixel)
+                            {
+                                case 8:
+                                    if (!this->handleTight8(rect.r.x, rect.r.y, rect.r.w, rect.r.h))
+                                        return false;
+                                    break;
+                                case 16:
+                                    if (!this->handleTight16(rect.r.x, rect.r.y, rect.r.w, rect.r.h))
+                                        return false;
+                                    break;
+                                case 32:
+                                    if (!this->handleTight32(rect.r.x, rect.r.y, rect.r.w, rect.r.h))
+                                        return false;
+                                    break;
+                                default:
+                                    if (isOpen) this->errorMessage1l("RFBProtocol::receivedFramebufferUpdate", "unimplemented bits per pixel", pixelFormat.bitsPerPixel);
+                                    return false;
+                            }
+                        }
+                        break;
+
                         case rfbEncodingDesktopSize:
                         {
                             framebufferWidth  = rect.r.w;
@@ -1573,6 +2667,13 @@ void RFBProtocol::infoCloseCompleted() const
 
 
 
+void RFBProtocol::infoEncodingPolicyChanged(const EncodingPolicyStats& stats) const
+{
+    // default implementation does nothing...
+}
+
+
+
 bool RFBProtocol::encryptChallenge(const unsigned char* challenge,
                                    size_t               challengeSize,
                                    const unsigned char* passwd,
@@ -1604,6 +2705,23 @@ bool RFBProtocol::encryptChallenge(const unsigned char* challenge,
 
 
 
+void* RFBProtocol::getRawRectBuffer(size_t size)
+{
+    if (size > rawRectBufferSize)
+    {
+        void* const newRawRectBuffer = realloc(rawRectBuffer, size);
+        if (!newRawRectBuffer)
+            return 0;  // fall back to receiving through decodeBuffer
+
+        rawRectBuffer     = (rfbCARD8*)newRawRectBuffer;
+        rawRectBufferSize = size;
+    }
+
+    return rawRectBuffer;
+}
+
+
+
 rfbCARD32 RFBProtocol::doMapColor(rfbCARD32 color)
 {
     return color;
@@ -1676,47 +2794,227 @@ void RFBProtocol::performUpdateNeeded(int x, int y, size_t w, size_t h)
 
 bool RFBProtocol::checkAvailableFromRFBServer(size_t n)
 {
-    if (n > COMM_BUFFER_SIZE)
+    if (!commBuffer || (n > commBufferSize))
         return false;
 
-    if (commBufferPos > 0)
+    while (n > commBufferAvail)
     {
-        memmove(commBuffer, commBuffer+commBufferPos, commBufferFill-commBufferPos);
+        if (!this->waitForRFBServer())
+            return false;
+        else
+        {
+            // Fill all of the free space in the ring buffer with a single
+            // readv(): from the write position up to the end of the buffer,
+            // then (if the free space wraps) from the start of the buffer.
+            const size_t writePos  = (commBufferPos + commBufferAvail) % commBufferSize;
+            const size_t freeSpace = commBufferSize - commBufferAvail;
+
+            struct iovec iov[2];
+            int          iovCount = 1;
+            iov[0].iov_base = commBuffer + writePos;
+            iov[0].iov_len  = commBufferSize - writePos;
+            if (iov[0].iov_len >= freeSpace)
+                iov[0].iov_len = freeSpace;
+            else
+            {
+                iov[1].iov_base = commBuffer;
+                iov[1].iov_len  = freeSpace - iov[0].iov_len;
+                iovCount = 2;
+            }
+
+            const ssize_t ne = this->receiveFromRFBServer(iov, iovCount);
 
-        commBufferFill -= commBufferPos;
-        commBufferPos = 0;
+            if (!isOpen)
+                return false;
+            else if (ne < 0)
+            {
+                if ((errno != EINTR) && (errno != EAGAIN))
+                    return false;
+            }
+            else if (ne == 0)
+            {
+                return false;  // end of file: the server closed the connection
+            }
+            else
+                commBufferAvail += (size_t)ne;
+        }
     }
 
-    bool lastReadReturnedZeroBytes = false;
+    return true;
+}
+
 
-    while (n > commBufferFill)
+
+bool RFBProtocol::waitForRFBServer()
+{
+    if (replayFile)
+        return this->waitForReplay();
+
+    for (;;)
     {
-        const int ne = read(sock, commBuffer+commBufferFill, COMM_BUFFER_SIZE-commBufferFill);
+        // Block until the server sends something or close() writes to the
+        // wakeup pipe.  poll() ignores a negative descriptor, so a missing
+        // wakeup pipe simply leaves us relying on the shutdown() in close().
+        struct pollfd fds[2];
+        fds[0].fd      = sock;
+        fds[0].events  = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd      = wakeupPipe[0];
+        fds[1].events  = POLLIN;
+        fds[1].revents = 0;
+
+        const int np = poll(fds, 2, -1);
 
-        if (!isOpen || (ne < 0))
+        if (!isOpen)
+            return false;  // in case this object was closed while we were waiting for input
+        else if (np < 0)
         {
-            return false;
+            if (errno != EINTR)
+                return false;
         }
-        else if (ne == 0)
+        else if (fds[1].revents != 0)
         {
-            if (lastReadReturnedZeroBytes)
-                usleep(1000);
+            return false;  // woken up by close()
+        }
+        else if ((fds[0].revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL)) != 0)
+        {
+            return true;
+        }
+    }
+}
+
 
-            lastReadReturnedZeroBytes = true;
+
+bool RFBProtocol::waitForReplay()
+{
+    while (replayBlockPos >= replayBlockLength)
+        if (!this->readReplayBlock())
+        {
+            replayEnded = true;
+            return false;  // end of the recording, or a read error
         }
-        else
+
+    if (replayRealTime)
+    {
+        for (;;)
         {
-            commBufferFill += (size_t)ne;
+            const long long delayUsec = (replayStartTime + 1000*(long long)replayBlockTimestamp) - MonotonicTimeUsec();
+            if (delayUsec <= 0)
+                break;
+
+            // Sleep until the block is due, unless close() writes to the wakeup pipe:
+            struct pollfd fds[1];
+            fds[0].fd      = wakeupPipe[0];
+            fds[0].events  = POLLIN;
+            fds[0].revents = 0;
+
+            const int np = poll(fds, 1, (int)((delayUsec + 999) / 1000));
+
+            if (!isOpen)
+                return false;
+            else if (np < 0)
+            {
+                if (errno != EINTR)
+                    return false;
+            }
+            else if (fds[0].revents != 0)
+            {
+                return false;  // woken up by close()
+            }
+        }
+    }
+
+    return isOpen;
+}
+
+
 
-            lastReadReturnedZeroBytes = false;
+bool RFBProtocol::readReplayBlock()
+{
+    rfbCARD32 length;
+    rfbCARD32 timestamp;
+
+    replayBlockLength = 0;
+    replayBlockPos    = 0;
+
+    if (fread(&length, sizeof(length), 1, replayFile) != 1)
+        return false;  // end of file
+
+    length = Swap32IfLE(length);
+
+    const size_t paddedLength = ((size_t)length + 3) & ~(size_t)3;
+
+    if (paddedLength > replayBlockSize)
+    {
+        rfbCARD8* const newReplayBlock = (rfbCARD8*)realloc(replayBlock, paddedLength);
+        if (!newReplayBlock)
+        {
+            if (isOpen) this->errorMessage("RFBProtocol::readReplayBlock", "memory allocation failed");
+            return false;
         }
+
+        replayBlock     = newReplayBlock;
+        replayBlockSize = paddedLength;
+    }
+
+    if ( (fread(replayBlock, 1, paddedLength, replayFile) != paddedLength) ||
+         (fread(&timestamp, sizeof(timestamp), 1, replayFile) != 1)          )
+    {
+        if (isOpen) this->errorMessage("RFBProtocol::readReplayBlock", "replay file is truncated");
+        return false;
     }
 
+    replayBlockLength    = length;
+    replayBlockTimestamp = Swap32IfLE(timestamp);
+
     return true;
 }
 
 
 
+ssize_t RFBProtocol::receiveFromRFBServer(const struct iovec* iov, int iovCount)
+{
+    ssize_t ne = 0;
+
+    if (!replayFile)
+        ne = readv(sock, iov, iovCount);
+    else
+    {
+        // waitForReplay() has made sure that replayBlock is not empty:
+        for (int i = 0; (i < iovCount) && (replayBlockPos < replayBlockLength); i++)
+        {
+            size_t nc = replayBlockLength - replayBlockPos;
+            if (nc > iov[i].iov_len)
+                nc = iov[i].iov_len;
+
+            memcpy(iov[i].iov_base, replayBlock+replayBlockPos, nc);
+
+            replayBlockPos += nc;
+            ne             += (ssize_t)nc;
+        }
+    }
+
+    if (ne > 0)
+    {
+        receiveStats.bytes += ne;
+
+        if (recordFile)
+        {
+            size_t nr = (size_t)ne;
+            for (int i = 0; (i < iovCount) && (nr > 0); i++)
+            {
+                const size_t nc = (nr < iov[i].iov_len) ? nr : iov[i].iov_len;
+                this->recordServerData(iov[i].iov_base, nc);
+                nr -= nc;
+            }
+        }
+    }
+
+    return ne;
+}
+
+
+
 bool RFBProtocol::readFromRFBServer(void* buf, size_t n)
 {
     if (!isOpen)
@@ -1724,23 +3022,64 @@ bool RFBProtocol::readFromRFBServer(void* buf, size_t n)
 
     while (n > 0)
     {
-        size_t avail = commBufferFill - commBufferPos;
-
-        if (avail <= 0)
+        if (commBufferAvail <= 0)
         {
-            if (!this->checkAvailableFromRFBServer((n > COMM_BUFFER_SIZE) ? COMM_BUFFER_SIZE : n))
+            // Once the ring buffer is drained, large requests are received
+            // straight into buf rather than being staged in commBuffer.
+            if (n >= MIN_DIRECT_READ_SIZE)
+                return this->readDirectFromRFBServer(buf, n);
+            else if (!this->checkAvailableFromRFBServer(1))
                 return false;
-            else
-                avail = commBufferFill - commBufferPos;
         }
 
-        const size_t nr = (avail > n) ? n : avail;
+        // Copy out at most the contiguous part up to the wrap point:
+        size_t nr = commBufferSize - commBufferPos;
+        if (nr > commBufferAvail)
+            nr = commBufferAvail;
+        if (nr > n)
+            nr = n;
 
         memcpy(buf, commBuffer+commBufferPos, nr);
 
-        buf           =  (char*)buf + nr;
-        commBufferPos += nr;
-        n             -= nr;
+        buf =  (char*)buf + nr;
+        n   -= nr;
+        this->consumeCommBuffer(nr);
+    }
+
+    return isOpen;
+}
+
+
+
+bool RFBProtocol::readDirectFromRFBServer(void* buf, size_t n)
+{
+    while (n > 0)
+    {
+        if (!this->waitForRFBServer())
+            return false;
+
+        struct iovec iov;
+        iov.iov_base = buf;
+        iov.iov_len  = n;
+
+        const ssize_t ne = this->receiveFromRFBServer(&iov, 1);
+
+        if (!isOpen)
+            return false;
+        else if (ne < 0)
+        {
+            if ((errno != EINTR) && (errno != EAGAIN))
+                return false;
+        }
+        else if (ne == 0)
+        {
+            return false;  // end of file: the server closed the connection
+        }
+        else
+        {
+            buf =  (char*)buf + ne;
+            n   -= (size_t)ne;
+        }
     }
 
     return isOpen;
@@ -1753,17 +3092,348 @@ bool RFBProtocol::writeToRFBServer(const void* buf, size_t n)
     if (!isOpen)
         return false;  // in case this object was closed while we were waiting for input
 
+    bool result = true;
+
+    OutputBatch* const batch = this->getOutputBatch(false);
+
+    if (!batch || (batch->depth <= 0) || ((batch->fill + n) > OUT_BUFFER_SIZE))
+        result = this->flushOutputBatch(batch, buf, n);  // not batching, or the buffer is full: send what is buffered and this message
+    else
+    {
+        if (batch->fill <= 0)
+            batch->deadline = MonotonicTimeUsec() + OUT_BUFFER_DEADLINE_USEC;
+
+        memcpy(batch->buffer+batch->fill, buf, n);
+        batch->fill += n;
+
+        if (MonotonicTimeUsec() >= batch->deadline)
+            result = this->flushOutputBatch(batch, 0, 0);
+    }
+
+    return result && isOpen;
+}
+
+
+
+void RFBProtocol::releaseReceiveResources()
+{
+    if (requestedEncodings) { free((void*)requestedEncodings); requestedEncodings = 0; }
+    zlibDecompressor.close();
+    for (int i = 0; i < NUM_TIGHT_ZLIB_STREAMS; i++)
+        tightZlibDecompressors[i].close();
+    jpegDecompressor.end();
+    if (tightDataBuffer) { free(tightDataBuffer); tightDataBuffer = 0; }
+    tightDataBufferSize = 0;
+    if (rawRectBuffer) { free(rawRectBuffer); rawRectBuffer = 0; }
+    rawRectBufferSize = 0;
+    if (commBuffer) { free(commBuffer); commBuffer = 0; }
+    commBufferPos   = 0;
+    commBufferAvail = 0;
+    memset(decodeBuffer, 0, DECODE_BUFFER_SIZE);
+    if (recordFile) { fclose(recordFile); recordFile = 0; }
+    recordStartTime = 0;
+    if (replayFile) { fclose(replayFile); replayFile = 0; }
+    if (replayBlock) { free(replayBlock); replayBlock = 0; }
+    replayBlockSize      = 0;
+    replayBlockLength    = 0;
+    replayBlockPos       = 0;
+    replayBlockTimestamp = 0;
+}
+
+
+
+void RFBProtocol::drainWakeupPipe()
+{
+    if (wakeupPipe[0] >= 0)
+    {
+        char buf[64];
+        while (::read(wakeupPipe[0], buf, sizeof(buf)) > 0)
+            ;  // wakeupPipe[0] is non-blocking
+    }
+}
+
+
+
+void RFBProtocol::beginOutputBatch()
+{
+    OutputBatch* const batch = this->getOutputBatch(true);
+    if (batch)
+        batch->depth++;  // otherwise messages are just sent right away
+}
+
+
+
+bool RFBProtocol::endOutputBatch()
+{
+    bool result = true;
+
+    OutputBatch* const batch = this->getOutputBatch(false);
+
+    if (batch && (batch->depth > 0))
+    {
+        batch->depth--;
+
+        if ((batch->depth <= 0) && !this->flushOutputBatch(batch, 0, 0))
+        {
+            if (isOpen) this->errorMessageForSend("RFBProtocol::endOutputBatch", "socket write error");
+            result = false;
+        }
+    }
+
+    return result;
+}
+
+
+
+void RFBProtocol::FreeOutputBatch(void* batch)  // static method
+{
+    free(batch);
+}
+
+
+
+RFBProtocol::OutputBatch* RFBProtocol::getOutputBatch(bool create)
+{
+    if (!outputBatchKeyValid)
+        return 0;
+
+    OutputBatch* batch = (OutputBatch*)pthread_getspecific(outputBatchKey);
+
+    if (!batch && create)
+    {
+        batch = (OutputBatch*)malloc(sizeof(OutputBatch));
+        if (batch)
+        {
+            batch->depth    = 0;
+            batch->deadline = 0;
+            batch->fill     = 0;
+
+            if (pthread_setspecific(outputBatchKey, batch) != 0)
+            {
+                free(batch);
+                batch = 0;
+            }
+        }
+    }
+
+    return batch;
+}
+
+
+
+bool RFBProtocol::flushOutputBatch(OutputBatch* batch, const void* buf, size_t n)
+{
+    const size_t fill = batch ? batch->fill : 0;
+    if (batch)
+        batch->fill = 0;  // on failure, the data is discarded along with the connection
+
+    if ((fill <= 0) && (n <= 0))
+        return true;
+    else if (!isOpen)
+        return false;  // don't let data buffered before close() reach a later connection
+
+    // Only the socket write itself is serialized; threads with an open
+    // batch keep filling their own buffers meanwhile.
+    pthread_mutex_lock(&sockWriteMutex);
+    bool result = (fill <= 0) || this->writeAllToSocket(batch->buffer, fill);
+    if (result && (n > 0))
+        result = this->writeAllToSocket(buf, n);
+    pthread_mutex_unlock(&sockWriteMutex);
+
+    return result;
+}
+
+
+
+bool RFBProtocol::writeAllToSocket(const void* buf, size_t n)
+{
+    if (replayFile)
+        return true;  // there is nobody to talk to
+
     while (n > 0)
     {
-        const int ne = write(sock, buf, n);
-        if (!isOpen || (ne < 0))
+        const ssize_t ne = write(sock, buf, n);
+        if (!isOpen)
             return false;
+        else if (ne < 0)
+        {
+            if (errno != EINTR)
+                return false;
+        }
+        else
+        {
+            buf =  (char*)buf + ne;
+            n   -= (size_t)ne;
+        }
+    }
+
+    return true;
+}
+
+
+
+bool RFBProtocol::configureSocket()
+{
+    if (!ApplySocketBufferSizes(sock, socketOptions))
+        return false;
+
+    if (sockIsLocal)
+        return true;  // the remaining options only apply to TCP
+
+    // Small messages are coalesced in output batches (see writeToRFBServer()),
+    // so Nagle's algorithm would usually only add latency to each flush.
+    const int noDelay = socketOptions.noDelay ? 1 : 0;
+    if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay)) < 0)
+        return false;
+
+    // The remaining options are advisory and not available everywhere
+    // (raising SO_BUSY_POLL may also need privileges), so failures are
+    // ignored.
+#ifdef SO_BUSY_POLL
+    if (socketOptions.busyPollUsec > 0)
+        (void)setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &socketOptions.busyPollUsec, sizeof(socketOptions.busyPollUsec));
+#endif
+
+    this->rearmQuickAck();
+
+    return true;
+}
+
+
+
+bool RFBProtocol::openRecordFile()
+{
+    char             fileName[PATH_MAX];
+    const time_t     now = time(0);
+    const struct tm* tm  = localtime(&now);
+
+    if (!tm || (strftime(fileName, sizeof(fileName), recordFileName, tm) == 0))
+        return false;
 
-        buf =  (char*)buf + ne;
-        n   -= ne;
+    if (!(recordFile = fopen(fileName, "wb")))
+        return false;
+
+    if (fwrite(RECORD_FILE_HEADER, 1, strlen(RECORD_FILE_HEADER), recordFile) != strlen(RECORD_FILE_HEADER))
+    {
+        fclose(recordFile);
+        recordFile = 0;
+        return false;
     }
 
-    return isOpen;
+    recordStartTime = MonotonicTimeUsec();
+
+    return true;
+}
+
+
+
+void RFBProtocol::recordServerData(const void* data, size_t n)
+{
+    if (recordFile && (n > 0))
+    {
+        static const char padding[4] = { 0, 0, 0, 0 };
+
+        const size_t    paddingSize = (4 - (n & 3)) & 3;
+        const rfbCARD32 length      = Swap32IfLE((rfbCARD32)n);
+        const rfbCARD32 timestamp   = Swap32IfLE((rfbCARD32)((MonotonicTimeUsec() - recordStartTime) / 1000));
+
+        // Stop recording (rather than produce a corrupt file) on a write error:
+        if ( (fwrite(&length,    sizeof(length),    1, recordFile) != 1)           ||
+             (fwrite(data,       1,                 n, recordFile) != n)           ||
+             (fwrite(padding,    1,       paddingSize, recordFile) != paddingSize) ||
+             (fwrite(&timestamp, sizeof(timestamp), 1, recordFile) != 1)              )
+        {
+            this->errorMessage("RFBProtocol::recordServerData", "write to record file failed; recording stopped");
+            fclose(recordFile);
+            recordFile = 0;
+        }
+    }
+}
+
+
+
+void RFBProtocol::rearmQuickAck()
+{
+    if (!socketOptions.quickAck || sockIsLocal || replayFile)
+        return;  // the usual case: no system call
+
+#ifdef TCP_QUICKACK
+    const int quickAck = 1;
+    (void)setsockopt(sock, IPPROTO_TCP, TCP_QUICKACK, &quickAck, sizeof(quickAck));
+#endif
+}
+
+
+
+bool RFBProtocol::readTightCompactLength(size_t& length)
+{
+    length = 0;
+
+    for (int i = 0; i < 3; i++)
+    {
+        rfbCARD8 b;
+        if (!this->readFromRFBServer(&b, 1))
+        {
+            if (isOpen) this->errorMessage("RFBProtocol::readTightCompactLength", "socket read error");
+            return false;
+        }
+
+        if (i == 2)
+            length |= ((size_t)b << 14);
+        else
+        {
+            length |= ((size_t)(b & 0x7f) << (7*i));
+            if (!(b & 0x80))
+                break;
+        }
+    }
+
+    return true;
+}
+
+
+
+bool RFBProtocol::resetTightZlibStreams(rfbCARD8 mask)
+{
+    for (int i = 0; i < NUM_TIGHT_ZLIB_STREAMS; i++)
+    {
+        if (mask & (1 << i))
+        {
+            tightZlibDecompressors[i].close();
+            if (!tightZlibDecompressors[i].init())
+                return false;
+        }
+    }
+
+    return true;
+}
+
+
+
+void RFBProtocol::initRGBToPixel()
+{
+    // The pixels are stored in the byte order in which the server sends
+    // them; ORing the byte-swapped components gives the byte-swapped pixel.
+    const rfbCARD16 maxes[3]  = { pixelFormat.redMax,   pixelFormat.greenMax,   pixelFormat.blueMax   };
+    const rfbCARD8  shifts[3] = { pixelFormat.redShift, pixelFormat.greenShift, pixelFormat.blueShift };
+    const bool      swap      = ((pixelFormat.bigEndian != 0) == (*(char*)&EndianTest != 0));
+
+    for (int c = 0; c < 3; c++)
+    {
+        for (rfbCARD32 v = 0; v < 256; v++)
+        {
+            const rfbCARD32 pixel = (((v * maxes[c]) + 127) / 255) << shifts[c];
+
+            if (!swap)
+                rgbToPixel[c][v] = pixel;
+            else if (pixelFormat.bitsPerPixel == 16)
+                rgbToPixel[c][v] = SwapPixel16((rfbCARD16)pixel);
+            else if (pixelFormat.bitsPerPixel == 32)
+                rgbToPixel[c][v] = SwapPixel32(pixel);
+            else
+                rgbToPixel[c][v] = pixel;
+        }
+    }
 }
 
 
@@ -1809,6 +3479,14 @@ bool RFBProtocol::writeToRFBServer(const void* buf, size_t n)
 
 
 
+// getOpaque*() extract a pixel value from inflated ZRLE data without
+// byte-swapping, just like ZlibDecompressor::readOpaque*().
+static inline void getOpaque8(rfbCARD8* pv, const rfbCARD8* p)    { *pv = p[0]; }
+static inline void getOpaque16(rfbCARD16* pv, const rfbCARD8* p)  { ((rfbCARD8*)pv)[0] = p[0]; ((rfbCARD8*)pv)[1] = p[1]; }
+static inline void getOpaque24A(rfbCARD32* pv, const rfbCARD8* p) { *pv = 0; ((rfbCARD8*)pv)[0] = p[0]; ((rfbCARD8*)pv)[1] = p[1]; ((rfbCARD8*)pv)[2] = p[2]; }
+static inline void getOpaque24B(rfbCARD32* pv, const rfbCARD8* p) { *pv = 0; ((rfbCARD8*)pv)[1] = p[0]; ((rfbCARD8*)pv)[2] = p[1]; ((rfbCARD8*)pv)[3] = p[2]; }
+static inline void getOpaque32(rfbCARD32* pv, const rfbCARD8* p)  { ((rfbCARD8*)pv)[0] = p[0]; ((rfbCARD8*)pv)[1] = p[1]; ((rfbCARD8*)pv)[2] = p[2]; ((rfbCARD8*)pv)[3] = p[3]; }
+
 #define BPP 8
 #include "zrle.cppinc"
 #undef BPP
@@ -1829,5 +3507,17 @@ bool RFBProtocol::writeToRFBServer(const void* buf, size_t n)
 
 
 
+#define BPP 8
+#include "tight.cppinc"
+#undef BPP
+#define BPP 16
+#include "tight.cppinc"
+#undef BPP
+#define BPP 32
+#include "tight.cppinc"
+#undef BPP
+
+
+
 #undef CONCAT2E
 #undef CONCAT2
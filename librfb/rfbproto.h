@@ -51,7 +51,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <zlib.h>
 #include <X11/Xmd.h>  // for CARD* definitions
 
@@ -312,10 +314,23 @@ typedef struct {
 #define rfbEncodingRRE            2
 #define rfbEncodingCoRRE          4
 #define rfbEncodingHextile        5
+#define rfbEncodingTight          7
 #define rfbEncodingZRLE          16
 #define rfbEncodingCursor      -239  /* pseudo encoding */ /* currently not supported by this implementation */
 #define rfbEncodingDesktopSize -223  /* pseudo encoding */
 
+/*
+ * The CompressLevel and QualityLevel pseudo encodings tell a Tight server
+ * how hard to compress (0 = fastest, 9 = best) and which JPEG quality to
+ * use (0 = lowest, 9 = highest).  JPEG is only used if a QualityLevel is
+ * requested.
+ */
+
+#define rfbEncodingCompressLevel0  -256  /* pseudo encoding */
+#define rfbEncodingCompressLevel9  -247  /* pseudo encoding */
+#define rfbEncodingQualityLevel0    -32  /* pseudo encoding */
+#define rfbEncodingQualityLevel9    -23  /* pseudo encoding */
+
 
 
 /*****************************************************************************
@@ -478,6 +493,56 @@ typedef struct {
 #define rfbZRLETileHeight 64
 
 
+/*- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Tight Encoding.  The rectangle data starts with a compression control
+ * byte.  Its low 4 bits tell the client to reset the corresponding ones of
+ * its four zlib streams before decoding.  Its high 4 bits give the
+ * subencoding:
+ *
+ * rfbTightFill - the rectangle is filled with a single TPIXEL that follows.
+ *
+ * rfbTightJpeg - a compact length follows, and then that many bytes of a
+ *    JPEG image of the rectangle.
+ *
+ * Otherwise (basic compression) bits 0 and 1 of the subencoding select the
+ *    zlib stream, and if rfbTightExplicitFilter is set, a filter id byte
+ *    follows; the default filter is rfbTightFilterCopy.  For
+ *    rfbTightFilterPalette a byte giving the number of colours minus one
+ *    and then that many TPIXELs follow.  The filtered data follows: if it
+ *    is shorter than rfbTightMinToCompress bytes it is sent as is,
+ *    otherwise a compact length is followed by that many bytes of zlib
+ *    stream data.
+ *
+ * The filtered data consists of rows of TPIXELs for rfbTightFilterCopy, of
+ * TPIXELs minus their prediction from the pixels above and to the left for
+ * rfbTightFilterGradient, and of palette indices for rfbTightFilterPalette:
+ * one bit per pixel (most significant bit first, each row padded to a
+ * whole byte) for two colours, otherwise one byte per pixel.
+ *
+ * A TPIXEL is a pixel in the client's format, except that if the format
+ * has 32 bits per pixel, a depth of 24 and maximum colour values of 255, it
+ * is sent as 3 bytes: red, green and blue.
+ *
+ * A compact length is 1 to 3 bytes holding 7, 7 and 8 bits of the length,
+ * least significant first; the top bit of the first two bytes is set if
+ * another byte follows.
+ *
+ * Servers never send Tight rectangles wider than rfbTightMaxRectWidth.
+ */
+
+#define rfbTightExplicitFilter  0x04
+#define rfbTightFill            0x08
+#define rfbTightJpeg            0x09
+#define rfbTightMaxSubencoding  0x09
+
+#define rfbTightFilterCopy      0x00
+#define rfbTightFilterPalette   0x01
+#define rfbTightFilterGradient  0x02
+
+#define rfbTightMinToCompress   12
+#define rfbTightMaxRectWidth    2048
+
+
 /*-----------------------------------------------------------------------------
  * SetColourMapEntries - these messages are only sent if the pixel
  * format uses a "colour map" (i.e. trueColour false) and the client has not
@@ -742,6 +807,8 @@ typedef union {
 #ifdef __cplusplus
 }  // end of extern "C" block
 
+#include "jpegdecompressor.h"
+
 
 
 namespace rfb
@@ -796,8 +863,20 @@ namespace rfb
                 return bytes;
             }
 
+            // span() makes at least n contiguous inflated bytes available
+            // at getPtr() and returns how many there are, which may be more
+            // than n.  Less than n are returned only if the compressed data
+            // ends first or cannot be inflated.  n must not exceed
+            // BUFFER_SIZE.  Decoders consume the bytes via setPtr().
+            size_t span(size_t n) { return ((size_t)(end - ptr) >= n) ? (size_t)(end - ptr) : refill(n); }
+
+            // setBytesIn() sets the number of compressed bytes that follow
+            // in the stream from the server, e.g., from a ZRLE length header.
+            void setBytesIn(unsigned n) { bytesIn = n; }
+
         protected:
-            virtual int overrun(size_t itemSize, unsigned nItems);
+            virtual int    overrun(size_t itemSize, unsigned nItems);
+            virtual size_t refill(size_t n);  // called by span()
 
         public:
             bool readrfbCARD8(rfbCARD8* pv) { if (!fill(1)) return false; *pv = *ptr++; return true; }
@@ -877,8 +956,173 @@ namespace rfb
                                    const char*           theRequestedEncodings,     // copied
                                    bool                  theSharedDesktopFlag);     // fails if isOpen
 
+        // initViaReplay() plays back a session recorded via setRecordFileName()
+        // in place of a server: everything the server sent is read from
+        // theReplayFileName, and everything written to the server is discarded.
+        // With theRealTimeFlag the data is delivered at the pace at which it was
+        // recorded, otherwise as fast as it can be decoded, which makes
+        // getReceiveStats() a repeatable measure of decoding throughput.
+        // handleRFBServerMessage() returns false at the end of the recording.
+        // The server in the recording honored the pixel format and encodings
+        // requested at the time, so theRequestedPixelFormat and
+        // theRequestedEncodings must be the same as for the recorded session.
+        virtual bool initViaReplay(const char*           theReplayFileName,
+                                   const rfbPixelFormat& theRequestedPixelFormat,   // copied
+                                   const char*           theRequestedEncodings,     // copied
+                                   bool                  theRealTimeFlag);          // fails if isOpen
+
+        bool getIsReplaying() const { return (isOpen && (replayFile != 0)); }
+
+        // close() may be called on another thread than the one calling
+        // handleRFBServerMessage(); it shuts the socket down and wakes that
+        // thread up.  The receive buffers, decompressors and record/replay
+        // files are kept until the next initVia*() or the destructor, so
+        // join that thread before either.
         virtual void close();  // to be safe, call close() before this object is destroyed
 
+        // Counters for the data received since the last initVia*() call.
+        struct ReceiveStats
+        {
+            ReceiveStats();
+
+            long long bytes;        // received from the server (or read from the replay file)
+            long long rectangles;   // FramebufferUpdate rectangles, including pseudo-rectangles
+            long long updates;      // FramebufferUpdate messages
+            long long pixels;       // area of the rectangles received, except CopyRect and pseudo-rectangles
+            long long elapsedUsec;  // from the end of connection setup until close(), or until now if still open
+        };
+
+        ReceiveStats getReceiveStats() const;
+
+        // With adaptive encodings, sendSetEncodings() orders the encodings
+        // and picks the Tight CompressLevel according to an EncodingPolicy,
+        // and the policy is re-evaluated about every ADAPT_INTERVAL_USEC
+        // from the updates received: the link throughput, and per policy
+        // the decoding CPU time and the bytes received per pixel.  The policy
+        // predicted to deliver pixels fastest is approached one step at a
+        // time, after ADAPT_STABLE_INTERVALS consistent evaluations; each
+        // change re-sends SetEncodings and calls infoEncodingPolicyChanged().
+        // Only encodings in requestedEncodings (all supported ones if it is
+        // 0) are sent, and a requested QualityLevel is only ever lowered, so
+        // JPEG is used only if it was asked for.  Connections to this machine
+        // start at POLICY_LAN, others at POLICY_BALANCED.  There is no
+        // adaptation while replaying.
+        enum EncodingPolicy
+        {
+            POLICY_LAN = 0,    // raw and hextile first; cheapest to decode
+            POLICY_BALANCED,   // hextile and ZRLE first
+            POLICY_WAN,        // ZRLE and Tight first, moderate compression
+            POLICY_CONGESTED,  // Tight first, best compression, lower JPEG quality
+            NUM_ENCODING_POLICIES
+        };
+
+        struct EncodingPolicyStats
+        {
+            EncodingPolicyStats();
+
+            EncodingPolicy policy;
+            double         linkThroughput;      // estimated bytes per second the connection delivers; 0 if not yet measured
+            double         decodeNsecPerPixel;  // decoding CPU time per pixel under policy; 0 if not yet measured
+            double         bytesPerPixel;       // bytes received per pixel under policy; 0 if not yet measured
+            long long      changes;             // policy changes since the last initVia*()
+        };
+
+        virtual bool setAdaptiveEncodings(bool newAdaptiveEncodings);  // fails if isOpen
+        bool getAdaptiveEncodings() const { return adaptiveEncodings; }
+        EncodingPolicyStats getEncodingPolicyStats() const;
+
+        static const char* GetEncodingPolicyName(EncodingPolicy policy);
+
+        // setCommBufferSize() sets the size of the ring buffer that receives
+        // data from the server; it takes effect at the next initViaConnect()
+        // or initViaListen().  0 selects DEFAULT_COMM_BUFFER_SIZE.
+        virtual bool setCommBufferSize(size_t newCommBufferSize);  // fails if isOpen
+        size_t getCommBufferSize() const { return commBufferSize; }
+
+        // setPreconnectedSocket() hands over a socket already connected (e.g.,
+        // by ConnectToServer() on another thread) to the same desktopHost and
+        // rfbPort that will be passed to the next initViaConnect(), which then
+        // skips hostname resolution and connect().  This object takes ownership
+        // of theSock; it is closed by close() if initViaConnect() never uses it.
+        virtual bool setPreconnectedSocket(int theSock);  // fails if isOpen; -1 ==> none
+
+        // SocketOptions tune the socket used to talk to the server.  The
+        // buffer sizes are applied before connect() or listen() as well as
+        // afterwards, so that the TCP window scale can take them into account.
+        struct SocketOptions
+        {
+            SocketOptions();
+
+            int  receiveBufferSize;  // SO_RCVBUF in bytes; 0 ==> system default
+            int  sendBufferSize;     // SO_SNDBUF in bytes; 0 ==> system default
+            bool noDelay;            // TCP_NODELAY; default true since small messages are coalesced in output batches anyway
+            bool quickAck;           // TCP_QUICKACK, re-armed once per server message; Linux only; default false
+            int  busyPollUsec;       // SO_BUSY_POLL in microseconds; Linux only; 0 ==> off
+        };
+
+        // setRecordFileName() makes the next initViaConnect() or initViaListen()
+        // record everything received from the server, from the ProtocolVersion
+        // message on, in rfbproxy's FBS 001.000 format: the RECORD_FILE_HEADER,
+        // then for each chunk received a big-endian 32-bit length, the data
+        // padded to a multiple of 4 bytes, and a big-endian 32-bit timestamp in
+        // milliseconds since the connection was made.  newRecordFileName is
+        // passed through strftime() with the local time when the file is
+        // opened, so it may contain e.g. "%Y%m%d-%H%M%S" to timestamp it.
+        virtual bool setRecordFileName(const char* newRecordFileName);  // copied; 0 or "" ==> don't record; fails if isOpen
+        const char* getRecordFileName() const { return recordFileName; }
+        bool getIsRecording() const { return (recordFile != 0); }
+
+        // setLocalSocketPath() names the Unix-domain socket of a VNC server
+        // running on this machine (e.g., Xvnc -rfbunixpath).  If set, the next
+        // initViaConnect() tries it first and falls back to TCP if it cannot
+        // connect, so only set it for desktops served on this machine.
+        virtual bool setLocalSocketPath(const char* newLocalSocketPath);  // copied; 0 or "" ==> TCP only; fails if isOpen
+        const char* getLocalSocketPath() const { return localSocketPath; }
+        bool getSockIsLocal() const { return sockIsLocal; }
+
+        // ConnectToLocalServer() connects to the Unix-domain socket at path.
+        // It returns the connected socket, or returns -1 and sets failure to
+        // a static string describing the failure.
+        static int ConnectToLocalServer(const char* path, const char*& failure);
+
+        // setSocketOptions() takes effect at the next initViaConnect() or
+        // initViaListen().
+        virtual bool setSocketOptions(const SocketOptions& newSocketOptions);  // fails if isOpen
+        const SocketOptions& getSocketOptions() const { return socketOptions; }
+
+        // ApplySocketBufferSizes() sets SO_RCVBUF and SO_SNDBUF on theSock as
+        // given in options; call it before connect() or listen().
+        static bool ApplySocketBufferSizes(int theSock, const SocketOptions& options);
+
+        // setConnectTimeout() bounds the time initViaConnect() waits for the
+        // TCP connection to be established; it takes effect at the next
+        // initViaConnect().  0 selects DEFAULT_CONNECT_TIMEOUT_MSEC.
+        virtual bool setConnectTimeout(unsigned newConnectTimeoutMsec);  // fails if isOpen
+        unsigned getConnectTimeout() const { return connectTimeoutMsec; }
+
+        // Time taken by the last initViaConnect() to establish the TCP
+        // connection, in microseconds; 0 if a preconnected socket was used
+        // or the connection failed.
+        long long getConnectDuration() const { return connectDurationUsec; }
+
+        // ConnectToServer() resolves theDesktopHost with getaddrinfo() and
+        // connects to the given rfbPort (CONNECT_PORT_OFFSET is added) using
+        // non-blocking sockets, trying up to MAX_PARALLEL_CONNECTS resolved
+        // addresses at once; the first to connect wins.  It gives up after
+        // timeoutMsec (0 ==> DEFAULT_CONNECT_TIMEOUT_MSEC), or as soon as
+        // abortFd (if >= 0) becomes readable.  The buffer sizes in options
+        // (if given) are applied before connecting.  It returns the connected
+        // (blocking) socket and fills in address, or returns -1 and sets
+        // failure to a static string describing the failure.  It uses no
+        // instance state, so it may be called from any thread.
+        static int ConnectToServer( const char*          theDesktopHost,  // 0 or "" ==> local
+                                    unsigned             theRfbPort,
+                                    unsigned             timeoutMsec,
+                                    struct sockaddr_in&  address,
+                                    const char*&         failure,
+                                    int                  abortFd = -1,
+                                    const SocketOptions* options = 0 );
+
     protected:
         virtual bool finishInit(bool theSharedDesktopFlag);  // called by initViaConnect() and initViaListen()
 
@@ -898,6 +1142,17 @@ namespace rfb
         virtual bool sendPointerEvent(int x, int y, int buttonMask);
         virtual bool sendClientCutText(const char* str, size_t len);
 
+    public:
+        // Messages a thread writes while it has an output batch open are
+        // coalesced in that thread's own OutputBatch buffer and sent when
+        // its outermost batch ends, when the buffer fills up, or when the
+        // oldest buffered message is older than OUT_BUFFER_DEADLINE_USEC.
+        // The deadline is checked on each write, so do not keep a batch
+        // open while waiting.  Messages from threads without an open batch
+        // are sent immediately.  Batches nest.
+        virtual void beginOutputBatch();
+        virtual bool endOutputBatch();  // returns false if flushing failed
+
     public:
         // sendStringViaKeyEvents() sends the given string as a series of KeySyms via sendKeyEvent().
         // With the following exceptions, a character's KeySym is its ASCII value.
@@ -947,6 +1202,15 @@ namespace rfb
         virtual void copyRect(int fromX, int fromY, int toX, int toY, size_t w, size_t h) = 0;
         virtual void fillRect(rfbCARD32 color, int x, int y, size_t w, size_t h)          = 0;  // color is sent in rfbCARD32 value regardless of actual size/format
 
+        // getRawRectBuffer() returns a buffer of at least size bytes into which
+        // a whole Raw-encoded rectangle is received directly from the socket,
+        // or a row of Hextile tiles is rasterized, before being passed to
+        // copyRectData().  The buffer only needs to remain valid until the
+        // next call.  If 0 is returned, the data is passed on in smaller
+        // pieces instead.  The default implementation grows a buffer that is
+        // freed by close().
+        virtual void* getRawRectBuffer(size_t size);
+
     protected:
         // The default implementation routes all error messages through errorMessage().
         // If your display environment is vulnerable to malicious strings (e.g., javascript
@@ -999,6 +1263,7 @@ namespace rfb
         virtual void infoDesktopSizeReceived(rfbCARD16 newWidth, rfbCARD16 newHeight) const;
         virtual void infoCloseStarted()   const;  // warning: if not closed when destructor called, this will be called after derived instance destructor has already completed...
         virtual void infoCloseCompleted() const;  // warning: if not closed when destructor called, this will be called after derived instance destructor has already completed...
+        virtual void infoEncodingPolicyChanged(const EncodingPolicyStats& stats) const;  // called before SetEncodings is re-sent; see setAdaptiveEncodings()
 
     protected:
         virtual char* returnPassword() = 0;  // must return 0 or a string allocated via malloc()
@@ -1027,7 +1292,33 @@ namespace rfb
     protected:
         virtual bool checkAvailableFromRFBServer(size_t n);
         virtual bool readFromRFBServer(void* buf, size_t n);
-        virtual bool writeToRFBServer(const void* buf, size_t n);
+        virtual bool writeToRFBServer(const void* buf, size_t n);  // buf must hold whole messages; coalesced while the calling thread has an output batch open
+
+    private:
+        struct OutputBatch;
+
+        void drainWakeupPipe();                             // discards pending wakeups written by close()
+        void releaseReceiveResources();                     // frees what the reader uses; called by initVia*() and the destructor, when no reader is running
+        bool waitForRFBServer();                            // blocks until sock is readable; false if closed or on error
+        bool waitForReplay();                               // waitForRFBServer() when replaying; false at the end of the recording
+        bool readReplayBlock();                             // loads the next block of replayFile into replayBlock
+        ssize_t receiveFromRFBServer(const struct iovec* iov, int iovCount);  // readv() from sock or replayBlock; records and counts the data
+        bool readDirectFromRFBServer(void* buf, size_t n);  // bypasses commBuffer; only called when commBuffer is empty
+        bool writeAllToSocket(const void* buf, size_t n);    // discards the data when replaying
+        OutputBatch* getOutputBatch(bool create);           // the calling thread's batching state; 0 if it has none and !create, or on failure
+        bool flushOutputBatch(OutputBatch* batch, const void* buf, size_t n);  // sends batch's buffer (batch may be 0), then buf, without other threads' messages in between
+        bool configureSocket();                             // called on the newly connected sock before finishInit(); applies socketOptions
+        void rearmQuickAck();                               // Linux clears TCP_QUICKACK, so this is called for every server message; does nothing unless socketOptions.quickAck
+        bool openRecordFile();                              // called by finishInit() if recordFileName is set
+        void recordServerData(const void* data, size_t n);  // called by receiveFromRFBServer()
+
+        void consumeCommBuffer(size_t n)
+        {
+            commBufferPos += n;
+            if (commBufferPos >= commBufferSize)
+                commBufferPos -= commBufferSize;
+            commBufferAvail -= n;
+        }
 
     protected:
         virtual bool handleRRE8(int rx, int ry, size_t rw, size_t rh);
@@ -1044,6 +1335,16 @@ namespace rfb
         virtual bool handleZRLE24A(int rx, int ry, size_t rw, size_t rh);
         virtual bool handleZRLE24B(int rx, int ry, size_t rw, size_t rh);
         virtual bool handleZRLE32(int rx, int ry, size_t rw, size_t rh);
+        virtual bool handleTight8(int rx, int ry, size_t rw, size_t rh);
+        virtual bool handleTight16(int rx, int ry, size_t rw, size_t rh);
+        virtual bool handleTight32(int rx, int ry, size_t rw, size_t rh);
+
+        bool readTightCompactLength(size_t& length);  // reads a Tight compact length from the server
+        bool resetTightZlibStreams(rfbCARD8 mask);    // resets tightZlibDecompressors[i] for each bit i set in mask
+        void initRGBToPixel();                        // sets up rgbToPixel for pixelFormat
+
+        size_t applyEncodingPolicy(rfbCARD32* encs, size_t n) const;  // reorders the n encodings in encs for encodingPolicy; encs must have room for n+1
+        bool   measuredUpdate(long long wallUsec, long long cpuUsec, long long bytes, long long pixels);  // true if encodingPolicy was changed
 
     public:
         static const rfbCARD16 EndianTest /* = 1 */;
@@ -1055,6 +1356,23 @@ namespace rfb
         enum { CONNECT_PORT_OFFSET = 5900 };
         enum { LISTEN_PORT_OFFSET  = 5500 };
 
+        enum { DEFAULT_COMM_BUFFER_SIZE = (256*1024) };
+        enum { MIN_COMM_BUFFER_SIZE     = 4096 };
+        enum { MIN_DIRECT_READ_SIZE     = 16384 };  // reads at least this large bypass commBuffer when it is empty
+
+        static const char RECORD_FILE_HEADER[] /* = "FBS 001.000\n" */;
+
+        enum { DEFAULT_CONNECT_TIMEOUT_MSEC = 10000 };
+        enum { MAX_PARALLEL_CONNECTS        = 8 };
+
+        enum { OUT_BUFFER_SIZE           = 16384 };
+        enum { OUT_BUFFER_DEADLINE_USEC  = 5000 };
+
+        enum { ADAPT_INTERVAL_USEC    = 1000000 };
+        enum { ADAPT_MIN_PIXELS       = 65536 };  // evaluations wait until this many pixels have been received
+        enum { ADAPT_STABLE_INTERVALS = 3 };
+        enum { ADAPT_MIN_GAIN_PERCENT = 20 };     // predicted speedup needed to move toward another policy
+
     protected:
         bool               isOpen;
         bool               isSameMachine;       // conntected to same machine as this client?  false if !isOpen
@@ -1064,7 +1382,7 @@ namespace rfb
         unsigned           portOffset;          // set to either 0 (if closed) or CONNECT_PORT_OFFSET or LISTEN_PORT_OFFSET if open
         rfbPixelFormat     pixelFormat;         // specified in initVia*(); zeroed if !isOpen
         bool               shouldMapColor;      // specified in initVia*(); false if !isOpen
-        const char*        requestedEncodings;  // specified in initVia*(); 0 if !isOpen; allocted via malloc()
+        const char*        requestedEncodings;  // specified in initVia*(); allocted via malloc(), freed by releaseReceiveResources() as the reader may still use it after close()
         const char*        desktopName;         // 0 until infoServerInitCompleted() called; allocted via malloc()
 
     protected:
@@ -1082,22 +1400,93 @@ namespace rfb
         bool             updateNeeded;
         bool             updateDefinitelyExpected;
         ZlibDecompressor zlibDecompressor;  // see above
+        rfbCARD8*        rawRectBuffer;         // see getRawRectBuffer(); allocated via malloc()
+        size_t           rawRectBufferSize;
+        int              preconnectedSock;      // see setPreconnectedSocket(); -1 if none
+        bool             sockIsLocal;           // true iff sock is a Unix-domain socket
+        const char*      localSocketPath;       // see setLocalSocketPath(); allocated via malloc()
+        const char*      recordFileName;        // see setRecordFileName(); allocated via malloc()
+        FILE*            recordFile;            // 0 unless recording
+        long long        recordStartTime;       // time (microseconds, CLOCK_MONOTONIC) recordFile was opened
+        unsigned         connectTimeoutMsec;    // set by setConnectTimeout()
+        SocketOptions    socketOptions;         // set by setSocketOptions()
+        long long        connectDurationUsec;   // see getConnectDuration()
+        ReceiveStats     receiveStats;          // see getReceiveStats(); elapsedUsec is not maintained here
+        long long        receiveStartTime;      // time (microseconds, CLOCK_MONOTONIC) finishInit() was called; 0 if never
+        long long        receiveStopTime;       // time (microseconds, CLOCK_MONOTONIC) close() was called
+        FILE*            replayFile;            // 0 unless replaying; see initViaReplay()
+        bool             replayRealTime;        // deliver replayed data at the recorded pace?
+        bool             replayEnded;           // true once replayFile has been read to the end
+        long long        replayStartTime;       // time (microseconds, CLOCK_MONOTONIC) the replay started
+        rfbCARD8*        replayBlock;           // current block of replayFile; allocated via malloc()
+        size_t           replayBlockSize;       // allocated size of replayBlock
+        size_t           replayBlockLength;     // number of data bytes in replayBlock
+        size_t           replayBlockPos;        // offset in replayBlock of the next byte to deliver
+        rfbCARD32        replayBlockTimestamp;  // milliseconds after replayStartTime at which replayBlock is due
+        bool             adaptiveEncodings;     // set by setAdaptiveEncodings()
+        EncodingPolicy   encodingPolicy;        // see setAdaptiveEncodings(); set by finishInit() and measuredUpdate()
+        long long        policyChanges;
+        double           linkThroughput;        // bytes per second; 0 until measured
+        double           policyDecodeNsecPerPixel[NUM_ENCODING_POLICIES];  // 0 until measured
+        double           policyBytesPerPixel[NUM_ENCODING_POLICIES];       // 0 until measured
+        long long        adaptWindowStart;      // time (microseconds, CLOCK_MONOTONIC) of the first update since the last evaluation; 0 if none
+        long long        adaptWallUsec;         // totals of the updates since the last evaluation...
+        long long        adaptCpuUsec;
+        long long        adaptBytes;
+        long long        adaptPixels;
+        int              adaptDirection;        // -1 or +1: direction of the last evaluations that called for a change; 0 if none
+        int              adaptStableCount;      // number of consecutive evaluations calling for adaptDirection
 
     private:
-        size_t commBufferPos;
-        size_t commBufferFill;
-        enum { COMM_BUFFER_SIZE = 4096 };
-        char commBuffer[COMM_BUFFER_SIZE];
+        int    wakeupPipe[2];    // close() writes to wakeupPipe[1] to wake up a reader blocked in checkAvailableFromRFBServer(); -1 if unavailable
+        char*  commBuffer;       // ring buffer of commBufferSize bytes; allocated via malloc() by finishInit(), freed by releaseReceiveResources()
+        size_t commBufferSize;   // set by setCommBufferSize()
+        size_t commBufferPos;    // offset in commBuffer of the next unread byte
+        size_t commBufferAvail;  // number of unread bytes starting at commBufferPos, possibly wrapping around the end of commBuffer
+
+    private:
+        struct OutputBatch  // a thread's coalesced messages; see beginOutputBatch()
+        {
+            unsigned  depth;     // number of batches the thread has open
+            long long deadline;  // time (microseconds, CLOCK_MONOTONIC) by which buffer must be sent; valid if fill > 0
+            size_t    fill;
+            char      buffer[OUT_BUFFER_SIZE];
+        };
+
+        static void FreeOutputBatch(void* batch);  // destructor for outputBatchKey
+
+        pthread_mutex_t sockWriteMutex;       // held while writing to sock, so that messages from different threads do not interleave
+        pthread_key_t   outputBatchKey;       // each thread's OutputBatch, allocated by its first beginOutputBatch()
+        bool            outputBatchKeyValid;  // false if outputBatchKey could not be created; messages are then never batched
 
     protected:
-        // The CoRRE encoding uses this buffer and assumes it is big enough
-        // to hold 255 * 255 * 32 bits -> 260100 bytes.  640*480 = 307200 bytes
+        // The RRE and CoRRE encodings read their subrectangles through this
+        // buffer in chunks of as many as fit.
         // Also, hextile assumes it is big enough to hold 16 * 16 * 32 bits = 1024 bytes.
         // Finally, the Zrle encoding assumes this buffer is big enough to hold
         // (rfbZRLETileWidth * rfbZRLETileHeight * 4) = 64 * 64 * 4 = 16384 bytes.
         enum { DECODE_BUFFER_SIZE = (640*480) };
         rfbCARD8 decodeBuffer[DECODE_BUFFER_SIZE];
 
+        // RRE and CoRRE rectangles with at most this many subrectangles are
+        // passed on as fillRect() calls; those with more are rasterized into
+        // a buffer from getRawRectBuffer() and passed on via copyRectData().
+        enum { MAX_DIRECT_FILL_SUBRECTS = 4 };
+
+        // The Tight encoding uses four zlib streams, selected per rectangle
+        // by the server.  Its JPEG images are received into tightDataBuffer
+        // and decompressed by jpegDecompressor.
+        enum { NUM_TIGHT_ZLIB_STREAMS = 4 };
+        ZlibDecompressor tightZlibDecompressors[NUM_TIGHT_ZLIB_STREAMS];
+        JpegDecompressor jpegDecompressor;
+        rfbCARD8*        tightDataBuffer;      // allocated via malloc()
+        size_t           tightDataBufferSize;
+
+        // rgbToPixel[c][v] is the pixel in pixelFormat, in the byte order in
+        // which it is sent, of color component c (0 = red, 1 = green, 2 = blue)
+        // at value v out of 255.  ORing the three components gives the pixel.
+        rfbCARD32 rgbToPixel[3][256];
+
     private:
         // Disable these copiers:
         RFBProtocol& operator=(const RFBProtocol&) { return *this; }
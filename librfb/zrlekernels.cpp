@@ -0,0 +1,568 @@
+/*
+ *  zrlekernels.cpp
+ *
+ *  Copyright (C) 2007 Voltaic.  All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include "zrlekernels.h"
+#include <strings.h>
+
+// The SSE2 and AVX2 kernels are compiled via function target attributes,
+// so that the rest of the program need not be built for those instruction
+// sets; they are only called if the CPU supports them.
+#if defined(__GNUC__) && (__GNUC__ >= 5) && (defined(__x86_64__) || defined(__i386__))
+#define ZRLE_KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+using namespace rfb;
+
+
+
+//----------------------------------------------------------------------
+// Index expansion tables: expandTableN[b] holds the indices packed into
+// byte b at N bits per index, most significant first.
+
+static rfbCARD8 expandTable1[256][8];
+static rfbCARD8 expandTable2[256][4];
+static rfbCARD8 expandTable4[256][2];
+
+static bool initExpandTables()
+{
+    for (int b = 0; b < 256; b++)
+    {
+        for (int i = 0; i < 8; i++)
+            expandTable1[b][i] = (b >> (7 - i))       & 0x01;
+        for (int i = 0; i < 4; i++)
+            expandTable2[b][i] = (b >> (6 - (2 * i))) & 0x03;
+        for (int i = 0; i < 2; i++)
+            expandTable4[b][i] = (b >> (4 - (4 * i))) & 0x0f;
+    }
+
+    return true;
+}
+
+static const bool expandTablesInitialized = initExpandTables();
+
+
+
+//----------------------------------------------------------------------
+// Scalar kernels (the lookups need no paletteSize)
+
+static void lookup8Scalar(rfbCARD8* dest, const rfbCARD8* indices, int count, const rfbCARD8* palette, int)
+{
+    for (int i = 0; i < count; i++)
+        dest[i] = palette[indices[i] & 0x7f];
+}
+
+static void lookup16Scalar(rfbCARD16* dest, const rfbCARD8* indices, int count, const rfbCARD16* palette, int)
+{
+    for (int i = 0; i < count; i++)
+        dest[i] = palette[indices[i] & 0x7f];
+}
+
+static void lookup32Scalar(rfbCARD32* dest, const rfbCARD8* indices, int count, const rfbCARD32* palette, int)
+{
+    for (int i = 0; i < count; i++)
+        dest[i] = palette[indices[i] & 0x7f];
+}
+
+static void fillRun8Scalar(rfbCARD8* dest, rfbCARD8 pix, int count)
+{
+    for (rfbCARD8* const end = dest + count; dest < end; )
+        *dest++ = pix;
+}
+
+static void fillRun16Scalar(rfbCARD16* dest, rfbCARD16 pix, int count)
+{
+    for (rfbCARD16* const end = dest + count; dest < end; )
+        *dest++ = pix;
+}
+
+static void fillRun32Scalar(rfbCARD32* dest, rfbCARD32 pix, int count)
+{
+    for (rfbCARD32* const end = dest + count; dest < end; )
+        *dest++ = pix;
+}
+
+static void expandIndicesScalar(rfbCARD8* indices, const rfbCARD8* packed, int count, int bitsPerIndex)
+{
+    // Whole bytes are expanded by table; the indices from the final,
+    // partial byte (if any) are copied from its table entry.
+    switch (bitsPerIndex)
+    {
+        case 1:
+            for ( ; count >= 8; count -= 8, indices += 8)
+                memcpy(indices, expandTable1[*packed++], 8);
+            if (count > 0)
+                memcpy(indices, expandTable1[*packed], count);
+            break;
+
+        case 2:
+            for ( ; count >= 4; count -= 4, indices += 4)
+                memcpy(indices, expandTable2[*packed++], 4);
+            if (count > 0)
+                memcpy(indices, expandTable2[*packed], count);
+            break;
+
+        case 4:
+            for ( ; count >= 2; count -= 2, indices += 2)
+                memcpy(indices, expandTable4[*packed++], 2);
+            if (count > 0)
+                memcpy(indices, expandTable4[*packed], count);
+            break;
+
+        default:
+            memcpy(indices, packed, count);
+            break;
+    }
+}
+
+
+
+#ifdef ZRLE_KERNELS_X86
+
+//----------------------------------------------------------------------
+// SSE2 kernels.  Without a byte shuffle, SSE2 only helps the lookup for
+// palettes of up to four colours (1 or 2 bits per index, e.g., text):
+// the low index bit selects between entries 0 and 1 (and 2 and 3), and
+// for four colours the high bit selects between those pairs.  Larger
+// palettes use the scalar lookup.  The indices are unpacked with shifts,
+// masks and byte interleaves.
+
+__attribute__((target("sse2")))
+static inline __m128i selectSSE2(__m128i mask, __m128i a, __m128i b)  // b where mask is set, a elsewhere
+{
+    return _mm_or_si128(_mm_andnot_si128(mask, a), _mm_and_si128(mask, b));
+}
+
+__attribute__((target("sse2")))
+static void lookup8SSE2(rfbCARD8* dest, const rfbCARD8* indices, int count, const rfbCARD8* palette, int paletteSize)
+{
+    int i = 0;
+
+    if (paletteSize <= 4)
+    {
+        const bool    fourColours = (paletteSize > 2);
+        const __m128i one         = _mm_set1_epi8(1);
+        const __m128i two         = _mm_set1_epi8(2);
+        const __m128i pal0        = _mm_set1_epi8((char)palette[0]);
+        const __m128i pal1        = _mm_set1_epi8((char)palette[1]);
+        const __m128i pal2        = _mm_set1_epi8((char)palette[2]);
+        const __m128i pal3        = _mm_set1_epi8((char)palette[3]);
+
+        for ( ; (i + 16) <= count; i += 16)
+        {
+            const __m128i idx = _mm_loadu_si128((const __m128i*)(indices + i));
+            const __m128i odd = _mm_cmpeq_epi8(_mm_and_si128(idx, one), one);
+            __m128i       pix = selectSSE2(odd, pal0, pal1);
+            if (fourColours)
+                pix = selectSSE2(_mm_cmpeq_epi8(_mm_and_si128(idx, two), two), pix, selectSSE2(odd, pal2, pal3));
+            _mm_storeu_si128((__m128i*)(dest + i), pix);
+        }
+    }
+
+    lookup8Scalar(dest + i, indices + i, count - i, palette, paletteSize);
+}
+
+__attribute__((target("sse2")))
+static void lookup16SSE2(rfbCARD16* dest, const rfbCARD8* indices, int count, const rfbCARD16* palette, int paletteSize)
+{
+    int i = 0;
+
+    if (paletteSize <= 4)
+    {
+        const bool    fourColours = (paletteSize > 2);
+        const __m128i zero        = _mm_setzero_si128();
+        const __m128i one         = _mm_set1_epi16(1);
+        const __m128i two         = _mm_set1_epi16(2);
+        const __m128i pal0        = _mm_set1_epi16((short)palette[0]);
+        const __m128i pal1        = _mm_set1_epi16((short)palette[1]);
+        const __m128i pal2        = _mm_set1_epi16((short)palette[2]);
+        const __m128i pal3        = _mm_set1_epi16((short)palette[3]);
+
+        for ( ; (i + 8) <= count; i += 8)
+        {
+            const __m128i idx = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(indices + i)), zero);
+            const __m128i odd = _mm_cmpeq_epi16(_mm_and_si128(idx, one), one);
+            __m128i       pix = selectSSE2(odd, pal0, pal1);
+            if (fourColours)
+                pix = selectSSE2(_mm_cmpeq_epi16(_mm_and_si128(idx, two), two), pix, selectSSE2(odd, pal2, pal3));
+            _mm_storeu_si128((__m128i*)(dest + i), pix);
+        }
+    }
+
+    lookup16Scalar(dest + i, indices + i, count - i, palette, paletteSize);
+}
+
+__attribute__((target("sse2")))
+static void lookup32SSE2(rfbCARD32* dest, const rfbCARD8* indices, int count, const rfbCARD32* palette, int paletteSize)
+{
+    int i = 0;
+
+    if (paletteSize <= 4)
+    {
+        const bool    fourColours = (paletteSize > 2);
+        const __m128i zero        = _mm_setzero_si128();
+        const __m128i one         = _mm_set1_epi32(1);
+        const __m128i two         = _mm_set1_epi32(2);
+        const __m128i pal0        = _mm_set1_epi32((int)palette[0]);
+        const __m128i pal1        = _mm_set1_epi32((int)palette[1]);
+        const __m128i pal2        = _mm_set1_epi32((int)palette[2]);
+        const __m128i pal3        = _mm_set1_epi32((int)palette[3]);
+
+        for ( ; (i + 4) <= count; i += 4)
+        {
+            int packed;
+            memcpy(&packed, indices + i, sizeof(packed));
+            const __m128i idx = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+            const __m128i odd = _mm_cmpeq_epi32(_mm_and_si128(idx, one), one);
+            __m128i       pix = selectSSE2(odd, pal0, pal1);
+            if (fourColours)
+                pix = selectSSE2(_mm_cmpeq_epi32(_mm_and_si128(idx, two), two), pix, selectSSE2(odd, pal2, pal3));
+            _mm_storeu_si128((__m128i*)(dest + i), pix);
+        }
+    }
+
+    lookup32Scalar(dest + i, indices + i, count - i, palette, paletteSize);
+}
+
+__attribute__((target("sse2")))
+static void fillRun8SSE2(rfbCARD8* dest, rfbCARD8 pix, int count)
+{
+    const __m128i v = _mm_set1_epi8((char)pix);
+
+    int i = 0;
+    for ( ; (i + 16) <= count; i += 16)
+        _mm_storeu_si128((__m128i*)(dest + i), v);
+
+    fillRun8Scalar(dest + i, pix, count - i);
+}
+
+__attribute__((target("sse2")))
+static void fillRun16SSE2(rfbCARD16* dest, rfbCARD16 pix, int count)
+{
+    const __m128i v = _mm_set1_epi16((short)pix);
+
+    int i = 0;
+    for ( ; (i + 8) <= count; i += 8)
+        _mm_storeu_si128((__m128i*)(dest + i), v);
+
+    fillRun16Scalar(dest + i, pix, count - i);
+}
+
+__attribute__((target("sse2")))
+static void fillRun32SSE2(rfbCARD32* dest, rfbCARD32 pix, int count)
+{
+    const __m128i v = _mm_set1_epi32((int)pix);
+
+    int i = 0;
+    for ( ; (i + 4) <= count; i += 4)
+        _mm_storeu_si128((__m128i*)(dest + i), v);
+
+    fillRun32Scalar(dest + i, pix, count - i);
+}
+
+__attribute__((target("sse2")))
+static void expandIndicesSSE2(rfbCARD8* indices, const rfbCARD8* packed, int count, int bitsPerIndex)
+{
+    switch (bitsPerIndex)
+    {
+        case 1:
+        {
+            // Each of 2 bytes is spread over 8 lanes, which test one bit each.
+            const __m128i bits = _mm_set_epi8(1, 2, 4, 8, 16, 32, 64, (char)128, 1, 2, 4, 8, 16, 32, 64, (char)128);
+            const __m128i one  = _mm_set1_epi8(1);
+
+            for ( ; count >= 16; count -= 16, indices += 16, packed += 2)
+            {
+                __m128i b = _mm_cvtsi32_si128(packed[0] | (packed[1] << 8));
+                b = _mm_unpacklo_epi8(b, b);
+                b = _mm_unpacklo_epi16(b, b);
+                b = _mm_unpacklo_epi32(b, b);
+                _mm_storeu_si128((__m128i*)indices, _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(b, bits), bits), one));
+            }
+            break;
+        }
+
+        case 2:
+        {
+            // The four fields of each of 8 bytes are interleaved in order.
+            const __m128i mask = _mm_set1_epi8(0x03);
+
+            for ( ; count >= 32; count -= 32, indices += 32, packed += 8)
+            {
+                const __m128i b  = _mm_loadl_epi64((const __m128i*)packed);
+                const __m128i f3 = _mm_and_si128(_mm_srli_epi16(b, 6), mask);
+                const __m128i f2 = _mm_and_si128(_mm_srli_epi16(b, 4), mask);
+                const __m128i f1 = _mm_and_si128(_mm_srli_epi16(b, 2), mask);
+                const __m128i f0 = _mm_and_si128(b, mask);
+                const __m128i hi = _mm_unpacklo_epi8(f3, f2);
+                const __m128i lo = _mm_unpacklo_epi8(f1, f0);
+                _mm_storeu_si128((__m128i*)indices,        _mm_unpacklo_epi16(hi, lo));
+                _mm_storeu_si128((__m128i*)(indices + 16), _mm_unpackhi_epi16(hi, lo));
+            }
+            break;
+        }
+
+        case 4:
+        {
+            // The high and low nibbles of each of 8 bytes are interleaved.
+            const __m128i mask = _mm_set1_epi8(0x0f);
+
+            for ( ; count >= 16; count -= 16, indices += 16, packed += 8)
+            {
+                const __m128i b = _mm_loadl_epi64((const __m128i*)packed);
+                _mm_storeu_si128((__m128i*)indices, _mm_unpacklo_epi8(_mm_and_si128(_mm_srli_epi16(b, 4), mask), _mm_and_si128(b, mask)));
+            }
+            break;
+        }
+    }
+
+    expandIndicesScalar(indices, packed, count, bitsPerIndex);
+}
+
+
+
+//----------------------------------------------------------------------
+// AVX2 kernels.  Palettes of up to 16 entries (i.e., all packed-pixel
+// tiles) fit into registers: byte shuffles look up 8-bit pixels and the
+// low and high bytes of 16-bit pixels, and two 8-entry permutes look up
+// 32-bit pixels.  Larger palettes use the scalar lookup.  A tile row
+// holds at most 64 indices, so unpacking them uses the SSE2 kernel.
+
+__attribute__((target("avx2")))
+static void lookup8AVX2(rfbCARD8* dest, const rfbCARD8* indices, int count, const rfbCARD8* palette, int paletteSize)
+{
+    int i = 0;
+
+    if (paletteSize <= 16)
+    {
+        const __m256i table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)palette));
+
+        for ( ; (i + 32) <= count; i += 32)
+        {
+            const __m256i idx = _mm256_loadu_si256((const __m256i*)(indices + i));
+            _mm256_storeu_si256((__m256i*)(dest + i), _mm256_shuffle_epi8(table, idx));
+        }
+    }
+
+    lookup8Scalar(dest + i, indices + i, count - i, palette, paletteSize);
+}
+
+__attribute__((target("avx2")))
+static void lookup16AVX2(rfbCARD16* dest, const rfbCARD8* indices, int count, const rfbCARD16* palette, int paletteSize)
+{
+    int i = 0;
+
+    if (paletteSize <= 16)
+    {
+        rfbCARD8 lowBytes[16];
+        rfbCARD8 highBytes[16];
+        for (int j = 0; j < 16; j++)
+        {
+            lowBytes[j]  = (rfbCARD8)(palette[j] & 0xff);
+            highBytes[j] = (rfbCARD8)(palette[j] >> 8);
+        }
+
+        const __m256i lowTable  = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)lowBytes));
+        const __m256i highTable = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)highBytes));
+
+        for ( ; (i + 32) <= count; i += 32)
+        {
+            const __m256i idx  = _mm256_loadu_si256((const __m256i*)(indices + i));
+            const __m256i low  = _mm256_shuffle_epi8(lowTable,  idx);
+            const __m256i high = _mm256_shuffle_epi8(highTable, idx);
+
+            // Interleaving works within 128-bit lanes: a holds pixels 0-7 and 16-23, b holds 8-15 and 24-31.
+            const __m256i a = _mm256_unpacklo_epi8(low, high);
+            const __m256i b = _mm256_unpackhi_epi8(low, high);
+            _mm256_storeu_si256((__m256i*)(dest + i),      _mm256_permute2x128_si256(a, b, 0x20));
+            _mm256_storeu_si256((__m256i*)(dest + i + 16), _mm256_permute2x128_si256(a, b, 0x31));
+        }
+    }
+
+    lookup16Scalar(dest + i, indices + i, count - i, palette, paletteSize);
+}
+
+__attribute__((target("avx2")))
+static void lookup32AVX2(rfbCARD32* dest, const rfbCARD8* indices, int count, const rfbCARD32* palette, int paletteSize)
+{
+    int i = 0;
+
+    if (paletteSize <= 16)
+    {
+        const __m256i table0 = _mm256_loadu_si256((const __m256i*)palette);        // entries 0-7
+        const __m256i table1 = _mm256_loadu_si256((const __m256i*)(palette + 8));  // entries 8-15
+        const __m256i seven  = _mm256_set1_epi32(7);
+
+        for ( ; (i + 8) <= count; i += 8)
+        {
+            const __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(indices + i)));
+            const __m256i r0  = _mm256_permutevar8x32_epi32(table0, idx);  // uses the low 3 bits of idx
+            const __m256i r1  = _mm256_permutevar8x32_epi32(table1, idx);
+            _mm256_storeu_si256((__m256i*)(dest + i), _mm256_blendv_epi8(r0, r1, _mm256_cmpgt_epi32(idx, seven)));
+        }
+    }
+
+    lookup32Scalar(dest + i, indices + i, count - i, palette, paletteSize);
+}
+
+__attribute__((target("avx2")))
+static void fillRun8AVX2(rfbCARD8* dest, rfbCARD8 pix, int count)
+{
+    const __m256i v = _mm256_set1_epi8((char)pix);
+
+    int i = 0;
+    for ( ; (i + 32) <= count; i += 32)
+        _mm256_storeu_si256((__m256i*)(dest + i), v);
+
+    fillRun8Scalar(dest + i, pix, count - i);
+}
+
+__attribute__((target("avx2")))
+static void fillRun16AVX2(rfbCARD16* dest, rfbCARD16 pix, int count)
+{
+    const __m256i v = _mm256_set1_epi16((short)pix);
+
+    int i = 0;
+    for ( ; (i + 16) <= count; i += 16)
+        _mm256_storeu_si256((__m256i*)(dest + i), v);
+
+    fillRun16Scalar(dest + i, pix, count - i);
+}
+
+__attribute__((target("avx2")))
+static void fillRun32AVX2(rfbCARD32* dest, rfbCARD32 pix, int count)
+{
+    const __m256i v = _mm256_set1_epi32((int)pix);
+
+    int i = 0;
+    for ( ; (i + 8) <= count; i += 8)
+        _mm256_storeu_si256((__m256i*)(dest + i), v);
+
+    fillRun32Scalar(dest + i, pix, count - i);
+}
+
+#endif  // #ifdef ZRLE_KERNELS_X86
+
+
+
+//----------------------------------------------------------------------
+// ZrleKernels methods
+
+ZrleKernels::Level ZrleKernels::getBestSupportedLevel()  // static method
+{
+#ifdef ZRLE_KERNELS_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+        return LEVEL_AVX2;
+    else if (__builtin_cpu_supports("sse2"))
+        return LEVEL_SSE2;
+#endif
+
+    return LEVEL_SCALAR;
+}
+
+
+
+bool ZrleKernels::setLevel(Level newLevel)  // static method
+{
+    if ((newLevel > getBestSupportedLevel()) || !getKernels(newLevel))
+        return false;
+    else
+    {
+        level   = newLevel;
+        kernels = getKernels(newLevel);
+
+        return true;
+    }
+}
+
+
+
+const char* ZrleKernels::getLevelName(Level l)  // static method
+{
+    switch (l)
+    {
+        case LEVEL_SCALAR: return "scalar";
+        case LEVEL_SSE2:   return "sse2";
+        case LEVEL_AVX2:   return "avx2";
+        default:           return "unknown";
+    }
+}
+
+
+
+bool ZrleKernels::findLevel(const char* name, Level& l)  // static method
+{
+    static const Level levels[] = { LEVEL_SCALAR, LEVEL_SSE2, LEVEL_AVX2 };
+
+    for (size_t i = 0; i < (sizeof(levels)/sizeof(levels[0])); i++)
+        if (name && (strcasecmp(name, getLevelName(levels[i])) == 0))
+        {
+            l = levels[i];
+            return true;
+        }
+
+    return false;
+}
+
+
+
+const ZrleKernels::Kernels* ZrleKernels::getKernels(Level l)  // static method
+{
+    static const Kernels scalarKernels =
+    {
+        lookup8Scalar, lookup16Scalar, lookup32Scalar,
+        fillRun8Scalar, fillRun16Scalar, fillRun32Scalar,
+        expandIndicesScalar
+    };
+
+#ifdef ZRLE_KERNELS_X86
+    static const Kernels sse2Kernels =
+    {
+        lookup8SSE2, lookup16SSE2, lookup32SSE2,
+        fillRun8SSE2, fillRun16SSE2, fillRun32SSE2,
+        expandIndicesSSE2
+    };
+
+    static const Kernels avx2Kernels =
+    {
+        lookup8AVX2, lookup16AVX2, lookup32AVX2,
+        fillRun8AVX2, fillRun16AVX2, fillRun32AVX2,
+        expandIndicesSSE2
+    };
+#endif
+
+    switch (l)
+    {
+        case LEVEL_SCALAR: return &scalarKernels;
+#ifdef ZRLE_KERNELS_X86
+        case LEVEL_SSE2:   return &sse2Kernels;
+        case LEVEL_AVX2:   return &avx2Kernels;
+#endif
+        default:           return 0;
+    }
+}
+
+
+
+ZrleKernels::Level          ZrleKernels::level   = ZrleKernels::getBestSupportedLevel();  // static member
+const ZrleKernels::Kernels* ZrleKernels::kernels = ZrleKernels::getKernels(ZrleKernels::level);  // static member
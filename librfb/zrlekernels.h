@@ -0,0 +1,95 @@
+/*
+ *  zrlekernels.h
+ *
+ *  Copyright (C) 2007 Voltaic.  All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#ifndef __ZRLEKERNELS_H_INCLUDED__
+#define __ZRLEKERNELS_H_INCLUDED__
+
+#include "rfbproto.h"
+
+
+
+namespace rfb
+{
+    //----------------------------------------------------------------------
+    // ZrleKernels holds the inner loops of the ZRLE decoder (see zrle.cppinc),
+    // which the Tight decoder's palette filter (see tight.cppinc) shares.
+    // Each kernel has a portable implementation and, on x86 compilers that
+    // support it, SSE2 and AVX2 implementations.  The best level supported
+    // by the CPU is selected when the program starts; setLevel() selects a
+    // lower one, e.g., to compare decoding rates of a replayed session.
+    // The 24A and 24B pixel variants use the 32-bit kernels.
+    class ZrleKernels
+    {
+    public:
+        enum Level
+        {
+            LEVEL_SCALAR = 0,
+            LEVEL_SSE2,
+            LEVEL_AVX2
+        };
+
+        static Level       getBestSupportedLevel();
+        static Level       getLevel()                 { return level; }
+        static bool        setLevel(Level newLevel);  // fails if newLevel is not supported by the CPU or the compiler
+        static const char* getLevelName(Level l);
+        static bool        findLevel(const char* name, Level& l);  // l is the Level named by name; false if there is none
+
+    public:
+        // expandIndices() unpacks count palette indices of bitsPerIndex
+        // (1, 2 or 4) bits each, most significant bits first, into one byte
+        // each.  packed holds ((count*bitsPerIndex)+7)/8 bytes.
+        static void expandIndices(rfbCARD8* indices, const rfbCARD8* packed, int count, int bitsPerIndex) { kernels->expandIndices(indices, packed, count, bitsPerIndex); }
+
+        // lookup*() set dest[i] to palette[indices[i]].  Indices must be
+        // less than paletteSize; larger ones select some entry among the
+        // first 16 if paletteSize <= 16, and otherwise only their low 7 bits
+        // are used.  palette must have room for at least 16 entries.
+        static void lookup8(rfbCARD8* dest, const rfbCARD8* indices, int count, const rfbCARD8* palette, int paletteSize)    { kernels->lookup8(dest, indices, count, palette, paletteSize);  }
+        static void lookup16(rfbCARD16* dest, const rfbCARD8* indices, int count, const rfbCARD16* palette, int paletteSize) { kernels->lookup16(dest, indices, count, palette, paletteSize); }
+        static void lookup32(rfbCARD32* dest, const rfbCARD8* indices, int count, const rfbCARD32* palette, int paletteSize) { kernels->lookup32(dest, indices, count, palette, paletteSize); }
+
+        // fillRun*() set count pixels starting at dest to pix.
+        static void fillRun8(rfbCARD8* dest, rfbCARD8 pix, int count)    { kernels->fillRun8(dest, pix, count);  }
+        static void fillRun16(rfbCARD16* dest, rfbCARD16 pix, int count) { kernels->fillRun16(dest, pix, count); }
+        static void fillRun32(rfbCARD32* dest, rfbCARD32 pix, int count) { kernels->fillRun32(dest, pix, count); }
+
+    protected:
+        struct Kernels
+        {
+            void (*lookup8)(rfbCARD8* dest, const rfbCARD8* indices, int count, const rfbCARD8* palette, int paletteSize);
+            void (*lookup16)(rfbCARD16* dest, const rfbCARD8* indices, int count, const rfbCARD16* palette, int paletteSize);
+            void (*lookup32)(rfbCARD32* dest, const rfbCARD8* indices, int count, const rfbCARD32* palette, int paletteSize);
+            void (*fillRun8)(rfbCARD8* dest, rfbCARD8 pix, int count);
+            void (*fillRun16)(rfbCARD16* dest, rfbCARD16 pix, int count);
+            void (*fillRun32)(rfbCARD32* dest, rfbCARD32 pix, int count);
+            void (*expandIndices)(rfbCARD8* indices, const rfbCARD8* packed, int count, int bitsPerIndex);
+        };
+
+        static const Kernels* getKernels(Level l);  // 0 if l is not supported
+
+    protected:
+        static Level          level;
+        static const Kernels* kernels;
+    };
+
+}  // end of namespace rfb
+
+#endif  // #ifndef __ZRLEKERNELS_H_INCLUDED__
@@ -28,6 +28,8 @@
 #include <Vrui/Geometry.h>
 #include <Geometry/OrthogonalTransformation.h>
 
+#include "librfb/zrlekernels.h"
+#include "librfb/pixelkernels.h"
 #include "vruivnc.h"
 
 
@@ -42,7 +44,8 @@ vruivnc::vruivnc(int& argc, char**& argv, char**& appDefaults) :
     rfbProtocolStartupData(),
     vncManager(new VncManager(*this, *this, !Vrui::isMaster(), Vrui::openPipe())),
     scaleToEnvironment(true),
-    surfaceMaterial(GLMaterial::Color(1.0f, 1.0f, 1.0f, 0.333f), GLMaterial::Color(0.333f, 0.333f, 0.333f), 10.0f)
+    surfaceMaterial(GLMaterial::Color(1.0f, 1.0f, 1.0f, 0.333f), GLMaterial::Color(0.333f, 0.333f, 0.333f), 10.0f),
+    sessionStartTime()
 {
     // Parse the command line:
     for (int i = 1; i < argc; ++i)
@@ -70,6 +73,58 @@ vruivnc::vruivnc(int& argc, char**& argv, char**& appDefaults) :
                 i++;
                 rfbProtocolStartupData.sharedDesktopFlag = true;
             }
+            else if (strcasecmp(argv[i]+1, "record") == 0)
+            {
+                if (++i < argc)
+                    rfbProtocolStartupData.recordFileName = argv[i];
+                else
+                    std::cout << "Missing file name after " << argv[i-1] << std::endl;
+            }
+            else if (strcasecmp(argv[i]+1, "replay") == 0)
+            {
+                if (++i < argc)
+                    rfbProtocolStartupData.replayFileName = argv[i];
+                else
+                    std::cout << "Missing file name after " << argv[i-1] << std::endl;
+            }
+            else if (strcasecmp(argv[i]+1, "replayRealTime") == 0)
+            {
+                rfbProtocolStartupData.replayRealTime = true;
+            }
+            else if (strcasecmp(argv[i]+1, "adaptiveEncodings") == 0)
+            {
+                rfbProtocolStartupData.adaptiveEncodings = true;
+            }
+            else if (strcasecmp(argv[i]+1, "pixelLayout") == 0)
+            {
+                const char* name = (++i < argc) ? argv[i] : 0;
+                if (!name)
+                    std::cout << "Missing pixel layout after " << argv[i-1] << std::endl;
+                else if (!VncManager::findPixelLayout(name, rfbProtocolStartupData.pixelLayout))
+                    std::cout << "Unrecognized pixel layout " << name << "; using " << VncManager::getPixelLayoutName(rfbProtocolStartupData.pixelLayout) << std::endl;
+            }
+            else if (strcasecmp(argv[i]+1, "zrleKernels") == 0)
+            {
+                rfb::ZrleKernels::Level level;
+                const char* name = (++i < argc) ? argv[i] : 0;
+                if (!name)
+                    std::cout << "Missing ZRLE kernel level after " << argv[i-1] << std::endl;
+                else if (!rfb::ZrleKernels::findLevel(name, level))
+                    std::cout << "Unrecognized ZRLE kernel level " << name << std::endl;
+                else if (!rfb::ZrleKernels::setLevel(level))
+                    std::cout << "ZRLE kernel level " << name << " is not supported; using " << rfb::ZrleKernels::getLevelName(rfb::ZrleKernels::getLevel()) << std::endl;
+            }
+            else if (strcasecmp(argv[i]+1, "pixelKernels") == 0)
+            {
+                rfb::PixelKernels::Level level;
+                const char* name = (++i < argc) ? argv[i] : 0;
+                if (!name)
+                    std::cout << "Missing pixel kernel level after " << argv[i-1] << std::endl;
+                else if (!rfb::PixelKernels::findLevel(name, level))
+                    std::cout << "Unrecognized pixel kernel level " << name << std::endl;
+                else if (!rfb::PixelKernels::setLevel(level))
+                    std::cout << "Pixel kernel level " << name << " is not supported; using " << rfb::PixelKernels::getLevelName(rfb::PixelKernels::getLevel()) << std::endl;
+            }
             else
             {
                 std::cout << "Unrecognized switch " << argv[i] << std::endl;
@@ -297,6 +352,9 @@ void vruivnc::infoAuthenticationResult(bool succeeded, rfbCARD32 authScheme, rfb
 void vruivnc::infoServerInitCompleted(bool succeeded)
 {
     fprintf(stderr, "vruivnc info: RFB protocol: server init completed: succeeded = %d\n", (int)succeeded);
+
+    if (succeeded)
+        sessionStartTime = Misc::Time::now();
 }
 
 
@@ -318,6 +376,34 @@ void vruivnc::infoCloseStarted()
 void vruivnc::infoCloseCompleted()
 {
     fprintf(stderr, "vruivnc info: RFB protocol: close completed\n");
+
+    // Queued actions are performed in order, so by now everything decoded
+    // from the replay has also been handed to the display:
+    if (rfbProtocolStartupData.replayFileName && Vrui::isMaster())
+    {
+        const rfb::RFBProtocol::ReceiveStats stats = vncManager->getRfbReceiveStats();
+
+        const Misc::Time elapsed       = Misc::Time::now() - sessionStartTime;
+        const double     seconds       = (double)elapsed.tv_sec + elapsed.tv_nsec/1.0e9;
+        const double     decodeSeconds = stats.elapsedUsec/1.0e6;
+
+        if ((seconds > 0) && (decodeSeconds > 0))
+        {
+            fprintf(stderr, "vruivnc info: replay: %lld bytes, %lld rectangles, %lld updates\n", stats.bytes, stats.rectangles, stats.updates);
+            fprintf(stderr, "vruivnc info: replay: decode:     %.3f s, %.2f MB/s, %.1f rects/s, %.1f updates/s\n",
+                    decodeSeconds, stats.bytes/decodeSeconds/1.0e6, stats.rectangles/decodeSeconds, stats.updates/decodeSeconds);
+            fprintf(stderr, "vruivnc info: replay: end-to-end: %.3f s, %.2f MB/s, %.1f rects/s, %.1f updates/s\n",
+                    seconds, stats.bytes/seconds/1.0e6, stats.rectangles/seconds, stats.updates/seconds);
+        }
+    }
+}
+
+
+
+void vruivnc::infoEncodingPolicyChanged(const rfb::RFBProtocol::EncodingPolicyStats& stats)
+{
+    fprintf(stderr, "vruivnc info: RFB protocol: encoding policy changed to %s: link %.2f MB/s, decode %.1f ns/pixel, %.3f bytes/pixel\n",
+            rfb::RFBProtocol::GetEncodingPolicyName(stats.policy), stats.linkThroughput/1.0e6, stats.decodeNsecPerPixel, stats.bytesPerPixel);
 }
 
 
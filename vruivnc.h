@@ -24,6 +24,7 @@
 #include <GL/gl.h>
 #include <GL/GLMaterial.h>
 #include <GL/GLObject.h>
+#include <Misc/Time.h>
 #include <Threads/Thread.h>
 #include <Threads/Mutex.h>
 #include <Comm/MulticastPipe.h>
@@ -64,6 +65,7 @@ namespace Voltaic {
         virtual void infoDesktopSizeReceived(rfbCARD16 newWidth, rfbCARD16 newHeight);
         virtual void infoCloseStarted();
         virtual void infoCloseCompleted();
+        virtual void infoEncodingPolicyChanged(const rfb::RFBProtocol::EncodingPolicyStats& stats);
 
         // VncManager::PasswordRetrievalThunk method:
         virtual void getPassword(VncManager::PasswordRetrievalCompletionThunk& passwordRetrievalCompletionThunk);
@@ -73,6 +75,7 @@ namespace Voltaic {
         VncManager* const                  vncManager;
         bool                               scaleToEnvironment;      // flag if the model should be scaled to fit the environment
         GLMaterial                         surfaceMaterial;         // OpenGL material properties for the display surface
+        Misc::Time                         sessionStartTime;        // when infoServerInitCompleted() reported success; for the replay statistics
 
     private:
         // Disable these copiers: